@@ -0,0 +1,127 @@
+#include <chrono>
+#include "accelerator.h"
+#include "task_pool.h"
+
+static double Milliseconds(std::chrono::high_resolution_clock::time_point start, std::chrono::high_resolution_clock::time_point end){
+	return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+std::string BVHAccelerator::Defines() const {
+	std::string defines = " -D USE_BVH";
+	if (settings.stackless) defines += " -D USE_STACKLESS";
+	if (settings.wide) defines += " -D USE_WIDE_BVH -D BVH_WIDTH=" + std::to_string(BVH_WIDTH);
+	return defines;
+}
+
+void BVHAccelerator::Build(const float *verts, const int *faces, int faceCount, TaskPool *pool){
+	collapsed = false;
+	auto buildStart = std::chrono::high_resolution_clock::now();
+	if (settings.spatialSplits){
+		BuildBVHSpatial(bvh, verts, faces, faceCount, settings.splitBudget);
+	}
+	else if (settings.parallel){
+		BuildBVHBinned(bvh, verts, faces, faceCount, pool);
+	}
+	else {
+		BuildBVH(bvh, verts, faces, faceCount);
+	}
+	auto buildEnd = std::chrono::high_resolution_clock::now();
+
+	if (settings.optimizeTreelets){
+		float before = BVHSAHCost(bvh);
+		auto optimizeStart = std::chrono::high_resolution_clock::now();
+		OptimizeBVH(bvh, BVH_TREELET_ROUNDS, pool);
+		auto optimizeEnd = std::chrono::high_resolution_clock::now();
+
+		printf("Treelets: SAH cost %.2f -> %.2f, optimized in %.2f ms\n", before, BVHSAHCost(bvh),
+			Milliseconds(optimizeStart, optimizeEnd));
+	}
+
+	float cost = BVHSAHCost(bvh);
+	double buildMs = Milliseconds(buildStart, buildEnd);
+	printf("BVH: %d nodes, SAH cost %.2f, built in %.2f ms (%.2f ms/Mtri)\n", (int)bvh->nodes.size(), cost,
+		buildMs, faceCount > 0 ? buildMs * 1e6 / faceCount : 0.0);
+
+	// Compare against the object split build it replaces
+	if (settings.spatialSplits){
+		BVH plain;
+		BuildBVHBinned(&plain, verts, faces, faceCount, pool);
+
+		float plainCost = BVHSAHCost(&plain);
+		size_t plainBytes = plain.nodes.size() * sizeof(BVHNode) + plain.triIndices.size() * 4 * sizeof(int);
+		size_t spatialBytes = bvh->nodes.size() * sizeof(BVHNode) + bvh->triIndices.size() * 4 * sizeof(int);
+
+		printf("SBVH: SAH cost %.2f vs %.2f (%.1f%% lower), %d references for %d faces, %.1f KB vs %.1f KB (%.1f%% more)\n",
+			cost, plainCost, plainCost > 0 ? 100.0 * (plainCost - cost) / plainCost : 0.0,
+			(int)bvh->triIndices.size(), faceCount, spatialBytes / 1024.0, plainBytes / 1024.0,
+			plainBytes > 0 ? 100.0 * ((double)spatialBytes - plainBytes) / plainBytes : 0.0);
+	}
+}
+
+DeviceArray BVHAccelerator::Nodes(){
+	DeviceArray nodes = { bvh->nodes.data(), sizeof(BVHNode)*bvh->nodes.size() };
+	if (settings.wide){
+		// A new collapse can open other children, changing the node count
+		if (collapsed) RefitWideBVH(bvh, sources, &wide);
+		else CollapseBVH(bvh, &wide, &sources);
+		collapsed = true;
+
+		nodes.data = wide.data();
+		nodes.size = sizeof(WideBVHNode)*wide.size();
+	}
+	return nodes;
+}
+
+DeviceArray BVHAccelerator::Links(){
+	BVHParents(bvh, &parents);
+	DeviceArray links = { parents.data(), sizeof(int)*parents.size() };
+	return links;
+}
+
+int BVHAccelerator::StackDepth(){
+	if (!settings.wide) return BVHStackDepth(bvh->nodes, 0);
+
+	// The layout Nodes() uploads, collapsed once per build
+	Nodes();
+	return WideBVHStackDepth(wide);
+}
+
+bool BVHAccelerator::Report(int faceCount, FILE *json){
+	size_t nodeBytes = settings.wide ? sizeof(WideBVHNode)*wide.size() : sizeof(BVHNode)*bvh->nodes.size();
+
+	BVHStats stats;
+	ComputeBVHStats(&stats, bvh->nodes, std::vector<int>(1, 0), faceCount, nodeBytes);
+	PrintBVHStats(Name(), stats);
+	return json == NULL || WriteBVHStatsJSON(json, Name(), stats);
+}
+
+std::string GridAccelerator::Defines() const {
+	return " -D USE_GRID -D GRID_MAX_DEPTH=" + std::to_string(GRID_MAX_DEPTH);
+}
+
+void GridAccelerator::Build(const float *verts, const int *faces, int faceCount, TaskPool * /*pool*/){
+	auto buildStart = std::chrono::high_resolution_clock::now();
+	BuildGrid(&grid, verts, faces, faceCount);
+	auto buildEnd = std::chrono::high_resolution_clock::now();
+
+	double buildMs = Milliseconds(buildStart, buildEnd);
+	printf("Grid: %d levels, %d cells, %d references, built in %.2f ms (%.2f ms/Mtri)\n", (int)grid.levels.size(),
+		(int)grid.cells.size(), (int)grid.triIndices.size(), buildMs, faceCount > 0 ? buildMs * 1e6 / faceCount : 0.0);
+}
+
+DeviceArray GridAccelerator::Nodes(){
+	DeviceArray levels = { grid.levels.data(), sizeof(GridLevel)*grid.levels.size() };
+	return levels;
+}
+
+DeviceArray GridAccelerator::Links(){
+	DeviceArray cells = { grid.cells.data(), sizeof(GridCell)*grid.cells.size() };
+	return cells;
+}
+
+bool GridAccelerator::Report(int faceCount, FILE *json){
+	GridStats stats;
+	ComputeGridStats(&stats, &grid, faceCount);
+	PrintGridStats(Name(), stats);
+	return json == NULL || WriteGridStatsJSON(json, Name(), stats);
+}
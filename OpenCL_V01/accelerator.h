@@ -0,0 +1,114 @@
+#ifndef ACCELERATOR_H
+#define ACCELERATOR_H
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "bvh.h"
+#include "grid.h"
+
+class TaskPool;
+
+enum AcceleratorType
+{
+	ACCELERATOR_BVH,
+	ACCELERATOR_GRID
+};
+
+// Host build options of the BVH backend
+struct BVHSettings
+{
+	bool parallel;
+	bool spatialSplits;
+	float splitBudget;
+	bool optimizeTreelets;
+	bool wide; // collapse to WideBVHNode before upload
+	bool stackless;
+};
+
+// Contents of a device buffer, owned by the accelerator
+struct DeviceArray
+{
+	const void *data;
+	size_t size;
+};
+
+// Structure the Filter kernel traverses to find the closest face. Each
+// backend has its own traversal in kernels/image.cl, chosen by Defines()
+// when the program is built.
+class Accelerator
+{
+public:
+	virtual ~Accelerator() {}
+
+	virtual const char *Name() const = 0;
+
+	// -D options for clBuildProgram
+	virtual std::string Defines() const = 0;
+
+	// Build over the arrays from VertsToFloat3/FacesToVerts
+	virtual void Build(const float *verts, const int *faces, int faceCount, TaskPool *pool) = 0;
+
+	// Source face of every face entry the structure indexes, in that order.
+	// Faces can repeat, see GatherFaces.
+	virtual const std::vector<int> &FaceOrder() const = 0;
+
+	// Kernel arguments 5 (nodes) and 6 (links), valid until the next call
+	virtual DeviceArray Nodes() = 0;
+	virtual DeviceArray Links() = 0;
+
+	// Traversal stack entries the kernel needs for Nodes(), 0 without a stack
+	virtual int StackDepth() = 0;
+
+	// Load time stats, also written to json as one object when not NULL
+	virtual bool Report(int faceCount, FILE *json) = 0;
+
+	// Copy of the structure as it is now, to go back to when a rebuild is dropped
+	virtual Accelerator *Clone() const = 0;
+};
+
+class BVHAccelerator : public Accelerator
+{
+public:
+	// bvh is kept by the caller, so it can be refit or loaded from a cache.
+	// Collapsed nodes keep the layout of the first Nodes() after a build,
+	// later calls only requantize it for the refit boxes.
+	BVHAccelerator(BVH *bvh, const BVHSettings &settings) : bvh(bvh), settings(settings), collapsed(false) {}
+
+	const char *Name() const { return settings.wide ? "BVH (collapsed)" : "BVH"; }
+	std::string Defines() const;
+	void Build(const float *verts, const int *faces, int faceCount, TaskPool *pool);
+	const std::vector<int> &FaceOrder() const { return bvh->triIndices; }
+	DeviceArray Nodes();
+	DeviceArray Links();
+	int StackDepth();
+	bool Report(int faceCount, FILE *json);
+	Accelerator *Clone() const { return new BVHAccelerator(*this); }
+
+private:
+	BVH *bvh;
+	BVHSettings settings;
+	std::vector<WideBVHNode> wide;
+	WideBVHSources sources;
+	bool collapsed; // wide and sources match the topology of bvh
+	std::vector<int> parents;
+};
+
+class GridAccelerator : public Accelerator
+{
+public:
+	const char *Name() const { return "Grid"; }
+	std::string Defines() const;
+	void Build(const float *verts, const int *faces, int faceCount, TaskPool *pool);
+	const std::vector<int> &FaceOrder() const { return grid.triIndices; }
+	DeviceArray Nodes();
+	DeviceArray Links();
+	int StackDepth() { return 0; }
+	bool Report(int faceCount, FILE *json);
+	Accelerator *Clone() const { return new GridAccelerator(*this); }
+
+private:
+	Grid grid;
+};
+
+#endif
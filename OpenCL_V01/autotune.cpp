@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <chrono>
+#include "autotune.h"
+#include "bvh_cache.h"
+
+uint64_t KernelKey(const std::string &source, const std::string &options, const char *name){
+	uint64_t hash = HashBytes(FNV_OFFSET, source.data(), source.size());
+	hash = HashBytes(hash, options.data(), options.size());
+	return HashBytes(hash, name, strlen(name));
+}
+
+void CandidateLocalSizes(cl_kernel kernel, cl_device_id device, std::vector<LaunchShape> *candidates){
+	size_t kernelMax = 1, deviceMax = 1, multiple = 1;
+	size_t itemSizes[3] = { 1, 1, 1 };
+	clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &kernelMax, NULL);
+	clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(size_t), &multiple, NULL);
+	clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &deviceMax, NULL);
+	clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(itemSizes), itemSizes, NULL);
+
+	size_t limit = kernelMax < deviceMax ? kernelMax : deviceMax;
+	if (multiple == 0) multiple = 1;
+
+	candidates->clear();
+	LaunchShape shape;
+	shape.local[0] = shape.local[1] = 0;
+	shape.tileSize = 0;
+	candidates->push_back(shape);
+
+	// Powers of two in each direction, groups smaller than the multiple leave lanes idle
+	for (size_t w = 1; w <= TUNE_MAX_LOCAL_WIDTH && w <= itemSizes[0]; w *= 2){
+		for (size_t h = 1; h <= itemSizes[1] && w * h <= limit; h *= 2){
+			size_t size = w * h;
+			if (size % multiple != 0 && size != limit) continue;
+
+			shape.local[0] = w;
+			shape.local[1] = h;
+			candidates->push_back(shape);
+		}
+	}
+}
+
+bool LoadLaunchShape(const char *path, const std::string &device, uint64_t key, LaunchShape *shape){
+	FILE *file = fopen(path, "r");
+	if (file == NULL) return false;
+
+	bool found = false;
+	char line[1024];
+	while (!found && fgets(line, sizeof(line), file) != NULL){
+		// device name, tab, then the key and the shape
+		char *tab = strchr(line, '\t');
+		if (tab == NULL || device.compare(0, std::string::npos, line, tab - line) != 0) continue;
+
+		uint64_t lineKey = 0;
+		unsigned long localX = 0, localY = 0;
+		int tileSize = 0;
+		if (sscanf(tab + 1, "%" SCNx64 "\t%lu\t%lu\t%d", &lineKey, &localX, &localY, &tileSize) == 4 && lineKey == key){
+			shape->local[0] = localX;
+			shape->local[1] = localY;
+			shape->tileSize = tileSize;
+			found = true;
+		}
+	}
+
+	fclose(file);
+	return found;
+}
+
+bool SaveLaunchShape(const char *path, const std::string &device, uint64_t key, const LaunchShape &shape, double ms){
+	// Keep every other entry
+	std::vector<std::string> lines;
+	FILE *file = fopen(path, "r");
+	if (file != NULL){
+		char line[1024];
+		char prefix[64];
+		snprintf(prefix, sizeof(prefix), "\t%016" PRIx64 "\t", key);
+		std::string ownPrefix = device + prefix;
+
+		while (fgets(line, sizeof(line), file) != NULL){
+			if (strncmp(line, ownPrefix.c_str(), ownPrefix.size()) != 0) lines.push_back(line);
+		}
+		fclose(file);
+	}
+
+	std::string tempPath = std::string(path) + ".tmp";
+	file = fopen(tempPath.c_str(), "w");
+	if (file == NULL){
+		printf("Autotune: can not write %s\n", tempPath.c_str());
+		return false;
+	}
+
+	bool ok = true;
+	for (size_t i = 0; i < lines.size(); i++){
+		ok = ok && fputs(lines[i].c_str(), file) >= 0;
+	}
+	ok = ok && fprintf(file, "%s\t%016" PRIx64 "\t%lu\t%lu\t%d\t%.3f\n", device.c_str(), key,
+		(unsigned long)shape.local[0], (unsigned long)shape.local[1], shape.tileSize, ms) > 0;
+	ok = fclose(file) == 0 && ok;
+
+	if (ok){
+		remove(path);
+		ok = rename(tempPath.c_str(), path) == 0;
+	}
+	if (!ok){
+		printf("Autotune: failed to write %s\n", path);
+		remove(tempPath.c_str());
+	}
+	return ok;
+}
+
+// Mean ms of TUNE_RUNS frames after a warm-up, negative when the shape fails
+static double TimeShape(cl_command_queue queue, const LaunchShape &shape, const std::function<int(const LaunchShape &)> &render){
+	if (render(shape) != CL_SUCCESS || clFinish(queue) != CL_SUCCESS) return -1;
+
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int run = 0; run < TUNE_RUNS; run++){
+		if (render(shape) != CL_SUCCESS) return -1;
+	}
+	if (clFinish(queue) != CL_SUCCESS) return -1;
+	auto end = std::chrono::high_resolution_clock::now();
+
+	return std::chrono::duration<double, std::milli>(end - start).count() / TUNE_RUNS;
+}
+
+// Tiles must hold whole work-groups, or edge groups would reach into the next tile
+static bool FitsTile(const LaunchShape &shape){
+	if (shape.tileSize <= 0 || shape.local[0] == 0) return true;
+	return shape.tileSize % shape.local[0] == 0 && shape.tileSize % shape.local[1] == 0;
+}
+
+static void PrintShape(const LaunchShape &shape, double ms){
+	if (shape.local[0] == 0) printf("Autotune: local driver");
+	else printf("Autotune: local %dx%d", (int)shape.local[0], (int)shape.local[1]);
+
+	if (shape.tileSize > 0) printf(", tile %d", shape.tileSize);
+	if (ms < 0) printf(": failed\n");
+	else printf(": %.3f ms\n", ms);
+}
+
+cl_int TuneLaunchShape(cl_command_queue queue, const std::vector<LaunchShape> &candidates, const std::vector<int> &tileSizes,
+	const std::function<int(const LaunchShape &)> &render, LaunchShape *best, double *bestMs){
+	*bestMs = -1;
+	for (size_t i = 0; i < candidates.size(); i++){
+		LaunchShape shape = candidates[i];
+		if (!tileSizes.empty()) shape.tileSize = tileSizes[0];
+		if (!FitsTile(shape)) continue;
+
+		double ms = TimeShape(queue, shape, render);
+		PrintShape(shape, ms);
+		if (ms >= 0 && (*bestMs < 0 || ms < *bestMs)){
+			*best = shape;
+			*bestMs = ms;
+		}
+	}
+	if (*bestMs < 0) return CL_INVALID_WORK_GROUP_SIZE;
+
+	for (size_t i = 1; i < tileSizes.size(); i++){
+		LaunchShape shape = *best;
+		shape.tileSize = tileSizes[i];
+		if (!FitsTile(shape)) continue;
+
+		double ms = TimeShape(queue, shape, render);
+		PrintShape(shape, ms);
+		if (ms >= 0 && ms < *bestMs){
+			*best = shape;
+			*bestMs = ms;
+		}
+	}
+	return CL_SUCCESS;
+}
@@ -0,0 +1,46 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#ifdef __APPLE__
+#include "OpenCL/opencl.h"
+#else
+#include "CL/cl.h"
+#endif
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+#define TUNE_FILE "worksizes.txt" // one line per device and kernel
+#define TUNE_RUNS 4 // timed frames per candidate, after one warm-up frame
+#define TUNE_MAX_LOCAL_WIDTH 64
+
+// How the Filter kernel is launched. local[0] == 0 leaves the work-group
+// size to the driver, tileSize only matters for tiled frames.
+struct LaunchShape
+{
+	size_t local[2];
+	int tileSize;
+};
+
+// Key of a compiled kernel, changes with its source and build options
+uint64_t KernelKey(const std::string &source, const std::string &options, const char *name);
+
+// 2D work-group shapes the kernel can run with on device, sizes are
+// multiples of CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE within the
+// kernel and device limits. The driver's choice is always the first.
+void CandidateLocalSizes(cl_kernel kernel, cl_device_id device, std::vector<LaunchShape> *candidates);
+
+// True when path holds a shape tuned for this device and key
+bool LoadLaunchShape(const char *path, const std::string &device, uint64_t key, LaunchShape *shape);
+
+// Replaces the entry of this device and key, other entries are kept
+bool SaveLaunchShape(const char *path, const std::string &device, uint64_t key, const LaunchShape &shape, double ms);
+
+// Time render, which enqueues one frame, with every candidate and then
+// with the tile sizes the best local size divides. tileSizes may be
+// empty for untiled frames. Returns the fastest shape and its mean ms.
+cl_int TuneLaunchShape(cl_command_queue queue, const std::vector<LaunchShape> &candidates, const std::vector<int> &tileSizes,
+	const std::function<int(const LaunchShape &)> &render, LaunchShape *best, double *bestMs);
+
+#endif
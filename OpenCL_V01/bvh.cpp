@@ -0,0 +1,253 @@
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "bvh.h"
+
+struct BuildTask
+{
+	int node;
+	int first;
+	int count;
+};
+
+struct CentroidLess
+{
+	const float *centroids;
+	int axis;
+
+	bool operator()(int a, int b) const
+	{
+		float ca = centroids[3 * a + axis];
+		float cb = centroids[3 * b + axis];
+		if (ca != cb) return ca < cb;
+		return a < b;
+	}
+};
+
+static void SetNodeBounds(BVHNode *node, const AABB &box){
+	for (int k = 0; k < 3; k++){
+		node->bmin[k] = box.bmin[k];
+		node->bmax[k] = box.bmax[k];
+	}
+}
+
+static AABB NodeBounds(const BVHNode &node){
+	AABB box;
+	for (int k = 0; k < 3; k++){
+		box.bmin[k] = node.bmin[k];
+		box.bmax[k] = node.bmax[k];
+	}
+	return box;
+}
+
+void BuildBVH(BVH *bvh, const float *verts, const int *faces, int faceCount){
+	// Per triangle bounds
+	std::vector<AABB> boxes(faceCount);
+
+	for (int i = 0; i < faceCount; i++){
+		for (int v = 0; v < 3; v++){
+			boxes[i].Grow(&verts[3 * faces[3 * i + v]]);
+		}
+	}
+
+	BuildBVHFromBoxes(bvh, boxes.data(), faceCount);
+}
+
+void BuildBVHFromBoxes(BVH *bvh, const AABB *boxes, int faceCount){
+	bvh->nodes.clear();
+	bvh->triIndices.resize(faceCount);
+
+	std::vector<float> centroids(faceCount * 3);
+
+	for (int i = 0; i < faceCount; i++){
+		for (int k = 0; k < 3; k++){
+			centroids[3 * i + k] = 0.5f * (boxes[i].bmin[k] + boxes[i].bmax[k]);
+		}
+		bvh->triIndices[i] = i;
+	}
+
+	bvh->nodes.reserve(faceCount > 0 ? 2 * faceCount - 1 : 1);
+	bvh->nodes.push_back(BVHNode());
+
+	// Empty scene, leave an inverted root box that every ray misses
+	if (faceCount == 0){
+		SetNodeBounds(&bvh->nodes[0], AABB());
+		bvh->nodes[0].leftFirst = 0;
+		bvh->nodes[0].count = 0;
+		return;
+	}
+
+	int *tris = bvh->triIndices.data();
+	std::vector<int> sorted(faceCount);
+	std::vector<float> rightArea(faceCount);
+
+	std::vector<BuildTask> tasks;
+	BuildTask root = { 0, 0, faceCount };
+	tasks.push_back(root);
+
+	while (!tasks.empty()){
+		BuildTask task = tasks.back();
+		tasks.pop_back();
+
+		AABB box;
+		for (int i = task.first; i < task.first + task.count; i++){
+			box.Grow(boxes[tris[i]]);
+		}
+		SetNodeBounds(&bvh->nodes[task.node], box);
+
+		// Sweep every axis for the cheapest split
+		float nodeArea = box.Area();
+		float bestCost = 1e30f;
+		int bestAxis = -1;
+		int bestSplit = 0;
+
+		if (task.count > 1){
+			for (int axis = 0; axis < 3; axis++){
+				CentroidLess less = { centroids.data(), axis };
+				memcpy(sorted.data(), tris + task.first, task.count * sizeof(int));
+				std::sort(sorted.begin(), sorted.begin() + task.count, less);
+
+				AABB right;
+				for (int i = task.count - 1; i > 0; i--){
+					right.Grow(boxes[sorted[i]]);
+					rightArea[i] = right.Area();
+				}
+
+				AABB left;
+				for (int i = 1; i < task.count; i++){
+					left.Grow(boxes[sorted[i - 1]]);
+					float cost = left.Area() * i + rightArea[i] * (task.count - i);
+					if (cost < bestCost){
+						bestCost = cost;
+						bestAxis = axis;
+						bestSplit = i;
+					}
+				}
+			}
+
+			if (nodeArea > 0){
+				bestCost = BVH_TRAVERSAL_COST + BVH_INTERSECT_COST * bestCost / nodeArea;
+			}
+			else {
+				// Flat or degenerate box, fall back to a median split
+				bestCost = 0;
+				bestSplit = task.count / 2;
+			}
+		}
+
+		float leafCost = BVH_INTERSECT_COST * task.count;
+		if (bestAxis < 0 || (bestCost >= leafCost && task.count <= BVH_MAX_LEAF_SIZE)){
+			bvh->nodes[task.node].leftFirst = task.first;
+			bvh->nodes[task.node].count = task.count;
+			continue;
+		}
+
+		CentroidLess less = { centroids.data(), bestAxis };
+		std::sort(tris + task.first, tris + task.first + task.count, less);
+
+		int left = (int)bvh->nodes.size();
+		bvh->nodes.push_back(BVHNode());
+		bvh->nodes.push_back(BVHNode());
+		bvh->nodes[task.node].leftFirst = left;
+		bvh->nodes[task.node].count = 0;
+
+		BuildTask leftTask = { left, task.first, bestSplit };
+		BuildTask rightTask = { left + 1, task.first + bestSplit, task.count - bestSplit };
+		tasks.push_back(rightTask);
+		tasks.push_back(leftTask);
+	}
+}
+
+void ReorderFaces(const BVH *bvh, int *faces, int *faceMats, int faceCount){
+	int *oldFaces = (int*)malloc(faceCount * 3 * sizeof(int));
+	int *oldMats = (int*)malloc(faceCount * sizeof(int));
+	memcpy(oldFaces, faces, faceCount * 3 * sizeof(int));
+	memcpy(oldMats, faceMats, faceCount * sizeof(int));
+
+	for (int i = 0; i < faceCount; i++){
+		int src = bvh->triIndices[i];
+		for (int k = 0; k < 3; k++){
+			faces[3 * i + k] = oldFaces[3 * src + k];
+		}
+		faceMats[i] = oldMats[src];
+	}
+
+	free(oldFaces);
+	free(oldMats);
+}
+
+void GatherFaces(const std::vector<int> &order, const int *faces, const int *faceMats, std::vector<int> *leafFaces, std::vector<int> *leafMats){
+	leafFaces->resize(order.size() * 3);
+	leafMats->resize(order.size());
+
+	for (size_t i = 0; i < order.size(); i++){
+		int src = order[i];
+		for (int k = 0; k < 3; k++){
+			(*leafFaces)[3 * i + k] = faces[3 * src + k];
+		}
+		(*leafMats)[i] = faceMats[src];
+	}
+}
+
+float BVHSAHCost(const BVH *bvh){
+	if (bvh->nodes.empty()) return 0;
+
+	float rootArea = NodeBounds(bvh->nodes[0]).Area();
+	if (rootArea <= 0) return 0;
+
+	float cost = 0;
+	for (size_t i = 0; i < bvh->nodes.size(); i++){
+		const BVHNode &node = bvh->nodes[i];
+		float area = NodeBounds(node).Area() / rootArea;
+		if (node.count > 0){
+			cost += BVH_INTERSECT_COST * node.count * area;
+		}
+		else {
+			cost += BVH_TRAVERSAL_COST * area;
+		}
+	}
+
+	return cost;
+}
+
+void BVHParents(const BVH *bvh, std::vector<int> *parents){
+	parents->assign(bvh->nodes.size(), -1);
+
+	for (size_t i = 0; i < bvh->nodes.size(); i++){
+		const BVHNode &node = bvh->nodes[i];
+		if (node.count > 0 || bvh->nodes.size() < 2) continue;
+
+		(*parents)[node.leftFirst] = (int)i;
+		(*parents)[node.leftFirst + 1] = (int)i;
+	}
+}
+
+// Stack needs come bottom-up, so children are resolved before their parent
+int BVHStackDepth(const std::vector<BVHNode> &nodes, int root){
+	// An empty scene has a root without children, which no ray enters
+	if (nodes.size() < 2) return 1;
+
+	std::vector<int> need(nodes.size(), 0);
+	std::vector<int> stack(1, root);
+	while (!stack.empty()){
+		int index = stack.back();
+		const BVHNode &node = nodes[index];
+		if (node.count > 0){
+			need[index] = 1;
+			stack.pop_back();
+			continue;
+		}
+
+		int left = node.leftFirst;
+		if (need[left] == 0 || need[left + 1] == 0){
+			if (need[left] == 0) stack.push_back(left);
+			if (need[left + 1] == 0) stack.push_back(left + 1);
+			continue;
+		}
+
+		// The sibling waits below whichever child is walked first
+		need[index] = 1 + (need[left] > need[left + 1] ? need[left] : need[left + 1]);
+		stack.pop_back();
+	}
+	return need[root];
+}
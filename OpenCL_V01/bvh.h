@@ -0,0 +1,187 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <stdio.h>
+#include <vector>
+
+#define BVH_MAX_LEAF_SIZE 8
+#define BVH_TRAVERSAL_COST 1.0f
+#define BVH_INTERSECT_COST 1.0f
+
+#define BVH_BIN_COUNT 16
+#define BVH_PARALLEL_SIZE 65536 // nodes this large bin across the whole pool
+#define BVH_TASK_SIZE 1024 // subtrees this large become their own task
+
+#define BVH_WIDTH 8 // children per collapsed node, 4 or 8
+
+#define SBVH_BIN_COUNT 32
+#define SBVH_OVERLAP_ALPHA 1e-5f // child overlap (relative to the root) that enables spatial splits
+
+#define BVH_TREELET_LEAVES 7 // leaves per restructured treelet, at most 8
+#define BVH_TREELET_ROUNDS 3
+
+#define BVH_REFIT_CHECK_INTERVAL 8 // device refits between SAH cost readbacks
+
+class TaskPool;
+
+// Flattened node, mirrored by BVHNode in kernels/image.cl (32 bytes).
+// Interior nodes keep their left child index in leftFirst with the right
+// child directly after it, leaves keep their first triangle and count > 0.
+struct BVHNode
+{
+	float bmin[3];
+	int leftFirst;
+	float bmax[3];
+	int count;
+};
+
+// Collapsed node, mirrored by WideBVHNode in kernels/image.cl. Child
+// boxes are stored in 8 bits per plane relative to origin and scale.
+// A child is a leaf when count > 0 (child is then its first triangle),
+// an inner node when child >= 0 and count == 0, and empty otherwise.
+// Slot s holds the child rays of octant s should visit first.
+struct WideBVHNode
+{
+	float origin[3];
+	float scale[3];
+	int child[BVH_WIDTH];
+	unsigned char qmin[3][BVH_WIDTH];
+	unsigned char qmax[3][BVH_WIDTH];
+	unsigned char count[BVH_WIDTH];
+};
+
+struct AABB
+{
+	float bmin[3];
+	float bmax[3];
+
+	AABB() { Reset(); }
+
+	void Reset()
+	{
+		for (int k = 0; k < 3; k++){
+			bmin[k] = 1e30f;
+			bmax[k] = -1e30f;
+		}
+	}
+
+	void Grow(const float *p)
+	{
+		for (int k = 0; k < 3; k++){
+			if (p[k] < bmin[k]) bmin[k] = p[k];
+			if (p[k] > bmax[k]) bmax[k] = p[k];
+		}
+	}
+
+	void Grow(const AABB &b)
+	{
+		for (int k = 0; k < 3; k++){
+			if (b.bmin[k] < bmin[k]) bmin[k] = b.bmin[k];
+			if (b.bmax[k] > bmax[k]) bmax[k] = b.bmax[k];
+		}
+	}
+
+	float Area() const
+	{
+		float e[3];
+		for (int k = 0; k < 3; k++){
+			e[k] = bmax[k] - bmin[k];
+			if (e[k] < 0) return 0;
+		}
+		return 2.0f * (e[0] * e[1] + e[1] * e[2] + e[2] * e[0]);
+	}
+};
+
+struct BVH
+{
+	std::vector<BVHNode> nodes;
+	std::vector<int> triIndices; // leaf order -> original face index
+};
+
+// Full-sweep SAH build over the arrays from VertsToFloat3/FacesToVerts
+void BuildBVH(BVH *bvh, const float *verts, const int *faces, int faceCount);
+
+// Same build over arbitrary boxes, triIndices then index the boxes
+void BuildBVHFromBoxes(BVH *bvh, const AABB *boxes, int faceCount);
+
+// Binned SAH build, subtrees are split into tasks on the pool
+void BuildBVHBinned(BVH *bvh, const float *verts, const int *faces, int faceCount, TaskPool *pool);
+
+// SAH build that also splits space, clipping triangles that straddle the
+// plane. Up to splitBudget * faceCount extra references are made, so
+// triIndices can name a face more than once (see GatherFaces).
+void BuildBVHSpatial(BVH *bvh, const float *verts, const int *faces, int faceCount, float splitBudget);
+
+// Rebuild small treelets bottom-up with their cheapest SAH topology.
+// Leaves and their faces are left as they are.
+void OptimizeBVH(BVH *bvh, int rounds, TaskPool *pool);
+
+// Copy of faces and materials in the order a structure indexes them, one
+// entry per source face index in order (BVH::triIndices for a BVH)
+void GatherFaces(const std::vector<int> &order, const int *faces, const int *faceMats, std::vector<int> *leafFaces, std::vector<int> *leafMats);
+
+// Put faces and their materials in leaf order so leaves index them directly
+void ReorderFaces(const BVH *bvh, int *faces, int *faceMats, int faceCount);
+
+// Recompute every box bottom-up after the vertices moved. Topology and the
+// leaf order of faces are kept, pool may be NULL to refit on this thread.
+void RefitBVH(BVH *bvh, const float *verts, const int *faces, TaskPool *pool);
+
+float BVHSAHCost(const BVH *bvh);
+
+// Parent of every node (-1 for the root), used by stackless traversal.
+// Left children always sit at odd indices, so siblings need no storage.
+void BVHParents(const BVH *bvh, std::vector<int> *parents);
+
+// Binary nodes a collapse took each wide node and slot from, so a refit
+// can requantize the same layout instead of collapsing again
+struct WideBVHSources
+{
+	std::vector<int> nodes; // box of each wide node, -1 for an empty scene
+	std::vector<int> children; // BVH_WIDTH per wide node, -1 for empty slots
+};
+
+// Collapse a binary BVH into BVH_WIDTH wide nodes with quantized boxes.
+// Which children are opened depends on their boxes, so sources (may be
+// NULL) keep the layout for RefitWideBVH.
+void CollapseBVH(const BVH *bvh, std::vector<WideBVHNode> *wide, WideBVHSources *sources);
+
+// Requantize wide after bvh was refit. Node count, slots and stack depth
+// stay those of the collapse that filled sources.
+void RefitWideBVH(const BVH *bvh, const WideBVHSources &sources, std::vector<WideBVHNode> *wide);
+
+// Most entries the traversal stack holds walking the tree below root, which
+// pushes every child it enters. kernels/image.cl sizes BVH_STACK_SIZE by it.
+int BVHStackDepth(const std::vector<BVHNode> &nodes, int root);
+
+// The same for collapsed nodes from the root, only inner children are pushed
+int WideBVHStackDepth(const std::vector<WideBVHNode> &nodes);
+
+#define BVH_STATS_HISTOGRAM (BVH_MAX_LEAF_SIZE + 2) // last bucket holds larger leaves
+
+struct BVHStats
+{
+	int treeCount; // roots, more than one for the BLAS of a two-level scene
+	int nodeCount;
+	int innerCount;
+	int leafCount;
+	int refCount; // leaf entries, above faceCount when faces are split
+	int faceCount;
+	int leafHistogram[BVH_STATS_HISTOGRAM];
+	int maxDepth;
+	float averageLeafDepth;
+	float sahCost; // mean over roots, each relative to its root area
+	float averageOverlap; // child box overlap relative to the parent area
+	float overlapCost; // child overlap areas relative to the root area
+	size_t nodeBytes;
+	size_t faceBytes;
+	float bytesPerFace;
+};
+
+// Stats over the trees below roots. nodeBytes is what the device holds,
+// which differs from nodes.size() for collapsed layouts.
+void ComputeBVHStats(BVHStats *stats, const std::vector<BVHNode> &nodes, const std::vector<int> &roots, int faceCount, size_t nodeBytes);
+void PrintBVHStats(const char *name, const BVHStats &stats);
+bool WriteBVHStatsJSON(FILE *file, const char *name, const BVHStats &stats);
+
+#endif
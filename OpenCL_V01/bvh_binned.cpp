@@ -0,0 +1,276 @@
+#include <algorithm>
+#include <atomic>
+#include "bvh.h"
+#include "task_pool.h"
+
+struct Bin
+{
+	AABB box;
+	int count;
+};
+
+struct BinSet
+{
+	Bin bins[3][BVH_BIN_COUNT];
+
+	void Reset()
+	{
+		for (int axis = 0; axis < 3; axis++){
+			for (int b = 0; b < BVH_BIN_COUNT; b++){
+				bins[axis][b].box.Reset();
+				bins[axis][b].count = 0;
+			}
+		}
+	}
+
+	void Merge(const BinSet &other)
+	{
+		for (int axis = 0; axis < 3; axis++){
+			for (int b = 0; b < BVH_BIN_COUNT; b++){
+				bins[axis][b].box.Grow(other.bins[axis][b].box);
+				bins[axis][b].count += other.bins[axis][b].count;
+			}
+		}
+	}
+};
+
+struct BinnedBuilder
+{
+	BVH *bvh;
+	TaskPool *pool;
+	std::vector<AABB> boxes;
+	std::vector<float> centroids;
+	std::atomic<int> nodeCount;
+	std::atomic<int> pending;
+
+	void BuildSubtree(int node, int first, int count);
+
+	// Node bounds and centroid bounds of a range
+	void RangeBounds(int first, int count, AABB *box, AABB *centroidBox)
+	{
+		const int *tris = bvh->triIndices.data();
+
+		if (count < BVH_PARALLEL_SIZE){
+			for (int i = first; i < first + count; i++){
+				box->Grow(boxes[tris[i]]);
+				centroidBox->Grow(&centroids[3 * tris[i]]);
+			}
+			return;
+		}
+
+		int grain = ChunkSize(count);
+		int chunks = (count + grain - 1) / grain;
+		std::vector<AABB> chunkBoxes(chunks), chunkCentroids(chunks);
+
+		pool->ParallelFor(first, first + count, grain, [&](int begin, int end){
+			int c = (begin - first) / grain;
+			for (int i = begin; i < end; i++){
+				chunkBoxes[c].Grow(boxes[tris[i]]);
+				chunkCentroids[c].Grow(&centroids[3 * tris[i]]);
+			}
+		});
+
+		for (int c = 0; c < chunks; c++){
+			box->Grow(chunkBoxes[c]);
+			centroidBox->Grow(chunkCentroids[c]);
+		}
+	}
+
+	// Fill bins for all three axes at once
+	void BinRange(int first, int count, const AABB &centroidBox, BinSet *result)
+	{
+		const int *tris = bvh->triIndices.data();
+		result->Reset();
+
+		if (count < BVH_PARALLEL_SIZE){
+			BinTris(tris, first, first + count, centroidBox, result);
+			return;
+		}
+
+		int grain = ChunkSize(count);
+		int chunks = (count + grain - 1) / grain;
+		std::vector<BinSet> chunkBins(chunks);
+
+		pool->ParallelFor(first, first + count, grain, [&](int begin, int end){
+			BinSet &local = chunkBins[(begin - first) / grain];
+			local.Reset();
+			BinTris(tris, begin, end, centroidBox, &local);
+		});
+
+		for (int c = 0; c < chunks; c++){
+			result->Merge(chunkBins[c]);
+		}
+	}
+
+	void BinTris(const int *tris, int begin, int end, const AABB &centroidBox, BinSet *result)
+	{
+		for (int i = begin; i < end; i++){
+			int t = tris[i];
+			for (int axis = 0; axis < 3; axis++){
+				int b = BinIndex(centroidBox, axis, centroids[3 * t + axis]);
+				result->bins[axis][b].box.Grow(boxes[t]);
+				result->bins[axis][b].count++;
+			}
+		}
+	}
+
+	static int BinIndex(const AABB &centroidBox, int axis, float c)
+	{
+		float extent = centroidBox.bmax[axis] - centroidBox.bmin[axis];
+		if (extent <= 0) return 0;
+
+		int b = (int)((c - centroidBox.bmin[axis]) * (BVH_BIN_COUNT / extent));
+		return std::min(std::max(b, 0), BVH_BIN_COUNT - 1);
+	}
+
+	int ChunkSize(int count)
+	{
+		return std::max(count / (pool->ThreadCount() * 4), 4096);
+	}
+};
+
+void BinnedBuilder::BuildSubtree(int rootNode, int rootFirst, int rootCount){
+	int *tris = bvh->triIndices.data();
+
+	struct Range { int node, first, count; };
+	std::vector<Range> stack;
+	Range start = { rootNode, rootFirst, rootCount };
+	stack.push_back(start);
+
+	while (!stack.empty()){
+		Range r = stack.back();
+		stack.pop_back();
+
+		AABB box, centroidBox;
+		RangeBounds(r.first, r.count, &box, &centroidBox);
+
+		BVHNode &node = bvh->nodes[r.node];
+		for (int k = 0; k < 3; k++){
+			node.bmin[k] = box.bmin[k];
+			node.bmax[k] = box.bmax[k];
+		}
+
+		// Evaluate the plane between every pair of bins
+		float bestCost = 1e30f;
+		int bestAxis = -1;
+		int bestSplit = 0;
+
+		if (r.count > 1){
+			BinSet bins;
+			BinRange(r.first, r.count, centroidBox, &bins);
+
+			for (int axis = 0; axis < 3; axis++){
+				if (centroidBox.bmax[axis] - centroidBox.bmin[axis] <= 0) continue;
+
+				float rightArea[BVH_BIN_COUNT];
+				int rightCount[BVH_BIN_COUNT];
+				AABB right;
+				int count = 0;
+				for (int b = BVH_BIN_COUNT - 1; b > 0; b--){
+					right.Grow(bins.bins[axis][b].box);
+					count += bins.bins[axis][b].count;
+					rightArea[b] = right.Area();
+					rightCount[b] = count;
+				}
+
+				AABB left;
+				count = 0;
+				for (int b = 1; b < BVH_BIN_COUNT; b++){
+					left.Grow(bins.bins[axis][b - 1].box);
+					count += bins.bins[axis][b - 1].count;
+					if (count == 0 || rightCount[b] == 0) continue;
+
+					float cost = left.Area() * count + rightArea[b] * rightCount[b];
+					if (cost < bestCost){
+						bestCost = cost;
+						bestAxis = axis;
+						bestSplit = b;
+					}
+				}
+			}
+
+			float nodeArea = box.Area();
+			if (bestAxis >= 0 && nodeArea > 0){
+				bestCost = BVH_TRAVERSAL_COST + BVH_INTERSECT_COST * bestCost / nodeArea;
+			}
+		}
+
+		float leafCost = BVH_INTERSECT_COST * r.count;
+		int leftCount;
+
+		if (r.count == 1 || (bestCost >= leafCost && r.count <= BVH_MAX_LEAF_SIZE)){
+			node.leftFirst = r.first;
+			node.count = r.count;
+			continue;
+		}
+		else if (bestAxis < 0){
+			// Every centroid in the same spot, split the range in half
+			leftCount = r.count / 2;
+		}
+		else {
+			int *mid = std::partition(tris + r.first, tris + r.first + r.count, [&](int t){
+				return BinIndex(centroidBox, bestAxis, centroids[3 * t + bestAxis]) < bestSplit;
+			});
+			leftCount = (int)(mid - (tris + r.first));
+		}
+
+		int left = nodeCount.fetch_add(2);
+		node.leftFirst = left;
+		node.count = 0;
+
+		Range children[2] = {
+			{ left, r.first, leftCount },
+			{ left + 1, r.first + leftCount, r.count - leftCount }
+		};
+
+		// Large subtrees go to the pool, the rest stay on this thread
+		for (int c = 1; c >= 0; c--){
+			if (children[c].count >= BVH_TASK_SIZE){
+				Range child = children[c];
+				pending++;
+				pool->Submit([this, child] { BuildSubtree(child.node, child.first, child.count); }, &pending);
+			}
+			else {
+				stack.push_back(children[c]);
+			}
+		}
+	}
+}
+
+void BuildBVHBinned(BVH *bvh, const float *verts, const int *faces, int faceCount, TaskPool *pool){
+	if (faceCount == 0){
+		BuildBVH(bvh, verts, faces, faceCount);
+		return;
+	}
+
+	BinnedBuilder builder;
+	builder.bvh = bvh;
+	builder.pool = pool;
+	builder.boxes.resize(faceCount);
+	builder.centroids.resize(faceCount * 3);
+	builder.nodeCount = 1;
+	builder.pending = 0;
+
+	bvh->triIndices.resize(faceCount);
+	bvh->nodes.resize(2 * faceCount - 1);
+
+	// Per triangle bounds and centroids
+	pool->ParallelFor(0, faceCount, 4096, [&](int begin, int end){
+		for (int i = begin; i < end; i++){
+			AABB &box = builder.boxes[i];
+			box.Reset();
+			for (int v = 0; v < 3; v++){
+				box.Grow(&verts[3 * faces[3 * i + v]]);
+			}
+			for (int k = 0; k < 3; k++){
+				builder.centroids[3 * i + k] = 0.5f * (box.bmin[k] + box.bmax[k]);
+			}
+			bvh->triIndices[i] = i;
+		}
+	});
+
+	builder.BuildSubtree(0, 0, faceCount);
+	pool->WaitFor(&builder.pending);
+
+	bvh->nodes.resize(builder.nodeCount);
+}
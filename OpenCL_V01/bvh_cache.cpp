@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <string.h>
+#include "bvh_cache.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+struct CacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t nodeSize; // catches a changed BVHNode layout
+	uint64_t key;
+	int32_t vertexCount;
+	int32_t faceCount;
+	int32_t materialCount;
+	int32_t nodeCount;
+	int32_t refCount;
+	int32_t pad;
+};
+
+static const char cacheMagic[8] = { 'C', 'L', 'P', 'T', 'B', 'V', 'H', 0 };
+
+#define FNV_PRIME 1099511628211ULL
+
+uint64_t HashBytes(uint64_t hash, const void *data, size_t size){
+	const unsigned char *bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < size; i++){
+		hash = (hash ^ bytes[i]) * FNV_PRIME;
+	}
+	return hash;
+}
+
+// Appends the file to the hash, returns false when it can not be read
+static bool HashFile(uint64_t *hash, const char *path, std::string *contents){
+	FILE *file = fopen(path, "rb");
+	if (file == NULL) return false;
+
+	char buffer[65536];
+	size_t read;
+	while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0){
+		*hash = HashBytes(*hash, buffer, read);
+		if (contents != NULL) contents->append(buffer, read);
+	}
+
+	fclose(file);
+	return true;
+}
+
+uint64_t SceneCacheKey(const char *objPath, const std::string &buildParams){
+	uint64_t hash = FNV_OFFSET;
+	std::string obj;
+	if (!HashFile(&hash, objPath, &obj)){
+		hash = HashBytes(hash, objPath, strlen(objPath));
+	}
+
+	// Material libraries are opened relative to the working directory, like obj_parser does
+	size_t line = 0;
+	while (line < obj.size()){
+		size_t end = obj.find('\n', line);
+		if (end == std::string::npos) end = obj.size();
+
+		if (obj.compare(line, 7, "mtllib ") == 0){
+			std::string name = obj.substr(line + 7, end - line - 7);
+			while (!name.empty() && (name[name.size() - 1] == '\r' || name[name.size() - 1] == ' ')){
+				name.erase(name.size() - 1);
+			}
+			hash = HashBytes(hash, name.data(), name.size());
+			HashFile(&hash, name.c_str(), NULL);
+		}
+		line = end + 1;
+	}
+
+	return HashBytes(hash, buildParams.data(), buildParams.size());
+}
+
+static size_t PayloadSize(const CacheHeader &header){
+	return sizeof(float) * 3 * (size_t)header.vertexCount
+		+ sizeof(int) * 4 * (size_t)header.faceCount
+		+ sizeof(float) * MATERIAL_FLOATS * (size_t)header.materialCount
+		+ sizeof(BVHNode) * (size_t)header.nodeCount
+		+ sizeof(int) * 5 * (size_t)header.refCount;
+}
+
+static bool MapFile(BVHCache *cache, const char *path){
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return false;
+
+	LARGE_INTEGER size;
+	GetFileSizeEx(file, &size);
+	HANDLE fileMapping = size.QuadPart > 0 ? CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+	void *view = fileMapping != NULL ? MapViewOfFile(fileMapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+	if (view == NULL){
+		if (fileMapping != NULL) CloseHandle(fileMapping);
+		CloseHandle(file);
+		return false;
+	}
+
+	cache->file = file;
+	cache->fileMapping = fileMapping;
+	cache->mapping = view;
+	cache->size = (size_t)size.QuadPart;
+#else
+	int file = open(path, O_RDONLY);
+	if (file < 0) return false;
+
+	struct stat info;
+	void *view = MAP_FAILED;
+	if (fstat(file, &info) == 0 && info.st_size > 0){
+		view = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+	}
+	if (view == MAP_FAILED){
+		close(file);
+		return false;
+	}
+
+	cache->file = file;
+	cache->mapping = view;
+	cache->size = (size_t)info.st_size;
+#endif
+	return true;
+}
+
+bool OpenBVHCache(BVHCache *cache, const char *path, uint64_t key){
+	memset(cache, 0, sizeof(*cache));
+	if (!MapFile(cache, path)) return false;
+
+	const CacheHeader *header = (const CacheHeader*)cache->mapping;
+	const char *reason = NULL;
+
+	if (cache->size < sizeof(CacheHeader) || memcmp(header->magic, cacheMagic, sizeof(cacheMagic)) != 0){
+		reason = "not a cache file";
+	}
+	else if (header->version != BVH_CACHE_VERSION || header->nodeSize != sizeof(BVHNode)){
+		reason = "written by another version";
+	}
+	else if (header->key != key){
+		reason = "scene or build parameters changed";
+	}
+	else if (header->vertexCount < 0 || header->faceCount < 0 || header->materialCount < 0 || header->nodeCount < 1 || header->refCount < 0 ||
+		cache->size != sizeof(CacheHeader) + PayloadSize(*header)){
+		reason = "truncated";
+	}
+
+	if (reason != NULL){
+		printf("BVH cache: %s is stale (%s), rebuilding\n", path, reason);
+		CloseBVHCache(cache);
+		return false;
+	}
+
+	const char *data = (const char*)cache->mapping + sizeof(CacheHeader);
+	SceneArrays &arrays = cache->arrays;
+
+	arrays.vertexCount = header->vertexCount;
+	arrays.faceCount = header->faceCount;
+	arrays.materialCount = header->materialCount;
+	arrays.nodeCount = header->nodeCount;
+	arrays.refCount = header->refCount;
+
+	arrays.verts = (const float*)data;
+	data += sizeof(float) * 3 * arrays.vertexCount;
+	arrays.srcFaces = (const int*)data;
+	data += sizeof(int) * 3 * arrays.faceCount;
+	arrays.srcFaceMats = (const int*)data;
+	data += sizeof(int) * arrays.faceCount;
+	arrays.materials = (const float*)data;
+	data += sizeof(float) * MATERIAL_FLOATS * arrays.materialCount;
+	arrays.nodes = (const BVHNode*)data;
+	data += sizeof(BVHNode) * arrays.nodeCount;
+	arrays.triIndices = (const int*)data;
+	data += sizeof(int) * arrays.refCount;
+	arrays.faces = (const int*)data;
+	data += sizeof(int) * 3 * arrays.refCount;
+	arrays.faceMats = (const int*)data;
+
+	return true;
+}
+
+void CloseBVHCache(BVHCache *cache){
+	if (cache->mapping == NULL) return;
+
+#ifdef _WIN32
+	UnmapViewOfFile(cache->mapping);
+	CloseHandle((HANDLE)cache->fileMapping);
+	CloseHandle((HANDLE)cache->file);
+#else
+	munmap(cache->mapping, cache->size);
+	close(cache->file);
+#endif
+	cache->mapping = NULL;
+}
+
+bool WriteBVHCache(const char *path, uint64_t key, const SceneArrays &arrays){
+	std::string tempPath = std::string(path) + ".tmp";
+	FILE *file = fopen(tempPath.c_str(), "wb");
+	if (file == NULL){
+		printf("BVH cache: can not write %s\n", tempPath.c_str());
+		return false;
+	}
+
+	CacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+	header.version = BVH_CACHE_VERSION;
+	header.nodeSize = sizeof(BVHNode);
+	header.key = key;
+	header.vertexCount = arrays.vertexCount;
+	header.faceCount = arrays.faceCount;
+	header.materialCount = arrays.materialCount;
+	header.nodeCount = arrays.nodeCount;
+	header.refCount = arrays.refCount;
+
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	ok = ok && fwrite(arrays.verts, sizeof(float) * 3, arrays.vertexCount, file) == (size_t)arrays.vertexCount;
+	ok = ok && fwrite(arrays.srcFaces, sizeof(int) * 3, arrays.faceCount, file) == (size_t)arrays.faceCount;
+	ok = ok && fwrite(arrays.srcFaceMats, sizeof(int), arrays.faceCount, file) == (size_t)arrays.faceCount;
+	ok = ok && fwrite(arrays.materials, sizeof(float) * MATERIAL_FLOATS, arrays.materialCount, file) == (size_t)arrays.materialCount;
+	ok = ok && fwrite(arrays.nodes, sizeof(BVHNode), arrays.nodeCount, file) == (size_t)arrays.nodeCount;
+	ok = ok && fwrite(arrays.triIndices, sizeof(int), arrays.refCount, file) == (size_t)arrays.refCount;
+	ok = ok && fwrite(arrays.faces, sizeof(int) * 3, arrays.refCount, file) == (size_t)arrays.refCount;
+	ok = ok && fwrite(arrays.faceMats, sizeof(int), arrays.refCount, file) == (size_t)arrays.refCount;
+	ok = fclose(file) == 0 && ok;
+
+	if (ok){
+		remove(path);
+		ok = rename(tempPath.c_str(), path) == 0;
+	}
+	if (!ok){
+		printf("BVH cache: failed to write %s\n", path);
+		remove(tempPath.c_str());
+	}
+	return ok;
+}
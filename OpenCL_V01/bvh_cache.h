@@ -0,0 +1,65 @@
+#ifndef BVH_CACHE_H
+#define BVH_CACHE_H
+
+#include <stdint.h>
+#include <string>
+#include "bvh.h"
+
+#define BVH_CACHE_VERSION 2
+
+#define MATERIAL_FLOATS 4 // diffuse rgb padded to one float4 per material
+
+// Everything setupOpenCL needs to skip parsing and building. Face and
+// material arrays use the layout of FacesToVerts/FacesToMats/GetObjectMaterials.
+struct SceneArrays
+{
+	const float *verts;
+	int vertexCount;
+
+	const int *srcFaces; // file order
+	const int *srcFaceMats;
+	int faceCount;
+
+	const float *materials;
+	int materialCount;
+
+	const BVHNode *nodes;
+	int nodeCount;
+
+	const int *triIndices; // leaf order, one entry per reference
+	const int *faces;
+	const int *faceMats;
+	int refCount;
+};
+
+// A cache file mapped read-only, arrays point into the mapping
+struct BVHCache
+{
+	SceneArrays arrays;
+
+	void *mapping;
+	size_t size;
+#ifdef _WIN32
+	void *file;
+	void *fileMapping;
+#else
+	int file;
+#endif
+};
+
+#define FNV_OFFSET 14695981039346656037ULL // seed of HashBytes
+
+// FNV-1a over size bytes, continuing from hash
+uint64_t HashBytes(uint64_t hash, const void *data, size_t size);
+
+// Hash of the OBJ, every MTL it names and the build parameters
+uint64_t SceneCacheKey(const char *objPath, const std::string &buildParams);
+
+// False when the file is missing, from another version or for another key
+bool OpenBVHCache(BVHCache *cache, const char *path, uint64_t key);
+void CloseBVHCache(BVHCache *cache);
+
+// Written to a temporary file first, so a crash never leaves half a cache
+bool WriteBVHCache(const char *path, uint64_t key, const SceneArrays &arrays);
+
+#endif
@@ -0,0 +1,71 @@
+#include "bvh.h"
+#include "task_pool.h"
+
+#define BVH_REFIT_GRAIN 1024
+
+static void RefitNode(BVH *bvh, int n, const float *verts, const int *faces){
+	BVHNode &node = bvh->nodes[n];
+	AABB box;
+
+	if (node.count > 0){
+		for (int i = node.leftFirst; i < node.leftFirst + node.count; i++){
+			for (int v = 0; v < 3; v++){
+				box.Grow(&verts[3 * faces[3 * i + v]]);
+			}
+		}
+	}
+	else {
+		for (int c = 0; c < 2; c++){
+			const BVHNode &child = bvh->nodes[node.leftFirst + c];
+			box.Grow(child.bmin);
+			box.Grow(child.bmax);
+		}
+	}
+
+	for (int k = 0; k < 3; k++){
+		node.bmin[k] = box.bmin[k];
+		node.bmax[k] = box.bmax[k];
+	}
+}
+
+void RefitBVH(BVH *bvh, const float *verts, const int *faces, TaskPool *pool){
+	if (bvh->nodes.empty() || (bvh->nodes.size() == 1 && bvh->nodes[0].count == 0)) return;
+
+	// Nodes grouped by depth, every level only reads the one below it
+	std::vector<std::vector<int> > levels;
+	std::vector<int> stack(1, 0);
+	std::vector<int> depth(bvh->nodes.size(), 0);
+
+	while (!stack.empty()){
+		int n = stack.back();
+		stack.pop_back();
+
+		if ((int)levels.size() <= depth[n]) levels.resize(depth[n] + 1);
+		levels[depth[n]].push_back(n);
+
+		const BVHNode &node = bvh->nodes[n];
+		if (node.count == 0){
+			for (int c = 0; c < 2; c++){
+				depth[node.leftFirst + c] = depth[n] + 1;
+				stack.push_back(node.leftFirst + c);
+			}
+		}
+	}
+
+	for (int d = (int)levels.size() - 1; d >= 0; d--){
+		const std::vector<int> &level = levels[d];
+
+		if (pool == NULL || (int)level.size() < BVH_REFIT_GRAIN){
+			for (size_t i = 0; i < level.size(); i++){
+				RefitNode(bvh, level[i], verts, faces);
+			}
+			continue;
+		}
+
+		pool->ParallelFor(0, (int)level.size(), BVH_REFIT_GRAIN, [&](int begin, int end){
+			for (int i = begin; i < end; i++){
+				RefitNode(bvh, level[i], verts, faces);
+			}
+		});
+	}
+}
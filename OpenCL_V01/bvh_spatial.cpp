@@ -0,0 +1,371 @@
+#include <algorithm>
+#include <math.h>
+#include "bvh.h"
+
+// Triangle reference, box is the part of the triangle this reference covers
+struct SpatialRef
+{
+	AABB box;
+	int tri;
+};
+
+struct SpatialTask
+{
+	int node;
+	std::vector<SpatialRef> refs;
+};
+
+struct SplitCandidate
+{
+	float cost;
+	int axis;
+	int bin;
+	float position;
+	AABB left, right;
+	int leftCount, rightCount;
+};
+
+static float Centroid(const SpatialRef &ref, int axis){
+	return 0.5f * (ref.box.bmin[axis] + ref.box.bmax[axis]);
+}
+
+static AABB Intersect(const AABB &a, const AABB &b){
+	AABB box;
+	for (int k = 0; k < 3; k++){
+		box.bmin[k] = std::max(a.bmin[k], b.bmin[k]);
+		box.bmax[k] = std::min(a.bmax[k], b.bmax[k]);
+	}
+	return box;
+}
+
+static bool IsEmpty(const AABB &box){
+	return box.bmin[0] > box.bmax[0] || box.bmin[1] > box.bmax[1] || box.bmin[2] > box.bmax[2];
+}
+
+// Part of the referenced triangle between lo and hi along axis
+static AABB ClipRef(const SpatialRef &ref, const float *verts, const int *faces, int axis, float lo, float hi){
+	AABB clipped;
+	const float *v[3];
+	for (int i = 0; i < 3; i++){
+		v[i] = &verts[3 * faces[3 * ref.tri + i]];
+	}
+
+	for (int i = 0; i < 3; i++){
+		const float *p = v[i];
+		const float *q = v[(i + 1) % 3];
+
+		if (p[axis] >= lo && p[axis] <= hi) clipped.Grow(p);
+
+		// Points where the edge crosses either plane
+		float planes[2] = { lo, hi };
+		for (int s = 0; s < 2; s++){
+			if ((p[axis] < planes[s]) == (q[axis] < planes[s])) continue;
+
+			float t = (planes[s] - p[axis]) / (q[axis] - p[axis]);
+			float point[3];
+			for (int k = 0; k < 3; k++){
+				point[k] = p[k] + (q[k] - p[k]) * t;
+			}
+			point[axis] = planes[s];
+			clipped.Grow(point);
+		}
+	}
+
+	clipped = Intersect(clipped, ref.box);
+	clipped.bmin[axis] = std::max(clipped.bmin[axis], lo);
+	clipped.bmax[axis] = std::min(clipped.bmax[axis], hi);
+	return clipped;
+}
+
+// Best plane between two bins, true when it beats the current best
+static bool SweepBins(const AABB *bins, const int *leftCounts, const int *rightCounts, int axis, SplitCandidate *best){
+	float rightArea[SBVH_BIN_COUNT];
+	AABB rightBoxes[SBVH_BIN_COUNT];
+	int rightCount[SBVH_BIN_COUNT];
+	AABB right;
+	int count = 0;
+	for (int b = SBVH_BIN_COUNT - 1; b > 0; b--){
+		right.Grow(bins[b]);
+		count += rightCounts[b];
+		rightArea[b] = right.Area();
+		rightBoxes[b] = right;
+		rightCount[b] = count;
+	}
+
+	bool improved = false;
+	AABB left;
+	count = 0;
+	for (int b = 1; b < SBVH_BIN_COUNT; b++){
+		left.Grow(bins[b - 1]);
+		count += leftCounts[b - 1];
+		if (count == 0 || rightCount[b] == 0) continue;
+
+		float cost = left.Area() * count + rightArea[b] * rightCount[b];
+		if (cost < best->cost){
+			best->cost = cost;
+			best->axis = axis;
+			best->bin = b;
+			best->left = left;
+			best->right = rightBoxes[b];
+			best->leftCount = count;
+			best->rightCount = rightCount[b];
+			improved = true;
+		}
+	}
+	return improved;
+}
+
+// Binned SAH over reference centroids
+static void FindObjectSplit(const std::vector<SpatialRef> &refs, SplitCandidate *best){
+	AABB centroidBox;
+	for (size_t i = 0; i < refs.size(); i++){
+		float c[3] = { Centroid(refs[i], 0), Centroid(refs[i], 1), Centroid(refs[i], 2) };
+		centroidBox.Grow(c);
+	}
+
+	for (int axis = 0; axis < 3; axis++){
+		float extent = centroidBox.bmax[axis] - centroidBox.bmin[axis];
+		if (extent <= 0) continue;
+
+		AABB bins[SBVH_BIN_COUNT];
+		int counts[SBVH_BIN_COUNT] = { 0 };
+		for (size_t i = 0; i < refs.size(); i++){
+			int b = (int)((Centroid(refs[i], axis) - centroidBox.bmin[axis]) * (SBVH_BIN_COUNT / extent));
+			b = std::min(std::max(b, 0), SBVH_BIN_COUNT - 1);
+			bins[b].Grow(refs[i].box);
+			counts[b]++;
+		}
+
+		if (SweepBins(bins, counts, counts, axis, best)){
+			best->position = centroidBox.bmin[axis] + best->bin * (extent / SBVH_BIN_COUNT);
+		}
+	}
+}
+
+// Binned SAH over planes through the node, straddling references are
+// clipped into every bin they touch
+static void FindSpatialSplit(const std::vector<SpatialRef> &refs, const AABB &box, const float *verts, const int *faces, SplitCandidate *best){
+	for (int axis = 0; axis < 3; axis++){
+		float extent = box.bmax[axis] - box.bmin[axis];
+		if (extent <= 0) continue;
+
+		float width = extent / SBVH_BIN_COUNT;
+		AABB bins[SBVH_BIN_COUNT];
+		int entries[SBVH_BIN_COUNT] = { 0 };
+		int exits[SBVH_BIN_COUNT] = { 0 };
+
+		for (size_t i = 0; i < refs.size(); i++){
+			const SpatialRef &ref = refs[i];
+			int first = (int)((ref.box.bmin[axis] - box.bmin[axis]) / width);
+			int last = (int)((ref.box.bmax[axis] - box.bmin[axis]) / width);
+			first = std::min(std::max(first, 0), SBVH_BIN_COUNT - 1);
+			last = std::min(std::max(last, first), SBVH_BIN_COUNT - 1);
+
+			if (first == last){
+				bins[first].Grow(ref.box);
+			}
+			else {
+				for (int b = first; b <= last; b++){
+					float lo = box.bmin[axis] + b * width;
+					float hi = b == SBVH_BIN_COUNT - 1 ? box.bmax[axis] : lo + width;
+					AABB part = ClipRef(ref, verts, faces, axis, lo, hi);
+					if (!IsEmpty(part)) bins[b].Grow(part);
+				}
+			}
+			entries[first]++;
+			exits[last]++;
+		}
+
+		if (SweepBins(bins, entries, exits, axis, best)){
+			best->position = box.bmin[axis] + best->bin * width;
+		}
+	}
+}
+
+static void ObjectPartition(const std::vector<SpatialRef> &refs, const SplitCandidate &split, std::vector<SpatialRef> *left, std::vector<SpatialRef> *right){
+	for (size_t i = 0; i < refs.size(); i++){
+		if (Centroid(refs[i], split.axis) < split.position) left->push_back(refs[i]);
+		else right->push_back(refs[i]);
+	}
+}
+
+// Split references across the plane, straddlers stay on one side when that
+// is cheaper (reference unsplitting) or when the budget is used up
+static void SpatialPartition(const std::vector<SpatialRef> &refs, const SplitCandidate &split, const float *verts, const int *faces,
+	int *refTotal, int maxRefs, std::vector<SpatialRef> *left, std::vector<SpatialRef> *right){
+	int axis = split.axis;
+	float position = split.position;
+
+	AABB leftBox = split.left;
+	AABB rightBox = split.right;
+	int leftCount = split.leftCount;
+	int rightCount = split.rightCount;
+
+	for (size_t i = 0; i < refs.size(); i++){
+		const SpatialRef &ref = refs[i];
+		if (ref.box.bmax[axis] <= position){
+			left->push_back(ref);
+			continue;
+		}
+		if (ref.box.bmin[axis] >= position){
+			right->push_back(ref);
+			continue;
+		}
+
+		AABB leftGrown = leftBox;
+		AABB rightGrown = rightBox;
+		leftGrown.Grow(ref.box);
+		rightGrown.Grow(ref.box);
+
+		float splitCost = leftBox.Area() * leftCount + rightBox.Area() * rightCount;
+		float leftOnly = leftGrown.Area() * leftCount + rightBox.Area() * (rightCount - 1);
+		float rightOnly = leftBox.Area() * (leftCount - 1) + rightGrown.Area() * rightCount;
+
+		SpatialRef leftRef = ref;
+		SpatialRef rightRef = ref;
+		leftRef.box = ClipRef(ref, verts, faces, axis, -INFINITY, position);
+		rightRef.box = ClipRef(ref, verts, faces, axis, position, INFINITY);
+
+		bool budgetLeft = *refTotal < maxRefs;
+		bool unsplit = !budgetLeft || std::min(leftOnly, rightOnly) < splitCost || IsEmpty(leftRef.box) || IsEmpty(rightRef.box);
+
+		if (!unsplit){
+			left->push_back(leftRef);
+			right->push_back(rightRef);
+			(*refTotal)++;
+		}
+		else if (leftOnly <= rightOnly){
+			left->push_back(ref);
+			leftBox = leftGrown;
+			rightCount--;
+		}
+		else {
+			right->push_back(ref);
+			rightBox = rightGrown;
+			leftCount--;
+		}
+	}
+}
+
+void BuildBVHSpatial(BVH *bvh, const float *verts, const int *faces, int faceCount, float splitBudget){
+	if (faceCount == 0){
+		BuildBVH(bvh, verts, faces, faceCount);
+		return;
+	}
+
+	bvh->nodes.clear();
+	bvh->triIndices.clear();
+	bvh->nodes.push_back(BVHNode());
+
+	SpatialTask root;
+	root.node = 0;
+	root.refs.resize(faceCount);
+	AABB rootBox;
+	for (int i = 0; i < faceCount; i++){
+		for (int v = 0; v < 3; v++){
+			root.refs[i].box.Grow(&verts[3 * faces[3 * i + v]]);
+		}
+		root.refs[i].tri = i;
+		rootBox.Grow(root.refs[i].box);
+	}
+
+	float rootArea = rootBox.Area();
+	int refTotal = faceCount;
+	int maxRefs = faceCount + (int)(faceCount * splitBudget);
+
+	std::vector<SpatialTask> stack;
+	stack.push_back(SpatialTask());
+	std::swap(stack.back(), root);
+
+	while (!stack.empty()){
+		SpatialTask task;
+		std::swap(task, stack.back());
+		stack.pop_back();
+
+		std::vector<SpatialRef> &refs = task.refs;
+		int count = (int)refs.size();
+
+		AABB box;
+		for (int i = 0; i < count; i++){
+			box.Grow(refs[i].box);
+		}
+		for (int k = 0; k < 3; k++){
+			bvh->nodes[task.node].bmin[k] = box.bmin[k];
+			bvh->nodes[task.node].bmax[k] = box.bmax[k];
+		}
+
+		SplitCandidate objectSplit;
+		objectSplit.cost = 1e30f;
+		objectSplit.axis = -1;
+		SplitCandidate spatialSplit;
+		spatialSplit.cost = 1e30f;
+		spatialSplit.axis = -1;
+
+		if (count > 1){
+			FindObjectSplit(refs, &objectSplit);
+
+			// Only look for spatial splits where the object split children overlap
+			float overlap = objectSplit.axis >= 0 ? Intersect(objectSplit.left, objectSplit.right).Area() : rootArea;
+			if (refTotal < maxRefs && rootArea > 0 && overlap / rootArea > SBVH_OVERLAP_ALPHA){
+				FindSpatialSplit(refs, box, verts, faces, &spatialSplit);
+			}
+		}
+
+		bool spatial = spatialSplit.cost < objectSplit.cost;
+		const SplitCandidate &best = spatial ? spatialSplit : objectSplit;
+
+		float nodeArea = box.Area();
+		float bestCost = 1e30f;
+		if (best.axis >= 0 && nodeArea > 0){
+			bestCost = BVH_TRAVERSAL_COST + BVH_INTERSECT_COST * best.cost / nodeArea;
+		}
+
+		float leafCost = BVH_INTERSECT_COST * count;
+		if (count == 1 || (bestCost >= leafCost && count <= BVH_MAX_LEAF_SIZE)){
+			bvh->nodes[task.node].leftFirst = (int)bvh->triIndices.size();
+			bvh->nodes[task.node].count = count;
+			for (int i = 0; i < count; i++){
+				bvh->triIndices.push_back(refs[i].tri);
+			}
+			continue;
+		}
+
+		SpatialTask children[2];
+		if (best.axis >= 0){
+			if (spatial){
+				SpatialPartition(refs, best, verts, faces, &refTotal, maxRefs, &children[0].refs, &children[1].refs);
+			}
+			else {
+				ObjectPartition(refs, best, &children[0].refs, &children[1].refs);
+			}
+		}
+
+		// No usable plane, split the references in half along the widest axis
+		if (children[0].refs.empty() || children[1].refs.empty()){
+			int axis = 0;
+			for (int k = 1; k < 3; k++){
+				if (box.bmax[k] - box.bmin[k] > box.bmax[axis] - box.bmin[axis]) axis = k;
+			}
+			std::sort(refs.begin(), refs.end(), [axis](const SpatialRef &a, const SpatialRef &b){
+				return Centroid(a, axis) < Centroid(b, axis);
+			});
+			children[0].refs.assign(refs.begin(), refs.begin() + count / 2);
+			children[1].refs.assign(refs.begin() + count / 2, refs.end());
+		}
+
+		int left = (int)bvh->nodes.size();
+		bvh->nodes.push_back(BVHNode());
+		bvh->nodes.push_back(BVHNode());
+		bvh->nodes[task.node].leftFirst = left;
+		bvh->nodes[task.node].count = 0;
+
+		children[0].node = left;
+		children[1].node = left + 1;
+		refs.clear();
+
+		for (int c = 1; c >= 0; c--){
+			stack.push_back(SpatialTask());
+			std::swap(stack.back(), children[c]);
+		}
+	}
+}
@@ -0,0 +1,135 @@
+#include <string.h>
+#include "bvh.h"
+
+static AABB NodeBox(const BVHNode &node){
+	AABB box;
+	for (int k = 0; k < 3; k++){
+		box.bmin[k] = node.bmin[k];
+		box.bmax[k] = node.bmax[k];
+	}
+	return box;
+}
+
+static float OverlapArea(const AABB &a, const AABB &b){
+	AABB overlap;
+	for (int k = 0; k < 3; k++){
+		overlap.bmin[k] = a.bmin[k] > b.bmin[k] ? a.bmin[k] : b.bmin[k];
+		overlap.bmax[k] = a.bmax[k] < b.bmax[k] ? a.bmax[k] : b.bmax[k];
+	}
+	return overlap.Area();
+}
+
+void ComputeBVHStats(BVHStats *stats, const std::vector<BVHNode> &nodes, const std::vector<int> &roots, int faceCount, size_t nodeBytes){
+	memset(stats, 0, sizeof(*stats));
+	stats->treeCount = (int)roots.size();
+	stats->faceCount = faceCount;
+	stats->nodeBytes = nodeBytes;
+
+	double depthSum = 0;
+	double overlapSum = 0;
+
+	struct Entry { int node, depth; };
+	std::vector<Entry> stack;
+
+	for (size_t r = 0; r < roots.size(); r++){
+		const BVHNode &root = nodes[roots[r]];
+		float rootArea = NodeBox(root).Area();
+		double cost = 0;
+
+		// An empty scene has a root without children
+		if (root.count == 0 && nodes.size() < 2) continue;
+
+		Entry start = { roots[r], 0 };
+		stack.push_back(start);
+
+		while (!stack.empty()){
+			Entry e = stack.back();
+			stack.pop_back();
+
+			const BVHNode &node = nodes[e.node];
+			float area = rootArea > 0 ? NodeBox(node).Area() / rootArea : 0.0f;
+			stats->nodeCount++;
+			if (e.depth > stats->maxDepth) stats->maxDepth = e.depth;
+
+			if (node.count > 0){
+				stats->leafCount++;
+				stats->refCount += node.count;
+				stats->leafHistogram[node.count < BVH_STATS_HISTOGRAM - 1 ? node.count : BVH_STATS_HISTOGRAM - 1]++;
+				depthSum += e.depth;
+				cost += BVH_INTERSECT_COST * node.count * area;
+				continue;
+			}
+
+			stats->innerCount++;
+			cost += BVH_TRAVERSAL_COST * area;
+
+			const BVHNode &left = nodes[node.leftFirst];
+			const BVHNode &right = nodes[node.leftFirst + 1];
+			float overlap = OverlapArea(NodeBox(left), NodeBox(right));
+			float parentArea = NodeBox(node).Area();
+			if (parentArea > 0) overlapSum += overlap / parentArea;
+			if (rootArea > 0) stats->overlapCost += overlap / rootArea;
+
+			for (int c = 0; c < 2; c++){
+				Entry child = { node.leftFirst + c, e.depth + 1 };
+				stack.push_back(child);
+			}
+		}
+
+		stats->sahCost += (float)cost;
+	}
+
+	if (stats->treeCount > 0) stats->sahCost /= stats->treeCount;
+	if (stats->leafCount > 0) stats->averageLeafDepth = (float)(depthSum / stats->leafCount);
+	if (stats->innerCount > 0) stats->averageOverlap = (float)(overlapSum / stats->innerCount);
+
+	// Leaves index faces (3 vertex indices) and materials in leaf order
+	stats->faceBytes = (size_t)stats->refCount * 4 * sizeof(int);
+	if (faceCount > 0) stats->bytesPerFace = (float)(stats->nodeBytes + stats->faceBytes) / faceCount;
+}
+
+void PrintBVHStats(const char *name, const BVHStats &stats){
+	printf("%s: %d tree(s), %d nodes (%d inner, %d leaves), %d references for %d faces\n", name, stats.treeCount,
+		stats.nodeCount, stats.innerCount, stats.leafCount, stats.refCount, stats.faceCount);
+	printf("  depth max %d, leaf average %.1f\n", stats.maxDepth, stats.averageLeafDepth);
+	printf("  SAH cost %.2f, child overlap %.1f%% of parent, overlap cost %.2f\n", stats.sahCost,
+		100.0f * stats.averageOverlap, stats.overlapCost);
+	printf("  memory %.1f KB nodes + %.1f KB faces, %.1f bytes per face\n", stats.nodeBytes / 1024.0,
+		stats.faceBytes / 1024.0, stats.bytesPerFace);
+
+	printf("  leaf sizes:");
+	for (int i = 1; i < BVH_STATS_HISTOGRAM; i++){
+		printf(" %s%d:%d", i == BVH_STATS_HISTOGRAM - 1 ? ">" : "", i == BVH_STATS_HISTOGRAM - 1 ? i - 1 : i, stats.leafHistogram[i]);
+	}
+	printf("\n");
+}
+
+bool WriteBVHStatsJSON(FILE *file, const char *name, const BVHStats &stats){
+	fprintf(file, "{\n");
+	fprintf(file, "\t\"name\": \"%s\",\n", name);
+	fprintf(file, "\t\"trees\": %d,\n", stats.treeCount);
+	fprintf(file, "\t\"nodes\": %d,\n", stats.nodeCount);
+	fprintf(file, "\t\"innerNodes\": %d,\n", stats.innerCount);
+	fprintf(file, "\t\"leaves\": %d,\n", stats.leafCount);
+	fprintf(file, "\t\"references\": %d,\n", stats.refCount);
+	fprintf(file, "\t\"faces\": %d,\n", stats.faceCount);
+
+	// Index is the leaf size, the last entry counts every larger leaf
+	fprintf(file, "\t\"leafHistogram\": [");
+	for (int i = 0; i < BVH_STATS_HISTOGRAM; i++){
+		fprintf(file, "%s%d", i > 0 ? ", " : "", stats.leafHistogram[i]);
+	}
+	fprintf(file, "],\n");
+
+	fprintf(file, "\t\"maxDepth\": %d,\n", stats.maxDepth);
+	fprintf(file, "\t\"averageLeafDepth\": %.3f,\n", stats.averageLeafDepth);
+	fprintf(file, "\t\"sahCost\": %.4f,\n", stats.sahCost);
+	fprintf(file, "\t\"averageOverlap\": %.4f,\n", stats.averageOverlap);
+	fprintf(file, "\t\"overlapCost\": %.4f,\n", stats.overlapCost);
+	fprintf(file, "\t\"nodeBytes\": %lu,\n", (unsigned long)stats.nodeBytes);
+	fprintf(file, "\t\"faceBytes\": %lu,\n", (unsigned long)stats.faceBytes);
+	fprintf(file, "\t\"bytesPerFace\": %.2f\n", stats.bytesPerFace);
+	fprintf(file, "}");
+
+	return ferror(file) == 0;
+}
@@ -0,0 +1,213 @@
+#include <math.h>
+#include "bvh.h"
+#include "task_pool.h"
+
+#define TREELET_SUBSETS (1 << BVH_TREELET_LEAVES)
+
+static AABB NodeBox(const BVHNode &node){
+	AABB box;
+	for (int k = 0; k < 3; k++){
+		box.bmin[k] = node.bmin[k];
+		box.bmax[k] = node.bmax[k];
+	}
+	return box;
+}
+
+// SAH cost of the subtree below n, children are already up to date
+static float SubtreeCost(const BVH *bvh, const std::vector<float> &cost, int n){
+	const BVHNode &node = bvh->nodes[n];
+	float area = NodeBox(node).Area();
+	if (node.count > 0) return BVH_INTERSECT_COST * node.count * area;
+	return BVH_TRAVERSAL_COST * area + cost[node.leftFirst] + cost[node.leftFirst + 1];
+}
+
+struct Treelet
+{
+	BVH *bvh;
+	std::vector<float> *cost;
+
+	int leaves[BVH_TREELET_LEAVES];
+	int leafCount;
+	int pairs[BVH_TREELET_LEAVES - 1]; // child pairs of the treelet's inner nodes
+	int pairCount;
+
+	AABB boxes[TREELET_SUBSETS];
+	float best[TREELET_SUBSETS];
+	int partition[TREELET_SUBSETS];
+
+	BVHNode saved[BVH_TREELET_LEAVES];
+	float savedCost[BVH_TREELET_LEAVES];
+	int nextPair;
+
+	// Grow from the root by opening the treelet leaf with the largest area
+	void Form(int root)
+	{
+		const BVHNode &node = bvh->nodes[root];
+		leaves[0] = node.leftFirst;
+		leaves[1] = node.leftFirst + 1;
+		leafCount = 2;
+		pairs[0] = node.leftFirst;
+		pairCount = 1;
+
+		while (leafCount < BVH_TREELET_LEAVES){
+			int open = -1;
+			float openArea = -1;
+			for (int i = 0; i < leafCount; i++){
+				const BVHNode &leaf = bvh->nodes[leaves[i]];
+				float area = NodeBox(leaf).Area();
+				if (leaf.count == 0 && area > openArea){
+					open = i;
+					openArea = area;
+				}
+			}
+			if (open < 0) break;
+
+			int pair = bvh->nodes[leaves[open]].leftFirst;
+			pairs[pairCount++] = pair;
+			leaves[open] = pair;
+			leaves[leafCount++] = pair + 1;
+		}
+	}
+
+	// Cheapest topology over every subset of the treelet leaves
+	void Optimize()
+	{
+		int full = (1 << leafCount) - 1;
+
+		for (int s = 1; s <= full; s++){
+			boxes[s].Reset();
+			for (int i = 0; i < leafCount; i++){
+				if (s & (1 << i)) boxes[s].Grow(NodeBox(bvh->nodes[leaves[i]]));
+			}
+		}
+
+		for (int i = 0; i < leafCount; i++){
+			best[1 << i] = (*cost)[leaves[i]];
+			partition[1 << i] = 0;
+		}
+
+		// Proper subsets are smaller numbers, so they are done first
+		for (int s = 1; s <= full; s++){
+			if ((s & (s - 1)) == 0) continue;
+
+			float bestSplit = INFINITY;
+			int bestPart = 0;
+			int low = s & -s;
+			for (int p = (s - 1) & s; p > 0; p = (p - 1) & s){
+				if (!(p & low)) continue; // each split once
+				float c = best[p] + best[s ^ p];
+				if (c < bestSplit){
+					bestSplit = c;
+					bestPart = p;
+				}
+			}
+
+			best[s] = BVH_TRAVERSAL_COST * boxes[s].Area() + bestSplit;
+			partition[s] = bestPart;
+		}
+	}
+
+	// Write subset s into slot, inner nodes take the treelet's child pairs
+	void Emit(int s, int slot)
+	{
+		if ((s & (s - 1)) == 0){
+			int i = 0;
+			while (!(s & (1 << i))) i++;
+			bvh->nodes[slot] = saved[i];
+			(*cost)[slot] = savedCost[i];
+			return;
+		}
+
+		int pair = pairs[nextPair++];
+		BVHNode &node = bvh->nodes[slot];
+		for (int k = 0; k < 3; k++){
+			node.bmin[k] = boxes[s].bmin[k];
+			node.bmax[k] = boxes[s].bmax[k];
+		}
+		node.leftFirst = pair;
+		node.count = 0;
+		(*cost)[slot] = best[s];
+
+		Emit(partition[s], pair);
+		Emit(s ^ partition[s], pair + 1);
+	}
+
+	void Restructure(int root)
+	{
+		if (bvh->nodes[root].count > 0){
+			(*cost)[root] = SubtreeCost(bvh, *cost, root);
+			return;
+		}
+
+		Form(root);
+		if (leafCount < 3){
+			(*cost)[root] = SubtreeCost(bvh, *cost, root);
+			return;
+		}
+
+		Optimize();
+
+		int full = (1 << leafCount) - 1;
+		float current = SubtreeCost(bvh, *cost, root);
+		if (best[full] >= current * 0.9999f){
+			(*cost)[root] = current;
+			return;
+		}
+
+		for (int i = 0; i < leafCount; i++){
+			saved[i] = bvh->nodes[leaves[i]];
+			savedCost[i] = (*cost)[leaves[i]];
+		}
+		nextPair = 0;
+		Emit(full, root);
+	}
+};
+
+static void GroupByDepth(const BVH *bvh, std::vector<std::vector<int> > *levels){
+	levels->clear();
+
+	std::vector<int> stack(1, 0);
+	std::vector<int> depth(bvh->nodes.size(), 0);
+	while (!stack.empty()){
+		int n = stack.back();
+		stack.pop_back();
+
+		if ((int)levels->size() <= depth[n]) levels->resize(depth[n] + 1);
+		(*levels)[depth[n]].push_back(n);
+
+		const BVHNode &node = bvh->nodes[n];
+		if (node.count == 0){
+			for (int c = 0; c < 2; c++){
+				depth[node.leftFirst + c] = depth[n] + 1;
+				stack.push_back(node.leftFirst + c);
+			}
+		}
+	}
+}
+
+// Restructure treelets bottom-up. Nodes at one depth root disjoint
+// subtrees, so every level runs in parallel on the pool. A treelet only
+// moves nodes below its root, so the levels above stay valid.
+void OptimizeBVH(BVH *bvh, int rounds, TaskPool *pool){
+	if (bvh->nodes.size() < 3) return;
+
+	std::vector<float> cost(bvh->nodes.size(), 0.0f);
+	std::vector<std::vector<int> > levels;
+
+	for (int round = 0; round < rounds; round++){
+		GroupByDepth(bvh, &levels);
+
+		for (int d = (int)levels.size() - 1; d >= 0; d--){
+			const std::vector<int> &level = levels[d];
+
+			pool->ParallelFor(0, (int)level.size(), 64, [&](int begin, int end){
+				Treelet treelet;
+				treelet.bvh = bvh;
+				treelet.cost = &cost;
+				for (int i = begin; i < end; i++){
+					treelet.Restructure(level[i]);
+				}
+			});
+		}
+	}
+}
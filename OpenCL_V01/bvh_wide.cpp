@@ -0,0 +1,241 @@
+#include <math.h>
+#include <string.h>
+#include "bvh.h"
+
+struct CollapseTask
+{
+	int binary;
+	int wide;
+};
+
+static AABB NodeBox(const BVHNode &node){
+	AABB box;
+	for (int k = 0; k < 3; k++){
+		box.bmin[k] = node.bmin[k];
+		box.bmax[k] = node.bmax[k];
+	}
+	return box;
+}
+
+// Plane offsets decoded the same way as the kernel, with a single fma
+static float Dequantize(float origin, float scale, int q){
+	return fmaf((float)q, scale, origin);
+}
+
+static void Quantize(WideBVHNode *node, int slot, const AABB &box){
+	for (int k = 0; k < 3; k++){
+		int lo = 0;
+		int hi = 0;
+
+		if (node->scale[k] > 0){
+			lo = (int)floorf((box.bmin[k] - node->origin[k]) / node->scale[k]);
+			hi = (int)ceilf((box.bmax[k] - node->origin[k]) / node->scale[k]);
+			lo = lo < 0 ? 0 : (lo > 255 ? 255 : lo);
+			hi = hi < 0 ? 0 : (hi > 255 ? 255 : hi);
+
+			// Keep the decoded box conservative after rounding
+			while (lo > 0 && Dequantize(node->origin[k], node->scale[k], lo) > box.bmin[k]) lo--;
+			while (hi < 255 && Dequantize(node->origin[k], node->scale[k], hi) < box.bmax[k]) hi++;
+		}
+
+		node->qmin[k][slot] = (unsigned char)lo;
+		node->qmax[k][slot] = (unsigned char)hi;
+	}
+}
+
+// Origin and scale so that 255 steps always reach the far side of box
+static void SetFrame(WideBVHNode *node, const AABB &box){
+	for (int k = 0; k < 3; k++){
+		float extent = box.bmax[k] - box.bmin[k];
+		node->origin[k] = box.bmin[k];
+		node->scale[k] = extent > 0 ? extent / 255.0f : 0.0f;
+		while (extent > 0 && Dequantize(node->origin[k], node->scale[k], 255) < box.bmax[k]){
+			node->scale[k] = nextafterf(node->scale[k], INFINITY);
+		}
+	}
+}
+
+// Slot s is the first child for rays in octant s, nearest along -dir(s)
+static void AssignSlots(const BVH *bvh, const AABB &parent, const int *children, int childCount, int *slots){
+	float cost[BVH_WIDTH][BVH_WIDTH];
+
+	for (int c = 0; c < childCount; c++){
+		const BVHNode &node = bvh->nodes[children[c]];
+		float offset[3];
+		for (int k = 0; k < 3; k++){
+			offset[k] = 0.5f * (node.bmin[k] + node.bmax[k]) - 0.5f * (parent.bmin[k] + parent.bmax[k]);
+		}
+
+		for (int s = 0; s < BVH_WIDTH; s++){
+			cost[c][s] = 0;
+			for (int k = 0; k < 3; k++){
+				if ((1 << k) >= BVH_WIDTH) continue;
+				cost[c][s] += ((s >> k) & 1) ? -offset[k] : offset[k];
+			}
+		}
+		slots[c] = -1;
+	}
+
+	// Greedily hand out the cheapest remaining (child, slot) pair
+	bool slotUsed[BVH_WIDTH] = { false };
+	for (int n = 0; n < childCount; n++){
+		int bestChild = -1;
+		int bestSlot = -1;
+		for (int c = 0; c < childCount; c++){
+			if (slots[c] >= 0) continue;
+			for (int s = 0; s < BVH_WIDTH; s++){
+				if (slotUsed[s]) continue;
+				if (bestChild < 0 || cost[c][s] < cost[bestChild][bestSlot]){
+					bestChild = c;
+					bestSlot = s;
+				}
+			}
+		}
+		slots[bestChild] = bestSlot;
+		slotUsed[bestSlot] = true;
+	}
+}
+
+void CollapseBVH(const BVH *bvh, std::vector<WideBVHNode> *wide, WideBVHSources *sources){
+	wide->clear();
+	wide->push_back(WideBVHNode());
+
+	WideBVHSources unused;
+	if (sources == NULL) sources = &unused;
+	sources->nodes.assign(1, -1);
+	sources->children.assign(BVH_WIDTH, -1);
+
+	// Empty scene, a root without children
+	if (bvh->nodes.size() < 2 && bvh->nodes[0].count == 0){
+		WideBVHNode &empty = (*wide)[0];
+		memset(&empty, 0, sizeof(empty));
+		for (int s = 0; s < BVH_WIDTH; s++){
+			empty.child[s] = -1;
+		}
+		return;
+	}
+
+	std::vector<CollapseTask> tasks;
+	CollapseTask root = { 0, 0 };
+	tasks.push_back(root);
+
+	while (!tasks.empty()){
+		CollapseTask task = tasks.back();
+		tasks.pop_back();
+
+		const BVHNode &node = bvh->nodes[task.binary];
+		AABB box = NodeBox(node);
+
+		// Open the largest inner children until the node is full
+		int children[BVH_WIDTH];
+		int childCount = 0;
+
+		if (node.count > 0){
+			children[childCount++] = task.binary;
+		}
+		else {
+			children[childCount++] = node.leftFirst;
+			children[childCount++] = node.leftFirst + 1;
+		}
+
+		while (childCount < BVH_WIDTH){
+			int best = -1;
+			float bestArea = -1;
+			for (int c = 0; c < childCount; c++){
+				const BVHNode &child = bvh->nodes[children[c]];
+				float area = NodeBox(child).Area();
+				if (child.count == 0 && area > bestArea){
+					best = c;
+					bestArea = area;
+				}
+			}
+			if (best < 0) break;
+
+			int opened = children[best];
+			children[best] = bvh->nodes[opened].leftFirst;
+			children[childCount++] = bvh->nodes[opened].leftFirst + 1;
+		}
+
+		int slots[BVH_WIDTH];
+		AssignSlots(bvh, box, children, childCount, slots);
+
+		WideBVHNode out;
+		memset(&out, 0, sizeof(out));
+		for (int s = 0; s < BVH_WIDTH; s++){
+			out.child[s] = -1;
+		}
+
+		SetFrame(&out, box);
+		sources->nodes[task.wide] = task.binary;
+
+		for (int c = 0; c < childCount; c++){
+			const BVHNode &child = bvh->nodes[children[c]];
+			int s = slots[c];
+
+			Quantize(&out, s, NodeBox(child));
+			sources->children[task.wide * BVH_WIDTH + s] = children[c];
+
+			if (child.count > 0){
+				out.child[s] = child.leftFirst;
+				out.count[s] = (unsigned char)child.count;
+			}
+			else {
+				out.child[s] = (int)wide->size();
+				wide->push_back(WideBVHNode());
+				sources->nodes.push_back(-1);
+				sources->children.resize(sources->children.size() + BVH_WIDTH, -1);
+
+				CollapseTask childTask = { children[c], out.child[s] };
+				tasks.push_back(childTask);
+			}
+		}
+
+		(*wide)[task.wide] = out;
+	}
+}
+
+void RefitWideBVH(const BVH *bvh, const WideBVHSources &sources, std::vector<WideBVHNode> *wide){
+	for (size_t i = 0; i < wide->size(); i++){
+		if (sources.nodes[i] < 0) continue;
+
+		WideBVHNode &node = (*wide)[i];
+		SetFrame(&node, NodeBox(bvh->nodes[sources.nodes[i]]));
+		for (int s = 0; s < BVH_WIDTH; s++){
+			int child = sources.children[i * BVH_WIDTH + s];
+			if (child >= 0) Quantize(&node, s, NodeBox(bvh->nodes[child]));
+		}
+	}
+}
+
+int WideBVHStackDepth(const std::vector<WideBVHNode> &nodes){
+	if (nodes.empty()) return 1;
+
+	std::vector<int> need(nodes.size(), 0);
+	std::vector<int> stack(1, 0);
+	while (!stack.empty()){
+		int index = stack.back();
+		const WideBVHNode &node = nodes[index];
+
+		int inner = 0, deepest = 0;
+		bool ready = true;
+		for (int slot = 0; slot < BVH_WIDTH; slot++){
+			int child = node.child[slot];
+			if (node.count[slot] > 0 || child < 0) continue;
+
+			inner++;
+			if (need[child] == 0){
+				stack.push_back(child);
+				ready = false;
+			}
+			else if (need[child] > deepest){
+				deepest = need[child];
+			}
+		}
+		if (!ready) continue;
+
+		// Every inner child is pushed at once, all but one wait while it is walked
+		need[index] = inner > 0 ? inner - 1 + deepest : 1;
+		stack.pop_back();
+	}
+	return need[0];
+}
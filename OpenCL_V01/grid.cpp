@@ -0,0 +1,320 @@
+#include <math.h>
+#include <string.h>
+#include "bvh.h"
+#include "grid.h"
+
+#define GRID_FLAT_EXTENT 0.05f // axes this much shorter than the longest are flat
+
+// Faces of a sub-grid that still has to be filled
+struct GridJob
+{
+	int level;
+	int depth;
+	std::vector<int> faces;
+};
+
+static void Resolution(const float *bmin, const float *bmax, int faceCount, float density, int res[3]){
+	float e[3];
+	float extent = 0;
+	for (int k = 0; k < 3; k++){
+		e[k] = bmax[k] - bmin[k];
+		if (e[k] > extent) extent = e[k];
+	}
+
+	// Cubic cells, density * faceCount of them over the box. Flat axes
+	// get a single cell and are left out, or the rest would be far too fine.
+	float measure = 1;
+	int dims = 0;
+	for (int k = 0; k < 3; k++){
+		if (e[k] > GRID_FLAT_EXTENT * extent){
+			measure *= e[k];
+			dims++;
+		}
+	}
+	float scale = dims > 0 ? powf(density * faceCount / measure, 1.0f / dims) : 0.0f;
+
+	for (int k = 0; k < 3; k++){
+		int r = e[k] > GRID_FLAT_EXTENT * extent ? (int)(e[k] * scale) : 1;
+		res[k] = r < 1 ? 1 : (r > GRID_MAX_RESOLUTION ? GRID_MAX_RESOLUTION : r);
+	}
+}
+
+// Distance of the box to the plane of the face, the cheap half of a
+// triangle/box test that drops most cells a sloped face only passes by
+static bool PlaneOverlaps(const float *verts, const int *face, const float *center, const float *half){
+	const float *v0 = &verts[3 * face[0]];
+	const float *v1 = &verts[3 * face[1]];
+	const float *v2 = &verts[3 * face[2]];
+
+	float e1[3], e2[3];
+	for (int k = 0; k < 3; k++){
+		e1[k] = v1[k] - v0[k];
+		e2[k] = v2[k] - v0[k];
+	}
+	float n[3] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+
+	float r = 0, s = 0;
+	for (int k = 0; k < 3; k++){
+		r += half[k] * fabsf(n[k]);
+		s += n[k] * (center[k] - v0[k]);
+	}
+	return fabsf(s) <= r;
+}
+
+// Cells the face boxes would reach in a level, an upper bound on its
+// references. Faces large against the cells make refining pointless.
+static double EstimateReferences(const GridLevel &level, const int *faceList, int count, const std::vector<AABB> &boxes){
+	double refs = 0;
+	for (int i = 0; i < count; i++){
+		const AABB &box = boxes[faceList[i]];
+		double cells = 1;
+		for (int k = 0; k < 3; k++){
+			float cellSize = (level.bmax[k] - level.bmin[k]) / level.res[k];
+			float span = (box.bmax[k] < level.bmax[k] ? box.bmax[k] : level.bmax[k]) - (box.bmin[k] > level.bmin[k] ? box.bmin[k] : level.bmin[k]);
+			cells *= (span > 0 ? span / cellSize : 0) + 1;
+		}
+		refs += cells;
+	}
+	return refs;
+}
+
+// Bin the faces of one level into its cells, dense cells become jobs
+static void FillLevel(Grid *grid, const GridJob &job, const float *verts, const int *faces, const std::vector<AABB> &boxes, std::vector<GridJob> *jobs){
+	GridLevel level = grid->levels[job.level];
+	int cellCount = level.res[0] * level.res[1] * level.res[2];
+
+	float cellSize[3], invCell[3];
+	for (int k = 0; k < 3; k++){
+		cellSize[k] = (level.bmax[k] - level.bmin[k]) / level.res[k];
+		invCell[k] = 1.0f / cellSize[k];
+	}
+
+	// Cells are grown a little so faces on a boundary land on both sides
+	float half[3];
+	for (int k = 0; k < 3; k++){
+		half[k] = 0.5f * cellSize[k] * 1.001f;
+	}
+
+	// (cell, face) pairs, then a counting sort by cell
+	std::vector<int> pairCells, pairFaces;
+	std::vector<int> counts(cellCount + 1, 0);
+
+	for (size_t f = 0; f < job.faces.size(); f++){
+		int face = job.faces[f];
+		const AABB &box = boxes[face];
+
+		int lo[3], hi[3];
+		for (int k = 0; k < 3; k++){
+			lo[k] = (int)floorf((box.bmin[k] - level.bmin[k]) * invCell[k]);
+			hi[k] = (int)floorf((box.bmax[k] - level.bmin[k]) * invCell[k]);
+			lo[k] = lo[k] < 0 ? 0 : (lo[k] >= level.res[k] ? level.res[k] - 1 : lo[k]);
+			hi[k] = hi[k] < 0 ? 0 : (hi[k] >= level.res[k] ? level.res[k] - 1 : hi[k]);
+		}
+
+		bool single = lo[0] == hi[0] && lo[1] == hi[1] && lo[2] == hi[2];
+
+		for (int z = lo[2]; z <= hi[2]; z++){
+			for (int y = lo[1]; y <= hi[1]; y++){
+				for (int x = lo[0]; x <= hi[0]; x++){
+					float center[3] = {
+						level.bmin[0] + (x + 0.5f) * cellSize[0],
+						level.bmin[1] + (y + 0.5f) * cellSize[1],
+						level.bmin[2] + (z + 0.5f) * cellSize[2] };
+					if (!single && !PlaneOverlaps(verts, &faces[3 * face], center, half)) continue;
+
+					int cell = (z * level.res[1] + y) * level.res[0] + x;
+					pairCells.push_back(cell);
+					pairFaces.push_back(face);
+					counts[cell + 1]++;
+				}
+			}
+		}
+	}
+
+	for (int c = 0; c < cellCount; c++){
+		counts[c + 1] += counts[c];
+	}
+
+	std::vector<int> sorted(pairFaces.size());
+	std::vector<int> next(counts.begin(), counts.end() - 1);
+	for (size_t i = 0; i < pairFaces.size(); i++){
+		sorted[next[pairCells[i]]++] = pairFaces[i];
+	}
+
+	int firstCell = (int)grid->cells.size();
+	grid->levels[job.level].firstCell = firstCell;
+	grid->cells.resize(firstCell + cellCount);
+
+	for (int c = 0; c < cellCount; c++){
+		int first = counts[c];
+		int count = counts[c + 1] - counts[c];
+		GridCell &cell = grid->cells[firstCell + c];
+
+		if (count > GRID_MAX_CELL_FACES && job.depth + 1 < GRID_MAX_DEPTH){
+			int x = c % level.res[0];
+			int y = (c / level.res[0]) % level.res[1];
+			int z = c / (level.res[0] * level.res[1]);
+			int cellIndex[3] = { x, y, z };
+
+			// The sub-grid covers exactly the cell the kernel stepped into
+			GridLevel child;
+			for (int k = 0; k < 3; k++){
+				child.bmin[k] = level.bmin[k] + cellIndex[k] * cellSize[k];
+				child.bmax[k] = cellIndex[k] + 1 == level.res[k] ? level.bmax[k] : level.bmin[k] + (cellIndex[k] + 1) * cellSize[k];
+			}
+			child.firstCell = -1;
+			Resolution(child.bmin, child.bmax, count, GRID_DENSITY, child.res);
+
+			// Coarser until the faces fit, large faces end up in this cell
+			while (child.res[0] * child.res[1] * child.res[2] > 1 &&
+				EstimateReferences(child, &sorted[first], count, boxes) > GRID_MAX_DUPLICATION * count){
+				for (int k = 0; k < 3; k++){
+					child.res[k] = (child.res[k] + 1) / 2;
+				}
+			}
+
+			if (child.res[0] * child.res[1] * child.res[2] > 1){
+				cell.first = (int)grid->levels.size();
+				cell.count = -1;
+				grid->levels.push_back(child);
+
+				GridJob sub;
+				sub.level = cell.first;
+				sub.depth = job.depth + 1;
+				sub.faces.assign(sorted.begin() + first, sorted.begin() + first + count);
+				jobs->push_back(sub);
+				continue;
+			}
+		}
+
+		cell.first = (int)grid->triIndices.size();
+		cell.count = count;
+		grid->triIndices.insert(grid->triIndices.end(), sorted.begin() + first, sorted.begin() + first + count);
+	}
+}
+
+void BuildGrid(Grid *grid, const float *verts, const int *faces, int faceCount){
+	grid->levels.clear();
+	grid->cells.clear();
+	grid->triIndices.clear();
+
+	std::vector<AABB> boxes(faceCount);
+	AABB bounds;
+	for (int i = 0; i < faceCount; i++){
+		for (int v = 0; v < 3; v++){
+			boxes[i].Grow(&verts[3 * faces[3 * i + v]]);
+		}
+		bounds.Grow(boxes[i]);
+	}
+
+	GridLevel top;
+	top.firstCell = 0;
+
+	// Empty scene, one empty cell in an inverted box that every ray misses
+	if (faceCount == 0){
+		for (int k = 0; k < 3; k++){
+			top.bmin[k] = bounds.bmin[k];
+			top.bmax[k] = bounds.bmax[k];
+			top.res[k] = 1;
+		}
+		grid->levels.push_back(top);
+		GridCell empty = { 0, 0 };
+		grid->cells.push_back(empty);
+		return;
+	}
+
+	// Pad flat scenes so every axis has cells of some size
+	float extent = 0;
+	for (int k = 0; k < 3; k++){
+		float e = bounds.bmax[k] - bounds.bmin[k];
+		if (e > extent) extent = e;
+	}
+	float pad = extent > 0 ? 1e-4f * extent : 1e-4f;
+	for (int k = 0; k < 3; k++){
+		top.bmin[k] = bounds.bmin[k] - pad;
+		top.bmax[k] = bounds.bmax[k] + pad;
+	}
+	Resolution(top.bmin, top.bmax, faceCount, GRID_TOP_DENSITY, top.res);
+	grid->levels.push_back(top);
+
+	std::vector<GridJob> jobs(1);
+	jobs[0].level = 0;
+	jobs[0].depth = 0;
+	jobs[0].faces.resize(faceCount);
+	for (int i = 0; i < faceCount; i++){
+		jobs[0].faces[i] = i;
+	}
+
+	// Breadth first, so every level's sub-grids follow it in levels
+	for (size_t j = 0; j < jobs.size(); j++){
+		GridJob job;
+		job.level = jobs[j].level;
+		job.depth = jobs[j].depth;
+		job.faces.swap(jobs[j].faces);
+		FillLevel(grid, job, verts, faces, boxes, &jobs);
+	}
+}
+
+void ComputeGridStats(GridStats *stats, const Grid *grid, int faceCount){
+	memset(stats, 0, sizeof(*stats));
+	stats->levelCount = (int)grid->levels.size();
+	stats->cellCount = (int)grid->cells.size();
+	stats->refCount = (int)grid->triIndices.size();
+	stats->faceCount = faceCount;
+
+	// Sub-grids always come after the level that names them
+	std::vector<int> depth(grid->levels.size(), 0);
+	for (size_t l = 0; l < grid->levels.size(); l++){
+		const GridLevel &level = grid->levels[l];
+		int cellCount = level.res[0] * level.res[1] * level.res[2];
+		if (depth[l] > stats->maxDepth) stats->maxDepth = depth[l];
+
+		for (int c = level.firstCell; c < level.firstCell + cellCount; c++){
+			const GridCell &cell = grid->cells[c];
+			if (cell.count < 0){
+				depth[cell.first] = depth[l] + 1;
+			}
+			else if (cell.count == 0){
+				stats->emptyCells++;
+			}
+			else {
+				stats->leafCells++;
+				if (cell.count > stats->maxCellFaces) stats->maxCellFaces = cell.count;
+			}
+		}
+	}
+
+	if (stats->leafCells > 0) stats->averageCellFaces = (float)stats->refCount / stats->leafCells;
+
+	stats->nodeBytes = grid->levels.size() * sizeof(GridLevel) + grid->cells.size() * sizeof(GridCell);
+	stats->faceBytes = (size_t)stats->refCount * 4 * sizeof(int);
+	if (faceCount > 0) stats->bytesPerFace = (float)(stats->nodeBytes + stats->faceBytes) / faceCount;
+}
+
+void PrintGridStats(const char *name, const GridStats &stats){
+	printf("%s: %d levels (depth %d), %d cells (%d empty, %d with faces), %d references for %d faces\n", name,
+		stats.levelCount, stats.maxDepth + 1, stats.cellCount, stats.emptyCells, stats.leafCells, stats.refCount, stats.faceCount);
+	printf("  faces per cell average %.1f, max %d\n", stats.averageCellFaces, stats.maxCellFaces);
+	printf("  memory %.1f KB cells + %.1f KB faces, %.1f bytes per face\n", stats.nodeBytes / 1024.0,
+		stats.faceBytes / 1024.0, stats.bytesPerFace);
+}
+
+bool WriteGridStatsJSON(FILE *file, const char *name, const GridStats &stats){
+	fprintf(file, "{\n");
+	fprintf(file, "\t\"name\": \"%s\",\n", name);
+	fprintf(file, "\t\"levels\": %d,\n", stats.levelCount);
+	fprintf(file, "\t\"maxDepth\": %d,\n", stats.maxDepth);
+	fprintf(file, "\t\"cells\": %d,\n", stats.cellCount);
+	fprintf(file, "\t\"emptyCells\": %d,\n", stats.emptyCells);
+	fprintf(file, "\t\"leafCells\": %d,\n", stats.leafCells);
+	fprintf(file, "\t\"references\": %d,\n", stats.refCount);
+	fprintf(file, "\t\"faces\": %d,\n", stats.faceCount);
+	fprintf(file, "\t\"maxCellFaces\": %d,\n", stats.maxCellFaces);
+	fprintf(file, "\t\"averageCellFaces\": %.3f,\n", stats.averageCellFaces);
+	fprintf(file, "\t\"nodeBytes\": %lu,\n", (unsigned long)stats.nodeBytes);
+	fprintf(file, "\t\"faceBytes\": %lu,\n", (unsigned long)stats.faceBytes);
+	fprintf(file, "\t\"bytesPerFace\": %.2f\n", stats.bytesPerFace);
+	fprintf(file, "}");
+
+	return ferror(file) == 0;
+}
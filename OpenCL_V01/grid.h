@@ -0,0 +1,64 @@
+#ifndef GRID_H
+#define GRID_H
+
+#include <stdio.h>
+#include <vector>
+
+#define GRID_TOP_DENSITY 0.0625f // top level cells per face, coarse on purpose
+#define GRID_DENSITY 2.0f // cells per face inside a sub-grid
+#define GRID_MAX_CELL_FACES 8 // cells with more faces get a sub-grid
+#define GRID_MAX_DUPLICATION 8.0f // cells a face's box may reach on average in a sub-grid
+#define GRID_MAX_DEPTH 3 // levels including the top, mirrored in kernels/image.cl
+#define GRID_MAX_RESOLUTION 128 // cells per axis of one level
+
+// One level of the hierarchy, mirrored by GridLevel in kernels/image.cl.
+// Its res[0] * res[1] * res[2] cells start at firstCell, x fastest.
+struct GridLevel
+{
+	float bmin[3];
+	int firstCell;
+	float bmax[3];
+	int res[3];
+};
+
+// Mirrored by GridCell in kernels/image.cl. A cell with count >= 0 holds
+// faces [first, first + count), count < 0 means first is a sub-grid level
+// covering exactly this cell.
+struct GridCell
+{
+	int first;
+	int count;
+};
+
+struct Grid
+{
+	std::vector<GridLevel> levels; // level 0 covers the scene
+	std::vector<GridCell> cells;
+	std::vector<int> triIndices; // cell order -> original face, faces repeat
+};
+
+// Multi-level uniform grid over the arrays from VertsToFloat3/FacesToVerts.
+// Dense cells of each level are refined by a sub-grid, up to GRID_MAX_DEPTH.
+void BuildGrid(Grid *grid, const float *verts, const int *faces, int faceCount);
+
+struct GridStats
+{
+	int levelCount;
+	int maxDepth;
+	int cellCount;
+	int emptyCells;
+	int leafCells; // cells holding faces
+	int refCount;
+	int faceCount;
+	int maxCellFaces;
+	float averageCellFaces; // over cells holding faces
+	size_t nodeBytes; // levels and cells
+	size_t faceBytes;
+	float bytesPerFace;
+};
+
+void ComputeGridStats(GridStats *stats, const Grid *grid, int faceCount);
+void PrintGridStats(const char *name, const GridStats &stats);
+bool WriteGridStatsJSON(FILE *file, const char *name, const GridStats &stats);
+
+#endif
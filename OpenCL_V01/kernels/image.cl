@@ -3,6 +3,96 @@ __constant sampler_t sampler =
 | CLK_ADDRESS_CLAMP_TO_EDGE
 | CLK_FILTER_NEAREST;
 
+// Object space offset of the loaded mesh
+#define MESH_OFFSET (float3)(0.0,-3.0,7.0)
+
+// Entries of a traversal stack, the host passes the deepest walk of the
+// scene's trees so none is ever dropped
+#ifndef BVH_STACK_SIZE
+#define BVH_STACK_SIZE 64
+#endif
+
+// Rays a persistent work-item takes per fetch, fewer atomics against coherence
+#define PERSISTENT_BATCH 4
+
+// Point light, shadow rays start this far off the surface
+#define LIGHT_POS (float3)(0.0,0.0,7.0)
+#define SHADOW_BIAS 1e-3f
+#define SHADOW_AMBIENT 0.25f
+
+#define FLOOR_NORMAL (float3)(0.0,0.0,1.0)
+
+// Stackless traversal states
+#define FROM_PARENT 0
+#define FROM_SIBLING 1
+#define FROM_CHILD 2
+
+// Flattened BVH node, mirrors BVHNode in bvh.h
+typedef struct
+{
+	float bmin[3];
+	int leftFirst;
+	float bmax[3];
+	int count;
+} BVHNode;
+
+// Placement of one object, mirrors BVHInstance in scene.h
+typedef struct
+{
+	float worldToObject[12];
+	float objectToWorld[12];
+	int blasRoot;
+	int blasIndex;
+	int objectIndex;
+	int pad;
+} BVHInstance;
+
+#ifndef BVH_WIDTH
+#define BVH_WIDTH 8
+#endif
+
+// Collapsed node with 8-bit child boxes, mirrors WideBVHNode in bvh.h
+typedef struct
+{
+	float origin[3];
+	float scale[3];
+	int child[BVH_WIDTH];
+	uchar qmin[3][BVH_WIDTH];
+	uchar qmax[3][BVH_WIDTH];
+	uchar count[BVH_WIDTH];
+} WideBVHNode;
+
+#ifndef GRID_MAX_DEPTH
+#define GRID_MAX_DEPTH 3
+#endif
+
+// Level of the multi-level grid, mirrors GridLevel in grid.h
+typedef struct
+{
+	float bmin[3];
+	int firstCell;
+	float bmax[3];
+	int res[3];
+} GridLevel;
+
+// Face range, or a sub-grid level when count < 0, mirrors GridCell in grid.h
+typedef struct
+{
+	int first;
+	int count;
+} GridCell;
+
+// Kernel arguments 6 and 7 of the structure the program is built for
+#if defined(USE_GRID)
+typedef GridLevel TraversalNode;
+typedef GridCell TraversalLink;
+#elif defined(USE_WIDE_BVH)
+typedef WideBVHNode TraversalNode;
+typedef int TraversalLink;
+#else
+typedef BVHNode TraversalNode;
+typedef int TraversalLink; // parent of every node
+#endif
 
 // Floor plane
 bool plane(float3 pos, float3 norm, float3 ro, float3 rd, float3 *hit, float *dist)
@@ -16,16 +106,11 @@ bool plane(float3 pos, float3 norm, float3 ro, float3 rd, float3 *hit, float *di
 	return true;
 }
 
-// Geometry
-bool triangle(float3 v0, float3 v1, float3 v2, float3 ro, float3 rd, float3 *hit, float *dist, float3 *norm)
+// Geometry, v0 is in object space and the edges are v2 - v0 and v1 - v0
+bool triangle(float3 v0, float3 edge1, float3 edge2, float3 ro, float3 rd, float3 *hit, float *dist, float3 *norm)
 {
-	float3 cubePos = (float3)(0.0,-3.0,7.0);
+	float3 cubePos = MESH_OFFSET;
 	v0 = cubePos + v0;
-	v1 = cubePos + v1;
-	v2 = cubePos + v2;
-
-	float3 edge1 = v2 - v0;
-	float3 edge2 = v1 - v0;
 
 	float3 pvec = cross(rd, edge2);
 
@@ -98,7 +183,7 @@ float3 refractionFace(float3 rayDir, float3 N){
 float lightFace(float3 N, float3 Pos){
 
 	// Light attenuation //
-	float3 LPos = (float3)(0,0.0,7.0);
+	float3 LPos = LIGHT_POS;
 	float Ldist = length(LPos - Pos);
 	float a = 0.1;
 	float b = 0.01;
@@ -107,35 +192,451 @@ float lightFace(float3 N, float3 Pos){
 	return dot(N, LPos - Pos) * att;
 }
 
-// Find intersecting face
-int getIntersection(float3 rayOrigin, float3 rayDir, float3* hit2, float3* norm2, __constant int* faces, __constant float* verts, __constant int* faceCount){//, *hit, *dist, *norm){
-	float3 v1,v2,v3;
-	float3 minHit, minNorm;
-	float minDist = 999999.0;
-	int k;
+// Row major 3x4 affine transforms
+float3 transformPoint(__global const float* m, float3 p){
+	return (float3)(dot(vload4(0, m), (float4)(p, 1.0f)), dot(vload4(1, m), (float4)(p, 1.0f)), dot(vload4(2, m), (float4)(p, 1.0f)));
+}
+
+float3 transformVector(__global const float* m, float3 v){
+	return (float3)(dot(vload4(0, m), (float4)(v, 0.0f)), dot(vload4(1, m), (float4)(v, 0.0f)), dot(vload4(2, m), (float4)(v, 0.0f)));
+}
 
+// Normals go through the transpose of the inverse
+float3 transformNormal(__global const float* inv, float3 n){
+	return vload3(0, inv) * n.x + vload3(0, inv + 4) * n.y + vload3(0, inv + 8) * n.z;
+}
+
+// Slab test, returns the entry distance or INFINITY on a miss
+float boxEntry(__global const BVHNode* node, float3 ro, float3 invDir, float maxDist){
+	float3 t0 = (vload3(0, node->bmin) - ro) * invDir;
+	float3 t1 = (vload3(0, node->bmax) - ro) * invDir;
+	float3 tmin = fmin(t0, t1);
+	float3 tmax = fmax(t0, t1);
+
+	float tnear = fmax(fmax(tmin.x, tmin.y), fmax(tmin.z, 0.0f));
+	float tfar = fmin(fmin(tmax.x, tmax.y), fmin(tmax.z, maxDist));
+
+	return tnear <= tfar ? tnear : INFINITY;
+}
+
+// Slab test against a dequantized child box of a wide node
+float wideChildEntry(__global const WideBVHNode* node, int slot, float3 origin, float3 scale, float3 ro, float3 invDir, float maxDist){
+	float3 qmin = (float3)(node->qmin[0][slot], node->qmin[1][slot], node->qmin[2][slot]);
+	float3 qmax = (float3)(node->qmax[0][slot], node->qmax[1][slot], node->qmax[2][slot]);
+	float3 t0 = (fma(qmin, scale, origin) - ro) * invDir;
+	float3 t1 = (fma(qmax, scale, origin) - ro) * invDir;
+	float3 tmin = fmin(t0, t1);
+	float3 tmax = fmax(t0, t1);
+
+	float tnear = fmax(fmax(tmin.x, tmin.y), fmax(tmin.z, 0.0f));
+	float tfar = fmin(fmin(tmax.x, tmax.y), fmin(tmax.z, maxDist));
+
+	return tnear <= tfar ? tnear : INFINITY;
+}
+
+// Child visited first, the same answer every time a node is revisited
+int nearChild(__global const BVHNode* nodes, int n, float3 rayDir){
+	int left = nodes[n].leftFirst;
+	float3 cl = vload3(0, nodes[left].bmin) + vload3(0, nodes[left].bmax);
+	float3 cr = vload3(0, nodes[left+1].bmin) + vload3(0, nodes[left+1].bmax);
+	return dot(cl - cr, rayDir) <= 0.0f ? left : left + 1;
+}
+
+// Left children sit at odd indices with the right child after them
+int siblingOf(int n){
+	return (n & 1) ? n + 1 : n - 1;
+}
+
+// Test a single face, keeping the closest hit in front of the ray
+void testFace(int k, float3 rayOrigin, float3 rayDir, __global const float4* triangles, float* minDist, float3* minHit, float3* minNorm, int* hitFaceIndex){
 	float3 hit;
 	float dist;
 	float3 norm;
 
+	// Packed record, see PackTriangles
+	float3 v0 = triangles[3*k+0].xyz;
+	float3 edge1 = triangles[3*k+1].xyz;
+	float3 edge2 = triangles[3*k+2].xyz;
+
+	// Colision check
+	if(triangle(v0, edge1, edge2, rayOrigin, rayDir, &hit, &dist, &norm)){
+		if(dist > 0.0f && dist < *minDist){
+			*minDist = dist;
+			*minHit = hit;
+			*minNorm = norm;
+			*hitFaceIndex = k;
+		}
+	}
+}
+
+// Any hit closer than maxDist, without the hit point or normal
+bool occludeFace(int k, float3 rayOrigin, float3 rayDir, __global const float4* triangles, float maxDist){
+	float3 v0 = triangles[3*k+0].xyz + MESH_OFFSET;
+	float3 edge1 = triangles[3*k+1].xyz;
+	float3 edge2 = triangles[3*k+2].xyz;
+
+	float3 pvec = cross(rayDir, edge2);
+	float det = dot(edge1, pvec);
+	if(det == 0) return false;
+
+	float invDet = 1 / det;
+	float3 tvec = rayOrigin - v0;
+	float u = dot(tvec, pvec) * invDet;
+	if(u < 0 || u > 1) return false;
+
+	float3 qvec = cross(tvec, edge1);
+	float v = dot(rayDir, qvec) * invDet;
+	if(v < 0 || u + v > 1) return false;
+
+	float dist = dot(edge2, qvec) * invDet;
+	return dist > 0.0f && dist < maxDist;
+}
+
+// Closest hit below root of a binary BVH, ro is the origin in node space
+void traverseBVH(int root, float3 rayOrigin, float3 rayDir, float3 ro, float3 invDir, __global const float4* triangles, __global const BVHNode* nodes, float* minDist, float3* minHit, float3* minNorm, int* hitFaceIndex){
+	int k;
+	int stack[BVH_STACK_SIZE];
+	int stackPtr = 0;
+
+	if(boxEntry(&nodes[root], ro, invDir, *minDist) != INFINITY){
+		stack[stackPtr++] = root;
+	}
+
+	while(stackPtr > 0){
+		__global const BVHNode* node = &nodes[stack[--stackPtr]];
+
+		// Leaf
+		if(node->count > 0){
+			for(k=node->leftFirst; k<node->leftFirst + node->count; k++){
+				testFace(k, rayOrigin, rayDir, triangles, minDist, minHit, minNorm, hitFaceIndex);
+			}
+			continue;
+		}
+
+		// Visit the nearer child first, skip children behind the closest hit
+		int nearChild = node->leftFirst;
+		int farChild = node->leftFirst + 1;
+		float dNear = boxEntry(&nodes[nearChild], ro, invDir, *minDist);
+		float dFar = boxEntry(&nodes[farChild], ro, invDir, *minDist);
+
+		if(dFar < dNear){
+			int tmp = nearChild; nearChild = farChild; farChild = tmp;
+			float tmpDist = dNear; dNear = dFar; dFar = tmpDist;
+		}
+
+		if(dFar != INFINITY){
+			stack[stackPtr++] = farChild;
+		}
+		if(dNear != INFINITY){
+			stack[stackPtr++] = nearChild;
+		}
+	}
+}
+
+// Any hit below root of a binary BVH before maxDist. Children are not
+// sorted, and a leaf child is tested as soon as its box is hit instead of
+// going through the stack, so shadow rays reach faces early.
+bool occludedBVH(int root, float3 rayOrigin, float3 rayDir, float3 ro, float3 invDir, __global const float4* triangles, __global const BVHNode* nodes, float maxDist){
+	int k, c;
+	int stack[BVH_STACK_SIZE];
+	int stackPtr = 0;
+
+	if(boxEntry(&nodes[root], ro, invDir, maxDist) == INFINITY) return false;
+	stack[stackPtr++] = root;
+
+	while(stackPtr > 0){
+		__global const BVHNode* node = &nodes[stack[--stackPtr]];
+
+		// Only the root gets here as a leaf
+		if(node->count > 0){
+			for(k=node->leftFirst; k<node->leftFirst + node->count; k++){
+				if(occludeFace(k, rayOrigin, rayDir, triangles, maxDist)) return true;
+			}
+			continue;
+		}
+
+		for(c=0; c<2; c++){
+			__global const BVHNode* child = &nodes[node->leftFirst + c];
+			if(boxEntry(child, ro, invDir, maxDist) == INFINITY) continue;
+
+			if(child->count > 0){
+				for(k=child->leftFirst; k<child->leftFirst + child->count; k++){
+					if(occludeFace(k, rayOrigin, rayDir, triangles, maxDist)) return true;
+				}
+			}
+			else {
+				stack[stackPtr++] = node->leftFirst + c;
+			}
+		}
+	}
+	return false;
+}
+
+// Closest hit in a multi-level grid, stepping cells front to back with a
+// 3D DDA (Amanatides & Woo 1987). A dense cell holds a sub-grid that is
+// stepped over the cell's span of the ray before its parent moves on.
+// With anyHit the walk ends at the first face closer than *minDist, only
+// hitFaceIndex is set then.
+void traverseGrid(float3 rayOrigin, float3 rayDir, float3 ro, float3 invDir, __global const float4* triangles, __global const GridLevel* levels, __global const GridCell* cells, float* minDist, float3* minHit, float3* minNorm, int* hitFaceIndex, bool anyHit){
+	int k;
+	int level[GRID_MAX_DEPTH];
+	int3 cell[GRID_MAX_DEPTH];
+	float3 tMax[GRID_MAX_DEPTH];
+	float tEntry[GRID_MAX_DEPTH];
+	float tExit[GRID_MAX_DEPTH];
+	int3 step = (int3)(rayDir.x < 0.0f ? -1 : 1, rayDir.y < 0.0f ? -1 : 1, rayDir.z < 0.0f ? -1 : 1);
+
+	// Span of the ray inside the top level
+	float3 t0 = (vload3(0, levels[0].bmin) - ro) * invDir;
+	float3 t1 = (vload3(0, levels[0].bmax) - ro) * invDir;
+	float3 tmin = fmin(t0, t1);
+	float3 tmax = fmax(t0, t1);
+	float tnear = fmax(fmax(tmin.x, tmin.y), fmax(tmin.z, 0.0f));
+	float tfar = fmin(fmin(tmax.x, tmax.y), fmin(tmax.z, *minDist));
+	if(tnear > tfar) return;
+
+	int depth = 0;
+	level[0] = 0;
+	tEntry[0] = tnear;
+	tExit[0] = tfar;
+
+	// Entering a level finds the first cell and the next plane on each axis
+	bool enter = true;
+
+	while(depth >= 0){
+		__global const GridLevel* grid = &levels[level[depth]];
+		float3 bmin = vload3(0, grid->bmin);
+		int3 res = (int3)(grid->res[0], grid->res[1], grid->res[2]);
+		float3 cellSize = (vload3(0, grid->bmax) - bmin) / convert_float3(res);
+
+		if(enter){
+			float3 p = ro + rayDir * tEntry[depth];
+			cell[depth] = clamp(convert_int3(floor((p - bmin) / cellSize)), (int3)(0), res - 1);
+			float3 next = bmin + convert_float3(cell[depth] + max(step, (int3)(0))) * cellSize;
+			tMax[depth] = (float3)(
+				rayDir.x != 0.0f ? (next.x - ro.x) * invDir.x : INFINITY,
+				rayDir.y != 0.0f ? (next.y - ro.y) * invDir.y : INFINITY,
+				rayDir.z != 0.0f ? (next.z - ro.z) * invDir.z : INFINITY);
+			enter = false;
+		}
+
+		int3 c = cell[depth];
+		float3 t = tMax[depth];
+		float entry = tEntry[depth];
+		float exit = fmin(fmin(t.x, t.y), fmin(t.z, tExit[depth]));
+		GridCell gridCell = cells[grid->firstCell + (c.z * res.y + c.y) * res.x + c.x];
+
+		// Step this level past the cell first, the cell is then handled
+		// as if it were the last one of its level
+		bool last = exit >= tExit[depth];
+		if(!last){
+			float3 tDelta = cellSize * fabs(invDir);
+			if(t.x <= t.y && t.x <= t.z){
+				cell[depth].x += step.x;
+				tMax[depth].x += tDelta.x;
+				last = cell[depth].x < 0 || cell[depth].x >= res.x;
+			}
+			else if(t.y <= t.z){
+				cell[depth].y += step.y;
+				tMax[depth].y += tDelta.y;
+				last = cell[depth].y < 0 || cell[depth].y >= res.y;
+			}
+			else {
+				cell[depth].z += step.z;
+				tMax[depth].z += tDelta.z;
+				last = cell[depth].z < 0 || cell[depth].z >= res.z;
+			}
+		}
+		tEntry[depth] = exit;
+		if(last) depth--;
+
+		if(gridCell.count < 0){
+			// The host never nests deeper than GRID_MAX_DEPTH
+			depth++;
+			level[depth] = gridCell.first;
+			tEntry[depth] = entry;
+			tExit[depth] = exit;
+			enter = true;
+			continue;
+		}
+
+		for(k=gridCell.first; k<gridCell.first + gridCell.count; k++){
+			if(!anyHit){
+				testFace(k, rayOrigin, rayDir, triangles, minDist, minHit, minNorm, hitFaceIndex);
+			}
+			else if(occludeFace(k, rayOrigin, rayDir, triangles, *minDist)){
+				*hitFaceIndex = k;
+				return;
+			}
+		}
+
+		// Every cell left starts behind this one
+		if(*minDist <= exit) return;
+	}
+}
+
+// Find intersecting face
+int getIntersection(float3 rayOrigin, float3 rayDir, float3* hit2, float3* norm2, __global const float4* triangles, __constant int* faceCount, __global const TraversalNode* nodes, __global const TraversalLink* links, __global const BVHNode* tlasNodes, __global const BVHInstance* instances){//, *hit, *dist, *norm){
+	float3 minHit, minNorm;
+	float minDist = 999999.0;
+	int k;
+
 	int hitFaceIndex = -1;
 
-	// For each face in faces array
-	for(k=0; k<*faceCount; k++){
-		v1 = (float3)( verts[3*faces[3*k]+0],	verts[3*faces[3*k]+1],		verts[3*faces[3*k]+2] );
-		v2 = (float3)( verts[3*faces[3*k+1]+0],	verts[3*faces[3*k+1]+1],	verts[3*faces[3*k+1]+2] );
-		v3 = (float3)( verts[3*faces[3*k+2]+0],	verts[3*faces[3*k+2]+1],	verts[3*faces[3*k+2]+2] );
-
-		// Colision check
-		if(triangle(v1, v2, v3, rayOrigin, rayDir, &hit, &dist, &norm)){
-			if(dist < minDist){
-				minDist = dist;
-				minHit = hit;
-				minNorm = norm;
-				hitFaceIndex = k;
+#if defined(USE_BVH) && defined(USE_WIDE_BVH)
+	// Boxes are in object space, triangle() applies the offset itself
+	float3 ro = rayOrigin - MESH_OFFSET;
+	float3 invDir = 1.0f / rayDir;
+
+	// Slot (octant ^ i) is the i-th child to visit for this ray direction
+	int octant = ((rayDir.x < 0.0f) ? 1 : 0) | ((rayDir.y < 0.0f) ? 2 : 0) | ((rayDir.z < 0.0f) ? 4 : 0);
+	octant &= BVH_WIDTH - 1;
+
+	int stack[BVH_STACK_SIZE];
+	int stackPtr = 0;
+	int i, slot;
+	stack[stackPtr++] = 0;
+
+	while(stackPtr > 0){
+		__global const WideBVHNode* node = &nodes[stack[--stackPtr]];
+		float3 origin = vload3(0, node->origin);
+		float3 scale = vload3(0, node->scale);
+
+		// Inner children far to near, so the nearest ends on top of the stack
+		for(i=BVH_WIDTH-1; i>=0; i--){
+			slot = octant ^ i;
+			if(node->count[slot] > 0 || node->child[slot] < 0) continue;
+
+			if(wideChildEntry(node, slot, origin, scale, ro, invDir, minDist) != INFINITY){
+				stack[stackPtr++] = node->child[slot];
+			}
+		}
+
+		// Leaves near to far
+		for(i=0; i<BVH_WIDTH; i++){
+			slot = octant ^ i;
+			if(node->count[slot] == 0) continue;
+			if(wideChildEntry(node, slot, origin, scale, ro, invDir, minDist) == INFINITY) continue;
+
+			for(k=node->child[slot]; k<node->child[slot] + node->count[slot]; k++){
+				testFace(k, rayOrigin, rayDir, triangles, &minDist, &minHit, &minNorm, &hitFaceIndex);
 			}
 		}
 	}
+#elif defined(USE_BVH) && defined(USE_STACKLESS)
+	// Parent/sibling state machine (Hapala et al. 2011), no private stack
+	float3 ro = rayOrigin - MESH_OFFSET;
+	float3 invDir = 1.0f / rayDir;
+	__global const BVHNode* node = &nodes[0];
+
+	if(boxEntry(node, ro, invDir, minDist) != INFINITY){
+		if(node->count > 0){
+			for(k=node->leftFirst; k<node->leftFirst + node->count; k++){
+				testFace(k, rayOrigin, rayDir, triangles, &minDist, &minHit, &minNorm, &hitFaceIndex);
+			}
+		}
+		else {
+			int current = nearChild(nodes, 0, rayDir);
+			int state = FROM_PARENT;
+
+			while(true){
+				// Climbing back up, take the far child if it is still pending
+				if(state == FROM_CHILD){
+					if(current == 0) break;
+
+					int parent = links[current];
+					if(current == nearChild(nodes, parent, rayDir)){
+						current = siblingOf(current);
+						state = FROM_SIBLING;
+					}
+					else {
+						current = parent;
+					}
+					continue;
+				}
+
+				node = &nodes[current];
+				bool hitBox = boxEntry(node, ro, invDir, minDist) != INFINITY;
+
+				if(hitBox && node->count == 0){
+					current = nearChild(nodes, current, rayDir);
+					state = FROM_PARENT;
+					continue;
+				}
+
+				if(hitBox){
+					for(k=node->leftFirst; k<node->leftFirst + node->count; k++){
+						testFace(k, rayOrigin, rayDir, triangles, &minDist, &minHit, &minNorm, &hitFaceIndex);
+					}
+				}
+
+				if(state == FROM_PARENT){
+					current = siblingOf(current);
+					state = FROM_SIBLING;
+				}
+				else {
+					current = links[current];
+					state = FROM_CHILD;
+				}
+			}
+		}
+	}
+#elif defined(USE_BVH) && defined(USE_TLAS)
+	// Instances are placed in object space, triangle() applies the offset itself
+	float3 ro = rayOrigin - MESH_OFFSET;
+	float3 invDir = 1.0f / rayDir;
+	int hitInstance = -1;
+
+	int stack[BVH_STACK_SIZE];
+	int stackPtr = 0;
+
+	if(boxEntry(&tlasNodes[0], ro, invDir, minDist) != INFINITY){
+		stack[stackPtr++] = 0;
+	}
+
+	while(stackPtr > 0){
+		__global const BVHNode* node = &tlasNodes[stack[--stackPtr]];
+
+		if(node->count == 0){
+			int left = node->leftFirst;
+			if(boxEntry(&tlasNodes[left+1], ro, invDir, minDist) != INFINITY){
+				stack[stackPtr++] = left + 1;
+			}
+			if(boxEntry(&tlasNodes[left], ro, invDir, minDist) != INFINITY){
+				stack[stackPtr++] = left;
+			}
+			continue;
+		}
+
+		// Walk each instance's BLAS with the ray in its object space, the
+		// direction is not renormalized so distances stay comparable
+		for(k=node->leftFirst; k<node->leftFirst + node->count; k++){
+			__global const BVHInstance* instance = &instances[k];
+			float3 objOrigin = transformPoint(instance->worldToObject, ro);
+			float3 objDir = transformVector(instance->worldToObject, rayDir);
+			int before = hitFaceIndex;
+
+			traverseBVH(instance->blasRoot, objOrigin + MESH_OFFSET, objDir, objOrigin, 1.0f / objDir, triangles, nodes, &minDist, &minHit, &minNorm, &hitFaceIndex);
+			if(hitFaceIndex != before) hitInstance = k;
+		}
+	}
+
+	if(hitInstance >= 0){
+		minHit = rayOrigin + rayDir * minDist;
+		minNorm = transformNormal(instances[hitInstance].worldToObject, minNorm);
+	}
+#elif defined(USE_GRID)
+	// Cells are in object space, triangle() applies the offset itself
+	traverseGrid(rayOrigin, rayDir, rayOrigin - MESH_OFFSET, 1.0f / rayDir, triangles, nodes, links, &minDist, &minHit, &minNorm, &hitFaceIndex, false);
+#elif defined(USE_BVH)
+	// Boxes are in object space, triangle() applies the offset itself
+	traverseBVH(0, rayOrigin, rayDir, rayOrigin - MESH_OFFSET, 1.0f / rayDir, triangles, nodes, &minDist, &minHit, &minNorm, &hitFaceIndex);
+#else
+	// For each face in faces array
+	for(k=0; k<*faceCount; k++){
+		testFace(k, rayOrigin, rayDir, triangles, &minDist, &minHit, &minNorm, &hitFaceIndex);
+	}
+#endif
 
 	*hit2 = minHit;
 	*norm2 = minNorm;
@@ -143,17 +644,178 @@ int getIntersection(float3 rayOrigin, float3 rayDir, float3* hit2, float3* norm2
 	return hitFaceIndex;
 }
 
-float3 getPointColor( int objIndex, __constant int* faceMat, __constant float* Materials ){
+// Shadow and visibility query, true when any face lies between the origin
+// and origin + rayDir * maxDist. Stops at the first hit and keeps no hit
+// record, and each structure is walked in whatever order finds a blocker
+// soonest rather than front to back.
+bool occluded(float3 rayOrigin, float3 rayDir, float maxDist, __global const float4* triangles, __constant int* faceCount, __global const TraversalNode* nodes, __global const TraversalLink* links, __global const BVHNode* tlasNodes, __global const BVHInstance* instances){
+	int k;
+
+#if defined(USE_BVH) && defined(USE_WIDE_BVH)
+	float3 ro = rayOrigin - MESH_OFFSET;
+	float3 invDir = 1.0f / rayDir;
+
+	int stack[BVH_STACK_SIZE];
+	int stackPtr = 0;
+	int slot;
+	stack[stackPtr++] = 0;
+
+	// Leaf children are tested on the spot, inner ones wait on the stack
+	while(stackPtr > 0){
+		__global const WideBVHNode* node = &nodes[stack[--stackPtr]];
+		float3 origin = vload3(0, node->origin);
+		float3 scale = vload3(0, node->scale);
+
+		for(slot=0; slot<BVH_WIDTH; slot++){
+			if(node->count[slot] == 0 && node->child[slot] < 0) continue;
+			if(wideChildEntry(node, slot, origin, scale, ro, invDir, maxDist) == INFINITY) continue;
+
+			if(node->count[slot] == 0){
+				stack[stackPtr++] = node->child[slot];
+				continue;
+			}
+
+			for(k=node->child[slot]; k<node->child[slot] + node->count[slot]; k++){
+				if(occludeFace(k, rayOrigin, rayDir, triangles, maxDist)) return true;
+			}
+		}
+	}
+	return false;
+#elif defined(USE_BVH) && defined(USE_STACKLESS)
+	// Same state machine as the closest hit walk, always left child first
+	float3 ro = rayOrigin - MESH_OFFSET;
+	float3 invDir = 1.0f / rayDir;
+	__global const BVHNode* node = &nodes[0];
+
+	if(boxEntry(node, ro, invDir, maxDist) == INFINITY) return false;
+	if(node->count > 0){
+		for(k=node->leftFirst; k<node->leftFirst + node->count; k++){
+			if(occludeFace(k, rayOrigin, rayDir, triangles, maxDist)) return true;
+		}
+		return false;
+	}
+
+	int current = node->leftFirst;
+	int state = FROM_PARENT;
+
+	while(true){
+		if(state == FROM_CHILD){
+			if(current == 0) return false;
+
+			// Left children sit at odd indices
+			if(current & 1){
+				current = siblingOf(current);
+				state = FROM_SIBLING;
+			}
+			else {
+				current = links[current];
+			}
+			continue;
+		}
+
+		node = &nodes[current];
+		bool hitBox = boxEntry(node, ro, invDir, maxDist) != INFINITY;
+
+		if(hitBox && node->count == 0){
+			current = node->leftFirst;
+			state = FROM_PARENT;
+			continue;
+		}
+
+		if(hitBox){
+			for(k=node->leftFirst; k<node->leftFirst + node->count; k++){
+				if(occludeFace(k, rayOrigin, rayDir, triangles, maxDist)) return true;
+			}
+		}
+
+		if(state == FROM_PARENT){
+			current = siblingOf(current);
+			state = FROM_SIBLING;
+		}
+		else {
+			current = links[current];
+			state = FROM_CHILD;
+		}
+	}
+#elif defined(USE_BVH) && defined(USE_TLAS)
+	float3 ro = rayOrigin - MESH_OFFSET;
+	float3 invDir = 1.0f / rayDir;
+
+	int stack[BVH_STACK_SIZE];
+	int stackPtr = 0;
+
+	if(boxEntry(&tlasNodes[0], ro, invDir, maxDist) == INFINITY) return false;
+	stack[stackPtr++] = 0;
+
+	while(stackPtr > 0){
+		__global const BVHNode* node = &tlasNodes[stack[--stackPtr]];
+
+		if(node->count == 0){
+			int left = node->leftFirst;
+			if(boxEntry(&tlasNodes[left], ro, invDir, maxDist) != INFINITY){
+				stack[stackPtr++] = left;
+			}
+			if(boxEntry(&tlasNodes[left+1], ro, invDir, maxDist) != INFINITY){
+				stack[stackPtr++] = left + 1;
+			}
+			continue;
+		}
+
+		// The direction is not renormalized, so maxDist holds in object space
+		for(k=node->leftFirst; k<node->leftFirst + node->count; k++){
+			__global const BVHInstance* instance = &instances[k];
+			float3 objOrigin = transformPoint(instance->worldToObject, ro);
+			float3 objDir = transformVector(instance->worldToObject, rayDir);
+
+			if(occludedBVH(instance->blasRoot, objOrigin + MESH_OFFSET, objDir, objOrigin, 1.0f / objDir, triangles, nodes, maxDist)) return true;
+		}
+	}
+	return false;
+#elif defined(USE_GRID)
+	float dist = maxDist;
+	float3 hit, norm;
+	int hitFaceIndex = -1;
+	traverseGrid(rayOrigin, rayDir, rayOrigin - MESH_OFFSET, 1.0f / rayDir, triangles, nodes, links, &dist, &hit, &norm, &hitFaceIndex, true);
+	return hitFaceIndex >= 0;
+#elif defined(USE_BVH)
+	return occludedBVH(0, rayOrigin, rayDir, rayOrigin - MESH_OFFSET, 1.0f / rayDir, triangles, nodes, maxDist);
+#else
+	for(k=0; k<*faceCount; k++){
+		if(occludeFace(k, rayOrigin, rayDir, triangles, maxDist)) return true;
+	}
+	return false;
+#endif
+}
+
+float3 getPointColor( int objIndex, __global const int* faceMat, __global const float4* Materials ){
 	
 	// Floor
 	if (objIndex == -1){
 		return (float3)(1.0,0.9,0.9);
 	}
 
-	return (float3)( Materials[faceMat[objIndex]+0], Materials[faceMat[objIndex]+1], Materials[faceMat[objIndex]+2] );
+#ifdef SINGLE_MATERIAL
+	// Every face of the scene shares one material (see SceneDefines)
+	return SCENE_COLOR;
+#else
+	return Materials[faceMat[objIndex]].xyz;
+#endif
+}
+
+// Checkerboard floor lit by the point light, before shadowing
+float3 floorColor(float3 hit){
+	// Plane stuff
+	float scale = 0.1;
+	float light = lightFace(FLOOR_NORMAL, hit);
+
+	//do this calculation for all x, y, z, and it will work regardless of normal
+	if ( fmod( round( fabs(hit.x)*scale) + round(fabs(hit.y)*scale) + round(fabs(hit.z)*scale), 2.0f) < 1.0){
+		return (float3)(light);
+	}
+	return (float3)(1.0,0.0,0.0) * light;
 }
 
-float3 traceRay( float3 rayPos, float3 rayDir, __constant int* faces, __constant float* verts, __constant int* faceCount, __constant int* faceMat, __constant float* Materials )
+float3 traceRay( float3 rayPos, float3 rayDir, __global const float4* triangles, __constant int* faceCount, __global const int* faceMat, __global const float4* Materials, __global const TraversalNode* nodes, __global const TraversalLink* links, __global const BVHNode* tlasNodes, __global const BVHInstance* instances )
 {
 	float3 reflect_color = (float3)(0.0);
 	float3 refract_color = (float3)(0.0);
@@ -165,7 +827,7 @@ float3 traceRay( float3 rayPos, float3 rayDir, __constant int* faces, __constant
 	int objIndex;
 	bool hitCube = false;
 
-	objIndex = getIntersection( rayPos, rayDir, &hit, &norm, faces, verts, faceCount);
+	objIndex = getIntersection( rayPos, rayDir, &hit, &norm, triangles, faceCount, nodes, links, tlasNodes, instances);
 
 	// Didnt hit geometry
 	if(objIndex != -1){
@@ -174,18 +836,16 @@ float3 traceRay( float3 rayPos, float3 rayDir, __constant int* faces, __constant
 	}
 
 	// Hit the floor
-	else if(plane( (float3)(0.0), normalize((float3)(0.0,0.0,1.0)), rayPos, rayDir, &hit, &dist) )
+	else if(plane( (float3)(0.0), FLOOR_NORMAL, rayPos, rayDir, &hit, &dist) )
 	{
-		// Plane stuff
-		float scale = 0.1;
+		point_color = floorColor(hit);
 
-		//do this calculation for all x, y, z, and it will work regardless of normal
-		if ( fmod( round( fabs(hit.x)*scale) + round(fabs(hit.y)*scale) + round(fabs(hit.z)*scale), 2.0f) < 1.0){
-			point_color = lightFace((float3)(0.0,0.0,1.0), hit);
-		}	
-		else{
-			point_color = (float3)(1.0,0.0,0.0) * lightFace((float3)(0.0,0.0,1.0), hit);
+#ifdef USE_SHADOWS
+		// Shadow ray to the light, which sits at t = 1
+		if(occluded(hit + FLOOR_NORMAL * SHADOW_BIAS, LIGHT_POS - hit, 1.0f, triangles, faceCount, nodes, links, tlasNodes, instances)){
+			point_color *= SHADOW_AMBIENT;
 		}
+#endif
 	}
 
 	/*if ( object is reflective )
@@ -201,13 +861,45 @@ float3 traceRay( float3 rayPos, float3 rayDir, __constant int* faces, __constant
 	return point_color;
 }
 
+// Ray of the fixed camera through pixel pos
+void primaryRay(int2 pos, float3* rayOrigin, float3* rayDir){
+	// Screen info //
+	const int2 iResolution = {512,512};
+	float scx = ( (float)pos.x / iResolution.x )*2.0 - 1.0;
+	float scy = ( (float)pos.y / iResolution.y )*-2.0 + 1.0;
+
+	// Camera //
+	float3 camPos = (float3)(-2.0,-20.0,8.0);
+	float3 forward = normalize((float3)(0.3,1.0,0.0));
+	float3 up      = normalize((float3)(0.0,0.0,1.0));
+
+	float3 right = normalize(cross(forward, up));
+	up = normalize(cross(right, forward));
+	*rayOrigin = camPos + forward;
+	*rayDir = normalize(scx*right + scy*up + forward * (float3)(0.95));
+}
+
+// Add a sample to the running sum of pixel and return the mean so far
+float4 accumulate(int pixel, float4 sample, __global float4* accum, __global int* sampleCounts){
+	float4 sum = accum[pixel] + sample;
+	int count = sampleCounts[pixel] + 1;
+	accum[pixel] = sum;
+	sampleCounts[pixel] = count;
+	return sum / (float)count;
+}
+
 __kernel void Filter ( 
 	__write_only image2d_t output,
-	__constant float verts[],
-	__constant int faces[],
+	__global const float4* triangles,
 	__constant int* faceCount,
-	__constant int* faceMat,
-	__constant float Materials[])
+	__global const int* faceMat,
+	__global const float4* Materials,
+	__global const TraversalNode* nodes,
+	__global const TraversalLink* links,
+	__global const BVHNode* tlasNodes,
+	__global const BVHInstance* instances,
+	__global float4* accum,
+	__global int* sampleCounts)
 {
 	// MSAA //
 	int i = 0;
@@ -217,22 +909,13 @@ __kernel void Filter (
 	int samples = 1;
 	float AA_amount = 0.05;
 
-	// Screen info //
-	const int2 iResolution = {512,512};
     const int2 pos = {get_global_id(0), get_global_id(1)};
-	float scx = ( (float)pos.x / iResolution.x )*2.0 - 1.0;
-	float scy = ( (float)pos.y / iResolution.y )*-2.0 + 1.0;
-	float3 screenCoords = {scx,scy,0};
 
-	// Camera //
-	float3 camPos = (float3)(-2.0,-20.0,8.0);
-	float3 forward = normalize((float3)(0.3,1.0,0.0));
-	float3 up      = normalize((float3)(0.0,0.0,1.0));
+	// Launches rounded up to whole work-groups reach past the image
+	if (pos.x >= get_image_width(output) || pos.y >= get_image_height(output)) return;
 
-	float3 right = normalize(cross(forward, up));
-	up = normalize(cross(right, forward));
-	float3 rayOrigin = camPos + forward;
-	float3 rayDir = normalize(scx*right + scy*up + forward * (float3)(0.95));
+	float3 rayOrigin, rayDir;
+	primaryRay(pos, &rayOrigin, &rayDir);
 	
 	// Geometry //
 	float4 sum = (float4)(0.0f);
@@ -250,7 +933,7 @@ __kernel void Filter (
 		//ry = 0.5-rand( screenCoords.xy*(i) ); //ry = samples/2 - i;
 		
 		// Tracing
-		sum.xyz = traceRay(rayOrigin, rayDir, faces, verts, faceCount, faceMat, Materials);
+		sum.xyz = traceRay(rayOrigin, rayDir, triangles, faceCount, faceMat, Materials, nodes, links, tlasNodes, instances);
 	//}
 	
 	//sum = sum/samples;
@@ -258,6 +941,722 @@ __kernel void Filter (
 	// Lit Sphere
 	//sum = sphere( camPos, rayDir, (float3)(0.0,-75.0,0.0), 0.1f);
 	
-    write_imagef (output, (int2)(pos.x, pos.y), sum);
+    write_imagef (output, (int2)(pos.x, pos.y), accumulate(pos.y * get_image_width(output) + pos.x, sum, accum, sampleCounts));
 	//write_imagef (output, (int2)(pos.x, pos.y), (float4)(1.0,0,0,1.0));
-}
\ No newline at end of file
+}
+
+// Filter as a persistent kernel, pixels are fetched row-major from
+// pixelCounter until all width * height are done
+__kernel void FilterPersistent (
+	__write_only image2d_t output,
+	__global const float4* triangles,
+	__constant int* faceCount,
+	__global const int* faceMat,
+	__global const float4* Materials,
+	__global const TraversalNode* nodes,
+	__global const TraversalLink* links,
+	__global const BVHNode* tlasNodes,
+	__global const BVHInstance* instances,
+	__global int* pixelCounter,
+	int width,
+	int height,
+	__global float4* accum,
+	__global int* sampleCounts)
+{
+	int count = width * height;
+	int p;
+	float3 rayOrigin, rayDir;
+
+	while(true){
+		int first = atomic_add(pixelCounter, PERSISTENT_BATCH);
+		if(first >= count) return;
+
+		for(p=first; p<min(first + PERSISTENT_BATCH, count); p++){
+			int2 pos = (int2)(p % width, p / width);
+			primaryRay(pos, &rayOrigin, &rayDir);
+			float4 sample = (float4)(traceRay(rayOrigin, rayDir, triangles, faceCount, faceMat, Materials, nodes, links, tlasNodes, instances), 0.0f);
+			write_imagef(output, pos, accumulate(p, sample, accum, sampleCounts));
+		}
+	}
+}
+
+// ---------------------------------------------------------------------------
+// Wavefront pipeline (Laine et al. 2013)
+//
+// Filter split into stages that each run over a queue in global memory:
+// WavefrontGenerate makes one ray per pixel, WavefrontExtend finds the
+// closest hit of every queued ray, WavefrontShade colors the hits and
+// queues shadow rays, WavefrontConnect adds the light those reach and
+// WavefrontWrite stores the frame. Queues are SoA so neighbouring
+// work-items touch neighbouring addresses, their lengths are counted with
+// atomics in counters. Stages are launched as wide as a queue can get and
+// work-items past its length return at once.
+//
+// The tracing stages also come as persistent kernels (Aila & Laine 2009),
+// launched only as wide as the device holds at once. Their work-items
+// take PERSISTENT_BATCH rays at a time from a fetch counter until the
+// queue is empty, so none idles behind a long ray of its work-group.
+// ---------------------------------------------------------------------------
+
+#define QUEUE_RAYS 0
+#define QUEUE_SHADOW 1
+#define FETCH_RAYS 2
+#define FETCH_SHADOW 3
+
+__kernel void WavefrontGenerate(
+	__global float4* rayOrigins,
+	__global float4* rayDirs,
+	__global int* rayPixels,
+	__global float4* colors,
+	__global int* counters)
+{
+	const int2 pos = {get_global_id(0), get_global_id(1)};
+	int pixel = pos.y * get_global_size(0) + pos.x;
+	float3 rayOrigin, rayDir;
+	primaryRay(pos, &rayOrigin, &rayDir);
+
+	int slot = atomic_inc(&counters[QUEUE_RAYS]);
+	rayOrigins[slot] = (float4)(rayOrigin, 0.0f);
+	rayDirs[slot] = (float4)(rayDir, 0.0f);
+	rayPixels[slot] = pixel;
+	colors[pixel] = (float4)(0.0f);
+}
+
+__kernel void WavefrontExtend(
+	__global const float4* rayOrigins,
+	__global const float4* rayDirs,
+	__global int* hitFaces,
+	__global float4* hitPoints,
+	__global const int* counters,
+	__global const float4* triangles,
+	__constant int* faceCount,
+	__global const TraversalNode* nodes,
+	__global const TraversalLink* links,
+	__global const BVHNode* tlasNodes,
+	__global const BVHInstance* instances)
+{
+	int i = get_global_id(0);
+	if(i >= counters[QUEUE_RAYS]) return;
+
+	float3 hit, norm;
+	hitFaces[i] = getIntersection(rayOrigins[i].xyz, rayDirs[i].xyz, &hit, &norm, triangles, faceCount, nodes, links, tlasNodes, instances);
+	hitPoints[i] = (float4)(hit, 0.0f);
+}
+
+__kernel void WavefrontExtendPersistent(
+	__global const float4* rayOrigins,
+	__global const float4* rayDirs,
+	__global int* hitFaces,
+	__global float4* hitPoints,
+	__global int* counters,
+	__global const float4* triangles,
+	__constant int* faceCount,
+	__global const TraversalNode* nodes,
+	__global const TraversalLink* links,
+	__global const BVHNode* tlasNodes,
+	__global const BVHInstance* instances)
+{
+	int count = counters[QUEUE_RAYS];
+	int i;
+	float3 hit, norm;
+
+	while(true){
+		int first = atomic_add(&counters[FETCH_RAYS], PERSISTENT_BATCH);
+		if(first >= count) return;
+
+		for(i=first; i<min(first + PERSISTENT_BATCH, count); i++){
+			hitFaces[i] = getIntersection(rayOrigins[i].xyz, rayDirs[i].xyz, &hit, &norm, triangles, faceCount, nodes, links, tlasNodes, instances);
+			hitPoints[i] = (float4)(hit, 0.0f);
+		}
+	}
+}
+
+__kernel void WavefrontShade(
+	__global const float4* rayOrigins,
+	__global const float4* rayDirs,
+	__global const int* rayPixels,
+	__global const int* hitFaces,
+	__global const float4* hitPoints,
+	__global int* counters,
+	__global float4* shadowOrigins,
+	__global float4* shadowDirs,
+	__global int* shadowPixels,
+	__global float4* shadowColors,
+	__global float4* colors,
+	__global const int* faceMat,
+	__global const float4* Materials)
+{
+	int i = get_global_id(0);
+	if(i >= counters[QUEUE_RAYS]) return;
+
+	int pixel = rayPixels[i];
+	int objIndex = hitFaces[i];
+	float3 hit;
+	float dist;
+
+	if(objIndex != -1){
+		colors[pixel] = (float4)(getPointColor(objIndex, faceMat, Materials), 0.0f);
+	}
+	else if(plane((float3)(0.0), FLOOR_NORMAL, rayOrigins[i].xyz, rayDirs[i].xyz, &hit, &dist)){
+		float3 color = floorColor(hit);
+#ifdef USE_SHADOWS
+		// Shadowed light now, the rest once Connect finds the light visible
+		colors[pixel] = (float4)(color * SHADOW_AMBIENT, 0.0f);
+
+		int slot = atomic_inc(&counters[QUEUE_SHADOW]);
+		shadowOrigins[slot] = (float4)(hit + FLOOR_NORMAL * SHADOW_BIAS, 0.0f);
+		shadowDirs[slot] = (float4)(LIGHT_POS - hit, 0.0f);
+		shadowPixels[slot] = pixel;
+		shadowColors[slot] = (float4)(color * (1.0f - SHADOW_AMBIENT), 0.0f);
+#else
+		colors[pixel] = (float4)(color, 0.0f);
+#endif
+	}
+}
+
+__kernel void WavefrontConnect(
+	__global const float4* shadowOrigins,
+	__global const float4* shadowDirs,
+	__global const int* shadowPixels,
+	__global const float4* shadowColors,
+	__global const int* counters,
+	__global float4* colors,
+	__global const float4* triangles,
+	__constant int* faceCount,
+	__global const TraversalNode* nodes,
+	__global const TraversalLink* links,
+	__global const BVHNode* tlasNodes,
+	__global const BVHInstance* instances)
+{
+	int i = get_global_id(0);
+	if(i >= counters[QUEUE_SHADOW]) return;
+
+	// One shadow ray per pixel at most, so the add does not race
+	if(!occluded(shadowOrigins[i].xyz, shadowDirs[i].xyz, 1.0f, triangles, faceCount, nodes, links, tlasNodes, instances)){
+		colors[shadowPixels[i]] += shadowColors[i];
+	}
+}
+
+__kernel void WavefrontConnectPersistent(
+	__global const float4* shadowOrigins,
+	__global const float4* shadowDirs,
+	__global const int* shadowPixels,
+	__global const float4* shadowColors,
+	__global int* counters,
+	__global float4* colors,
+	__global const float4* triangles,
+	__constant int* faceCount,
+	__global const TraversalNode* nodes,
+	__global const TraversalLink* links,
+	__global const BVHNode* tlasNodes,
+	__global const BVHInstance* instances)
+{
+	int count = counters[QUEUE_SHADOW];
+	int i;
+
+	while(true){
+		int first = atomic_add(&counters[FETCH_SHADOW], PERSISTENT_BATCH);
+		if(first >= count) return;
+
+		for(i=first; i<min(first + PERSISTENT_BATCH, count); i++){
+			if(!occluded(shadowOrigins[i].xyz, shadowDirs[i].xyz, 1.0f, triangles, faceCount, nodes, links, tlasNodes, instances)){
+				colors[shadowPixels[i]] += shadowColors[i];
+			}
+		}
+	}
+}
+
+__kernel void WavefrontWrite(
+	__write_only image2d_t output,
+	__global const float4* colors,
+	__global float4* accum,
+	__global int* sampleCounts)
+{
+	const int2 pos = {get_global_id(0), get_global_id(1)};
+	int pixel = pos.y * get_global_size(0) + pos.x;
+	write_imagef(output, pos, accumulate(pixel, colors[pixel], accum, sampleCounts));
+}
+
+// ---------------------------------------------------------------------------
+// LBVH construction (Karras 2012)
+//
+// Node layout matches the host BVH: slot 0 is the root and the children of
+// internal node i live in slots 2i+1 and 2i+2, so siblings stay adjacent.
+// Every leaf holds one face and faces are gathered into leaf order.
+// ---------------------------------------------------------------------------
+
+#define RADIX_BITS 4
+#define RADIX_BUCKETS 16
+#define RADIX_BLOCK 64
+
+// Order preserving float <-> int mapping for atomic_min/atomic_max
+int floatToOrderedInt(float f){
+	int i = as_int(f);
+	return i >= 0 ? i : i ^ 0x7FFFFFFF;
+}
+
+float orderedIntToFloat(int i){
+	return as_float(i >= 0 ? i : i ^ 0x7FFFFFFF);
+}
+
+float3 faceCentroid(int k, __global const float* verts, __global const int* faces){
+	float3 v1 = vload3(faces[3*k+0], verts);
+	float3 v2 = vload3(faces[3*k+1], verts);
+	float3 v3 = vload3(faces[3*k+2], verts);
+	return (fmin(fmin(v1, v2), v3) + fmax(fmax(v1, v2), v3)) * 0.5f;
+}
+
+// Spread 10 bits out to every third bit
+uint expandBits(uint v){
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+// bounds holds min xyz then max xyz as ordered ints
+__kernel void LBVHCentroidBounds(
+	__global const float* verts,
+	__global const int* faces,
+	int faceCount,
+	__global int* bounds)
+{
+	int k = get_global_id(0);
+	if(k >= faceCount) return;
+
+	float3 c = faceCentroid(k, verts, faces);
+	atomic_min(&bounds[0], floatToOrderedInt(c.x));
+	atomic_min(&bounds[1], floatToOrderedInt(c.y));
+	atomic_min(&bounds[2], floatToOrderedInt(c.z));
+	atomic_max(&bounds[3], floatToOrderedInt(c.x));
+	atomic_max(&bounds[4], floatToOrderedInt(c.y));
+	atomic_max(&bounds[5], floatToOrderedInt(c.z));
+}
+
+// 30-bit Morton code of every face centroid
+__kernel void LBVHMortonCodes(
+	__global const float* verts,
+	__global const int* faces,
+	int faceCount,
+	__global const int* bounds,
+	__global uint* codes,
+	__global int* ids)
+{
+	int k = get_global_id(0);
+	if(k >= faceCount) return;
+
+	float3 bmin = (float3)(orderedIntToFloat(bounds[0]), orderedIntToFloat(bounds[1]), orderedIntToFloat(bounds[2]));
+	float3 bmax = (float3)(orderedIntToFloat(bounds[3]), orderedIntToFloat(bounds[4]), orderedIntToFloat(bounds[5]));
+	float3 extent = fmax(bmax - bmin, (float3)(1e-20f));
+
+	float3 p = clamp((faceCentroid(k, verts, faces) - bmin) / extent * 1024.0f, 0.0f, 1023.0f);
+	codes[k] = (expandBits((uint)p.x) << 2) | (expandBits((uint)p.y) << 1) | expandBits((uint)p.z);
+	ids[k] = k;
+}
+
+// Digit counts per block of RADIX_BLOCK keys, stored digit major
+__kernel void RadixHistogram(
+	__global const uint* keys,
+	int count,
+	int shift,
+	__global int* hist)
+{
+	int block = get_global_id(0);
+	int blockCount = get_global_size(0);
+	int counts[RADIX_BUCKETS];
+	int i;
+
+	for(i=0; i<RADIX_BUCKETS; i++){
+		counts[i] = 0;
+	}
+
+	int first = block * RADIX_BLOCK;
+	int last = min(first + RADIX_BLOCK, count);
+	for(i=first; i<last; i++){
+		counts[(keys[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+	}
+
+	for(i=0; i<RADIX_BUCKETS; i++){
+		hist[i * blockCount + block] = counts[i];
+	}
+}
+
+// Exclusive scan of the whole histogram, run as a single work-group
+__kernel void RadixScan(
+	__global int* hist,
+	int count,
+	__local int* partial)
+{
+	int lid = get_local_id(0);
+	int groupSize = get_local_size(0);
+	int span = (count + groupSize - 1) / groupSize;
+	int first = min(lid * span, count);
+	int last = min(first + span, count);
+	int i;
+
+	int sum = 0;
+	for(i=first; i<last; i++){
+		sum += hist[i];
+	}
+	partial[lid] = sum;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if(lid == 0){
+		int running = 0;
+		for(i=0; i<groupSize; i++){
+			int value = partial[i];
+			partial[i] = running;
+			running += value;
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	int running = partial[lid];
+	for(i=first; i<last; i++){
+		int value = hist[i];
+		hist[i] = running;
+		running += value;
+	}
+}
+
+// Stable scatter, every work-item walks its block in order
+__kernel void RadixScatter(
+	__global const uint* keysIn,
+	__global const int* valuesIn,
+	int count,
+	int shift,
+	__global const int* hist,
+	__global uint* keysOut,
+	__global int* valuesOut)
+{
+	int block = get_global_id(0);
+	int blockCount = get_global_size(0);
+	int offsets[RADIX_BUCKETS];
+	int i;
+
+	for(i=0; i<RADIX_BUCKETS; i++){
+		offsets[i] = hist[i * blockCount + block];
+	}
+
+	int first = block * RADIX_BLOCK;
+	int last = min(first + RADIX_BLOCK, count);
+	for(i=first; i<last; i++){
+		uint key = keysIn[i];
+		int dst = offsets[(key >> shift) & (RADIX_BUCKETS - 1)]++;
+		keysOut[dst] = key;
+		valuesOut[dst] = valuesIn[i];
+	}
+}
+
+// Common prefix length of two sorted keys, ties broken by index
+int lbvhDelta(__global const uint* codes, int count, int i, int j){
+	if(j < 0 || j >= count) return -1;
+
+	uint a = codes[i];
+	uint b = codes[j];
+	if(a == b) return 32 + (int)clz((uint)(i ^ j));
+	return (int)clz(a ^ b);
+}
+
+// One work-item per internal node, writes both children
+__kernel void LBVHBuildTree(
+	__global const uint* codes,
+	int count,
+	__global BVHNode* nodes,
+	__global int* parents,
+	__global int* leafSlots,
+	__global int* internalSlots)
+{
+	int i = get_global_id(0);
+	if(i >= count - 1) return;
+
+	// Direction of the range covered by this node
+	int d = (lbvhDelta(codes, count, i, i+1) - lbvhDelta(codes, count, i, i-1)) >= 0 ? 1 : -1;
+	int deltaMin = lbvhDelta(codes, count, i, i-d);
+
+	// Upper bound on the range length, then binary search the other end
+	int lmax = 2;
+	while(lbvhDelta(codes, count, i, i + lmax*d) > deltaMin){
+		lmax *= 2;
+	}
+
+	int l = 0;
+	int t;
+	for(t=lmax/2; t>=1; t/=2){
+		if(lbvhDelta(codes, count, i, i + (l+t)*d) > deltaMin){
+			l += t;
+		}
+	}
+	int j = i + l*d;
+
+	// Binary search the split position
+	int deltaNode = lbvhDelta(codes, count, i, j);
+	int s = 0;
+	t = l;
+	do {
+		t = (t + 1) >> 1;
+		if(lbvhDelta(codes, count, i, i + (s+t)*d) > deltaNode){
+			s += t;
+		}
+	} while(t > 1);
+	int gamma = i + s*d + min(d, 0);
+
+	if(i == 0){
+		nodes[0].leftFirst = 1;
+		nodes[0].count = 0;
+		parents[0] = -1;
+		internalSlots[0] = 0;
+	}
+
+	int child[2] = { gamma, gamma + 1 };
+	bool leaf[2] = { min(i, j) == gamma, max(i, j) == gamma + 1 };
+
+	for(t=0; t<2; t++){
+		int slot = 2*i + 1 + t;
+		parents[slot] = i;
+
+		if(leaf[t]){
+			nodes[slot].leftFirst = child[t];
+			nodes[slot].count = 1;
+			leafSlots[child[t]] = slot;
+		}
+		else {
+			nodes[slot].leftFirst = 2*child[t] + 1;
+			nodes[slot].count = 0;
+			internalSlots[child[t]] = slot;
+		}
+	}
+}
+
+// Bottom-up bounds, the second child to arrive at a node computes it
+__kernel void LBVHBuildBounds(
+	__global const float* verts,
+	__global const int* faces,
+	__global const int* ids,
+	int count,
+	__global BVHNode* nodes,
+	__global const int* parents,
+	__global const int* leafSlots,
+	__global const int* internalSlots,
+	__global volatile int* flags)
+{
+	int k = get_global_id(0);
+	if(k >= count) return;
+
+	int face = ids[k];
+	float3 v1 = vload3(faces[3*face+0], verts);
+	float3 v2 = vload3(faces[3*face+1], verts);
+	float3 v3 = vload3(faces[3*face+2], verts);
+	float3 bmin = fmin(fmin(v1, v2), v3);
+	float3 bmax = fmax(fmax(v1, v2), v3);
+
+	// Single face scene, the root is the leaf
+	if(count == 1){
+		vstore3(bmin, 0, nodes[0].bmin);
+		vstore3(bmax, 0, nodes[0].bmax);
+		nodes[0].leftFirst = 0;
+		nodes[0].count = 1;
+		return;
+	}
+
+	int slot = leafSlots[k];
+	vstore3(bmin, 0, nodes[slot].bmin);
+	vstore3(bmax, 0, nodes[slot].bmax);
+
+	int parent = parents[slot];
+	while(parent >= 0){
+		mem_fence(CLK_GLOBAL_MEM_FENCE);
+		if(atomic_inc(&flags[parent]) == 0){
+			return;
+		}
+
+		__global volatile BVHNode* left = &nodes[2*parent + 1];
+		__global volatile BVHNode* right = &nodes[2*parent + 2];
+		bmin = fmin((float3)(left->bmin[0], left->bmin[1], left->bmin[2]), (float3)(right->bmin[0], right->bmin[1], right->bmin[2]));
+		bmax = fmax((float3)(left->bmax[0], left->bmax[1], left->bmax[2]), (float3)(right->bmax[0], right->bmax[1], right->bmax[2]));
+
+		slot = internalSlots[parent];
+		vstore3(bmin, 0, nodes[slot].bmin);
+		vstore3(bmax, 0, nodes[slot].bmax);
+		parent = parents[slot];
+	}
+}
+
+// Triangle records for the Filter kernel in leaf order, v0 and the two
+// edges triangle() works with
+__kernel void PackTriangles(
+	__global const float* verts,
+	__global const int* faces,
+	int count,
+	__global float4* triangles)
+{
+	int k = get_global_id(0);
+	if(k >= count) return;
+
+	float3 v1 = vload3(faces[3*k+0], verts);
+	float3 v2 = vload3(faces[3*k+1], verts);
+	float3 v3 = vload3(faces[3*k+2], verts);
+
+	triangles[3*k+0] = (float4)(v1, 0.0f);
+	triangles[3*k+1] = (float4)(v3 - v1, 0.0f);
+	triangles[3*k+2] = (float4)(v2 - v1, 0.0f);
+}
+
+// Refit after the vertices moved, one work-item per node. Leaves start
+// the climb and the second child to arrive at a node merges both boxes.
+__kernel void BVHRefit(
+	__global const float* verts,
+	__global const int* faces,
+	int nodeCount,
+	__global BVHNode* nodes,
+	__global const int* parents,
+	__global volatile int* flags)
+{
+	int n = get_global_id(0);
+	if(n >= nodeCount || nodes[n].count == 0) return;
+
+	float3 bmin = (float3)(INFINITY);
+	float3 bmax = (float3)(-INFINITY);
+	for(int k=nodes[n].leftFirst; k<nodes[n].leftFirst + nodes[n].count; k++){
+		float3 v1 = vload3(faces[3*k+0], verts);
+		float3 v2 = vload3(faces[3*k+1], verts);
+		float3 v3 = vload3(faces[3*k+2], verts);
+		bmin = fmin(bmin, fmin(fmin(v1, v2), v3));
+		bmax = fmax(bmax, fmax(fmax(v1, v2), v3));
+	}
+	vstore3(bmin, 0, nodes[n].bmin);
+	vstore3(bmax, 0, nodes[n].bmax);
+
+	int parent = parents[n];
+	while(parent >= 0){
+		mem_fence(CLK_GLOBAL_MEM_FENCE);
+		if(atomic_inc(&flags[parent]) == 0){
+			return;
+		}
+
+		__global volatile BVHNode* left = &nodes[nodes[parent].leftFirst];
+		__global volatile BVHNode* right = left + 1;
+		bmin = fmin((float3)(left->bmin[0], left->bmin[1], left->bmin[2]), (float3)(right->bmin[0], right->bmin[1], right->bmin[2]));
+		bmax = fmax((float3)(left->bmax[0], left->bmax[1], left->bmax[2]), (float3)(right->bmax[0], right->bmax[1], right->bmax[2]));
+
+		vstore3(bmin, 0, nodes[parent].bmin);
+		vstore3(bmax, 0, nodes[parent].bmax);
+		parent = parents[parent];
+	}
+}
+
+// Parent slot of every slot, for the stackless traversal
+__kernel void LBVHParentLinks(
+	int nodeCount,
+	__global const int* parents,
+	__global const int* internalSlots,
+	__global int* parentLinks)
+{
+	int slot = get_global_id(0);
+	if(slot >= nodeCount) return;
+
+	int parent = parents[slot];
+	parentLinks[slot] = parent >= 0 ? internalSlots[parent] : -1;
+}
+
+// Gather faces and their materials into leaf order
+__kernel void LBVHReorderFaces(
+	__global const int* ids,
+	int count,
+	__global const int* srcFaces,
+	__global const int* srcFaceMat,
+	__global int* faces,
+	__global int* faceMat)
+{
+	int k = get_global_id(0);
+	if(k >= count) return;
+
+	int face = ids[k];
+	faces[3*k+0] = srcFaces[3*face+0];
+	faces[3*k+1] = srcFaces[3*face+1];
+	faces[3*k+2] = srcFaces[3*face+2];
+	faceMat[k] = srcFaceMat[face];
+}
+
+// ---------------------------------------------------------------------------
+// Ray reordering
+//
+// Shadow rays are sorted between WavefrontShade and WavefrontConnect with
+// the radix sort above, keyed by direction octant over the Morton code of
+// the origin within the bounds of the queue. Rays traced side by side then
+// start close together and head the same way, so they walk the same nodes.
+// Slots past the queue length get the largest key and stay at the end.
+// ---------------------------------------------------------------------------
+
+#define RAY_KEY_EMPTY 0xFFFFFFFFu
+
+__kernel void RayOriginBounds(
+	__global const float4* origins,
+	__global const int* counters,
+	int queue,
+	__global int* bounds)
+{
+	int i = get_global_id(0);
+	if(i >= counters[queue]) return;
+
+	float3 o = origins[i].xyz;
+	atomic_min(&bounds[0], floatToOrderedInt(o.x));
+	atomic_min(&bounds[1], floatToOrderedInt(o.y));
+	atomic_min(&bounds[2], floatToOrderedInt(o.z));
+	atomic_max(&bounds[3], floatToOrderedInt(o.x));
+	atomic_max(&bounds[4], floatToOrderedInt(o.y));
+	atomic_max(&bounds[5], floatToOrderedInt(o.z));
+}
+
+// Octant in bits 27-29, a 9 bit per axis origin cell below
+__kernel void RayKeys(
+	__global const float4* origins,
+	__global const float4* dirs,
+	__global const int* counters,
+	int queue,
+	__global const int* bounds,
+	__global uint* keys,
+	__global int* ids)
+{
+	int i = get_global_id(0);
+	ids[i] = i;
+	if(i >= counters[queue]){
+		keys[i] = RAY_KEY_EMPTY;
+		return;
+	}
+
+	float3 bmin = (float3)(orderedIntToFloat(bounds[0]), orderedIntToFloat(bounds[1]), orderedIntToFloat(bounds[2]));
+	float3 bmax = (float3)(orderedIntToFloat(bounds[3]), orderedIntToFloat(bounds[4]), orderedIntToFloat(bounds[5]));
+	float3 extent = fmax(bmax - bmin, (float3)(1e-20f));
+
+	float3 p = clamp((origins[i].xyz - bmin) / extent * 512.0f, 0.0f, 511.0f);
+	uint cell = (expandBits((uint)p.x) << 2) | (expandBits((uint)p.y) << 1) | expandBits((uint)p.z);
+
+	float3 d = dirs[i].xyz;
+	uint octant = (d.x < 0.0f ? 1 : 0) | (d.y < 0.0f ? 2 : 0) | (d.z < 0.0f ? 4 : 0);
+	keys[i] = (octant << 27) | cell;
+}
+
+// Shadow queue in sorted order, ids from the sort
+__kernel void WavefrontGatherShadowRays(
+	__global const int* ids,
+	__global const int* counters,
+	__global const float4* srcOrigins,
+	__global const float4* srcDirs,
+	__global const int* srcPixels,
+	__global const float4* srcColors,
+	__global float4* shadowOrigins,
+	__global float4* shadowDirs,
+	__global int* shadowPixels,
+	__global float4* shadowColors)
+{
+	int i = get_global_id(0);
+	if(i >= counters[QUEUE_SHADOW]) return;
+
+	int ray = ids[i];
+	shadowOrigins[i] = srcOrigins[ray];
+	shadowDirs[i] = srcDirs[ray];
+	shadowPixels[i] = srcPixels[ray];
+	shadowColors[i] = srcColors[ray];
+}
@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <limits.h>
+#include "lbvh.h"
+
+cl_int Enqueue1D(cl_command_queue queue, cl_kernel kernel, size_t count){
+	if (count == 0) return CL_SUCCESS;
+	size_t global = count;
+	return clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &global, NULL, 0, NULL, NULL);
+}
+
+cl_int CreateRadixSorter(RadixSorter *sorter, cl_context context, cl_program program, cl_device_id device, int capacity){
+	cl_int error = CL_SUCCESS;
+	int count = capacity > 0 ? capacity : 1;
+	int blockCount = (count + RADIX_BLOCK - 1) / RADIX_BLOCK;
+
+	sorter->capacity = capacity;
+
+	const char *names[3] = { "RadixHistogram", "RadixScan", "RadixScatter" };
+	cl_kernel *kernels[3] = { &sorter->histogram, &sorter->scan, &sorter->scatter };
+
+	for (int i = 0; i < 3; i++){
+		*kernels[i] = clCreateKernel(program, names[i], &error);
+		if (error != CL_SUCCESS){
+			printf("OpenCL: Error creating radix sort kernel %s\n", names[i]);
+			return error;
+		}
+	}
+
+	// The scan runs as one work-group, as wide as the device allows
+	size_t maxGroup = RADIX_SCAN_GROUP;
+	clGetKernelWorkGroupInfo(sorter->scan, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &maxGroup, NULL);
+	sorter->scanGroupSize = maxGroup < RADIX_SCAN_GROUP ? maxGroup : RADIX_SCAN_GROUP;
+
+	sorter->hist = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * blockCount * (1 << RADIX_BITS), NULL, &error);
+	if (error != CL_SUCCESS){
+		printf("OpenCL: Error allocating radix sort buffers\n");
+	}
+	return error;
+}
+
+void ReleaseRadixSorter(RadixSorter *sorter){
+	clReleaseKernel(sorter->histogram);
+	clReleaseKernel(sorter->scan);
+	clReleaseKernel(sorter->scatter);
+	clReleaseMemObject(sorter->hist);
+}
+
+cl_int RadixSort(RadixSorter *sorter, cl_command_queue queue, cl_mem keys[2], cl_mem values[2], int count){
+	cl_int error = CL_SUCCESS;
+	if (count <= 0) return CL_SUCCESS;
+	if (count > sorter->capacity){
+		printf("OpenCL: %d keys exceed the radix sort capacity of %d\n", count, sorter->capacity);
+		return CL_INVALID_VALUE;
+	}
+
+	// An even number of passes leaves the result in keys[0]
+	cl_int blockCount = (count + RADIX_BLOCK - 1) / RADIX_BLOCK;
+	cl_int histCount = blockCount * (1 << RADIX_BITS);
+	size_t scanSize = sorter->scanGroupSize;
+
+	for (int shift = 0, pass = 0; shift < 32; shift += RADIX_BITS, pass++){
+		cl_mem keysIn = keys[pass & 1];
+		cl_mem keysOut = keys[(pass + 1) & 1];
+		cl_mem valuesIn = values[pass & 1];
+		cl_mem valuesOut = values[(pass + 1) & 1];
+
+		clSetKernelArg(sorter->histogram, 0, sizeof(cl_mem), &keysIn);
+		clSetKernelArg(sorter->histogram, 1, sizeof(cl_int), &count);
+		clSetKernelArg(sorter->histogram, 2, sizeof(cl_int), &shift);
+		clSetKernelArg(sorter->histogram, 3, sizeof(cl_mem), &sorter->hist);
+		if (error == CL_SUCCESS) error = Enqueue1D(queue, sorter->histogram, blockCount);
+
+		clSetKernelArg(sorter->scan, 0, sizeof(cl_mem), &sorter->hist);
+		clSetKernelArg(sorter->scan, 1, sizeof(cl_int), &histCount);
+		clSetKernelArg(sorter->scan, 2, sizeof(cl_int) * scanSize, NULL);
+		if (error == CL_SUCCESS) error = clEnqueueNDRangeKernel(queue, sorter->scan, 1, NULL, &scanSize, &scanSize, 0, NULL, NULL);
+
+		clSetKernelArg(sorter->scatter, 0, sizeof(cl_mem), &keysIn);
+		clSetKernelArg(sorter->scatter, 1, sizeof(cl_mem), &valuesIn);
+		clSetKernelArg(sorter->scatter, 2, sizeof(cl_int), &count);
+		clSetKernelArg(sorter->scatter, 3, sizeof(cl_int), &shift);
+		clSetKernelArg(sorter->scatter, 4, sizeof(cl_mem), &sorter->hist);
+		clSetKernelArg(sorter->scatter, 5, sizeof(cl_mem), &keysOut);
+		clSetKernelArg(sorter->scatter, 6, sizeof(cl_mem), &valuesOut);
+		if (error == CL_SUCCESS) error = Enqueue1D(queue, sorter->scatter, blockCount);
+	}
+
+	if (error != CL_SUCCESS){
+		printf("OpenCL: Error enqueuing radix sort\n");
+	}
+	return error;
+}
+
+cl_int CreateLBVHBuilder(LBVHBuilder *builder, cl_context context, cl_program program, cl_device_id device, int faceCount){
+	cl_int error = CL_SUCCESS;
+	int count = faceCount > 0 ? faceCount : 1;
+
+	builder->faceCount = faceCount;
+
+	error = CreateRadixSorter(&builder->sorter, context, program, device, count);
+	if (error != CL_SUCCESS) return error;
+
+	const char *names[6] = { "LBVHCentroidBounds", "LBVHMortonCodes", "LBVHBuildTree", "LBVHBuildBounds",
+		"LBVHReorderFaces", "LBVHParentLinks" };
+	cl_kernel *kernels[6] = { &builder->centroidBounds, &builder->mortonCodes, &builder->buildTree, &builder->buildBounds,
+		&builder->reorderFaces, &builder->parentLinks };
+
+	for (int i = 0; i < 6; i++){
+		*kernels[i] = clCreateKernel(program, names[i], &error);
+		if (error != CL_SUCCESS){
+			printf("OpenCL: Error creating LBVH kernel %s\n", names[i]);
+			return error;
+		}
+	}
+
+	int nodeCount = 2 * count - 1;
+	builder->bounds = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * 6, NULL, &error);
+	for (int i = 0; i < 2; i++){
+		builder->codes[i] = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint) * count, NULL, &error);
+		builder->ids[i] = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * count, NULL, &error);
+	}
+	builder->parents = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * nodeCount, NULL, &error);
+	builder->leafSlots = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * count, NULL, &error);
+	builder->internalSlots = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * count, NULL, &error);
+	builder->flags = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * count, NULL, &error);
+	builder->zeros.assign(count, 0);
+
+	if (error != CL_SUCCESS){
+		printf("OpenCL: Error allocating LBVH buffers\n");
+	}
+	return error;
+}
+
+void ReleaseLBVHBuilder(LBVHBuilder *builder){
+	ReleaseRadixSorter(&builder->sorter);
+
+	clReleaseKernel(builder->centroidBounds);
+	clReleaseKernel(builder->mortonCodes);
+	clReleaseKernel(builder->buildTree);
+	clReleaseKernel(builder->buildBounds);
+	clReleaseKernel(builder->reorderFaces);
+	clReleaseKernel(builder->parentLinks);
+
+	clReleaseMemObject(builder->bounds);
+	for (int i = 0; i < 2; i++){
+		clReleaseMemObject(builder->codes[i]);
+		clReleaseMemObject(builder->ids[i]);
+	}
+	clReleaseMemObject(builder->parents);
+	clReleaseMemObject(builder->leafSlots);
+	clReleaseMemObject(builder->internalSlots);
+	clReleaseMemObject(builder->flags);
+}
+
+cl_int BuildLBVH(LBVHBuilder *builder, cl_command_queue queue, cl_mem verts, cl_mem srcFaces, cl_mem srcFaceMats,
+	cl_mem faces, cl_mem faceMats, cl_mem nodes, cl_mem parentLinks){
+	cl_int error = CL_SUCCESS;
+	cl_int count = builder->faceCount;
+	if (count == 0) return CL_SUCCESS;
+
+	// Centroid bounds, reset to an empty box first
+	const cl_int emptyBounds[6] = { INT_MAX, INT_MAX, INT_MAX, INT_MIN, INT_MIN, INT_MIN };
+	error = clEnqueueWriteBuffer(queue, builder->bounds, CL_TRUE, 0, sizeof(emptyBounds), emptyBounds, 0, NULL, NULL);
+
+	clSetKernelArg(builder->centroidBounds, 0, sizeof(cl_mem), &verts);
+	clSetKernelArg(builder->centroidBounds, 1, sizeof(cl_mem), &srcFaces);
+	clSetKernelArg(builder->centroidBounds, 2, sizeof(cl_int), &count);
+	clSetKernelArg(builder->centroidBounds, 3, sizeof(cl_mem), &builder->bounds);
+	if (error == CL_SUCCESS) error = Enqueue1D(queue, builder->centroidBounds, count);
+
+	// Morton codes
+	clSetKernelArg(builder->mortonCodes, 0, sizeof(cl_mem), &verts);
+	clSetKernelArg(builder->mortonCodes, 1, sizeof(cl_mem), &srcFaces);
+	clSetKernelArg(builder->mortonCodes, 2, sizeof(cl_int), &count);
+	clSetKernelArg(builder->mortonCodes, 3, sizeof(cl_mem), &builder->bounds);
+	clSetKernelArg(builder->mortonCodes, 4, sizeof(cl_mem), &builder->codes[0]);
+	clSetKernelArg(builder->mortonCodes, 5, sizeof(cl_mem), &builder->ids[0]);
+	if (error == CL_SUCCESS) error = Enqueue1D(queue, builder->mortonCodes, count);
+
+	// Sort by Morton code, the result ends in codes[0]/ids[0]
+	if (error == CL_SUCCESS) error = RadixSort(&builder->sorter, queue, builder->codes, builder->ids, count);
+
+	// Radix tree topology
+	clSetKernelArg(builder->buildTree, 0, sizeof(cl_mem), &builder->codes[0]);
+	clSetKernelArg(builder->buildTree, 1, sizeof(cl_int), &count);
+	clSetKernelArg(builder->buildTree, 2, sizeof(cl_mem), &nodes);
+	clSetKernelArg(builder->buildTree, 3, sizeof(cl_mem), &builder->parents);
+	clSetKernelArg(builder->buildTree, 4, sizeof(cl_mem), &builder->leafSlots);
+	clSetKernelArg(builder->buildTree, 5, sizeof(cl_mem), &builder->internalSlots);
+	if (error == CL_SUCCESS) error = Enqueue1D(queue, builder->buildTree, count - 1);
+
+	// Bottom-up bounds
+	if (error == CL_SUCCESS) error = clEnqueueWriteBuffer(queue, builder->flags, CL_FALSE, 0, sizeof(cl_int) * count, builder->zeros.data(), 0, NULL, NULL);
+
+	clSetKernelArg(builder->buildBounds, 0, sizeof(cl_mem), &verts);
+	clSetKernelArg(builder->buildBounds, 1, sizeof(cl_mem), &srcFaces);
+	clSetKernelArg(builder->buildBounds, 2, sizeof(cl_mem), &builder->ids[0]);
+	clSetKernelArg(builder->buildBounds, 3, sizeof(cl_int), &count);
+	clSetKernelArg(builder->buildBounds, 4, sizeof(cl_mem), &nodes);
+	clSetKernelArg(builder->buildBounds, 5, sizeof(cl_mem), &builder->parents);
+	clSetKernelArg(builder->buildBounds, 6, sizeof(cl_mem), &builder->leafSlots);
+	clSetKernelArg(builder->buildBounds, 7, sizeof(cl_mem), &builder->internalSlots);
+	clSetKernelArg(builder->buildBounds, 8, sizeof(cl_mem), &builder->flags);
+	if (error == CL_SUCCESS) error = Enqueue1D(queue, builder->buildBounds, count);
+
+	// Faces in leaf order for the render kernel
+	clSetKernelArg(builder->reorderFaces, 0, sizeof(cl_mem), &builder->ids[0]);
+	clSetKernelArg(builder->reorderFaces, 1, sizeof(cl_int), &count);
+	clSetKernelArg(builder->reorderFaces, 2, sizeof(cl_mem), &srcFaces);
+	clSetKernelArg(builder->reorderFaces, 3, sizeof(cl_mem), &srcFaceMats);
+	clSetKernelArg(builder->reorderFaces, 4, sizeof(cl_mem), &faces);
+	clSetKernelArg(builder->reorderFaces, 5, sizeof(cl_mem), &faceMats);
+	if (error == CL_SUCCESS) error = Enqueue1D(queue, builder->reorderFaces, count);
+
+	// Parent slots for stackless traversal, the root alone has none
+	if (parentLinks != NULL){
+		cl_int nodeCount = 2 * count - 1;
+		if (count == 1){
+			const cl_int rootLink = -1;
+			if (error == CL_SUCCESS) error = clEnqueueWriteBuffer(queue, parentLinks, CL_TRUE, 0, sizeof(cl_int), &rootLink, 0, NULL, NULL);
+		}
+		else {
+			clSetKernelArg(builder->parentLinks, 0, sizeof(cl_int), &nodeCount);
+			clSetKernelArg(builder->parentLinks, 1, sizeof(cl_mem), &builder->parents);
+			clSetKernelArg(builder->parentLinks, 2, sizeof(cl_mem), &builder->internalSlots);
+			clSetKernelArg(builder->parentLinks, 3, sizeof(cl_mem), &parentLinks);
+			if (error == CL_SUCCESS) error = Enqueue1D(queue, builder->parentLinks, nodeCount);
+		}
+	}
+
+	if (error != CL_SUCCESS){
+		printf("OpenCL: Error enqueuing LBVH build\n");
+	}
+	return error;
+}
+
+cl_int CreateBVHRefitter(BVHRefitter *refitter, cl_context context, cl_program program, int nodeCount){
+	cl_int error = CL_SUCCESS;
+	int count = nodeCount > 0 ? nodeCount : 1;
+
+	refitter->nodeCount = nodeCount;
+	refitter->refit = clCreateKernel(program, "BVHRefit", &error);
+	if (error != CL_SUCCESS){
+		printf("OpenCL: Error creating BVHRefit kernel\n");
+		return error;
+	}
+
+	refitter->flags = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * count, NULL, &error);
+	refitter->zeros.assign(count, 0);
+
+	if (error != CL_SUCCESS){
+		printf("OpenCL: Error allocating refit buffers\n");
+	}
+	return error;
+}
+
+void ReleaseBVHRefitter(BVHRefitter *refitter){
+	clReleaseKernel(refitter->refit);
+	clReleaseMemObject(refitter->flags);
+}
+
+cl_int RefitDeviceBVH(BVHRefitter *refitter, cl_command_queue queue, cl_mem verts, cl_mem faces, cl_mem nodes, cl_mem parentLinks){
+	cl_int error = CL_SUCCESS;
+	cl_int nodeCount = refitter->nodeCount;
+	if (nodeCount == 0) return CL_SUCCESS;
+
+	error = clEnqueueWriteBuffer(queue, refitter->flags, CL_FALSE, 0, sizeof(cl_int) * nodeCount, refitter->zeros.data(), 0, NULL, NULL);
+
+	clSetKernelArg(refitter->refit, 0, sizeof(cl_mem), &verts);
+	clSetKernelArg(refitter->refit, 1, sizeof(cl_mem), &faces);
+	clSetKernelArg(refitter->refit, 2, sizeof(cl_int), &nodeCount);
+	clSetKernelArg(refitter->refit, 3, sizeof(cl_mem), &nodes);
+	clSetKernelArg(refitter->refit, 4, sizeof(cl_mem), &parentLinks);
+	clSetKernelArg(refitter->refit, 5, sizeof(cl_mem), &refitter->flags);
+	if (error == CL_SUCCESS) error = Enqueue1D(queue, refitter->refit, nodeCount);
+
+	if (error != CL_SUCCESS){
+		printf("OpenCL: Error enqueuing BVH refit\n");
+	}
+	return error;
+}
+
+cl_int CreateTriangleRecords(TriangleRecords *triangles, cl_program program){
+	cl_int error = CL_SUCCESS;
+
+	triangles->records = NULL;
+	triangles->count = -1;
+	triangles->pack = clCreateKernel(program, "PackTriangles", &error);
+	if (error != CL_SUCCESS){
+		printf("OpenCL: Error creating PackTriangles kernel\n");
+	}
+	return error;
+}
+
+void ReleaseTriangleRecords(TriangleRecords *triangles){
+	clReleaseKernel(triangles->pack);
+	if (triangles->records != NULL) clReleaseMemObject(triangles->records);
+}
+
+cl_int PackTriangles(TriangleRecords *triangles, cl_context context, cl_command_queue queue, cl_mem verts, cl_mem faces, int count){
+	cl_int error = CL_SUCCESS;
+
+	if (count != triangles->count){
+		if (triangles->records != NULL) clReleaseMemObject(triangles->records);
+		triangles->records = clCreateBuffer(context, CL_MEM_READ_WRITE, TRIANGLE_RECORD_SIZE * (count > 0 ? count : 1), NULL, &error);
+		triangles->count = count;
+		if (error != CL_SUCCESS){
+			printf("OpenCL: Error allocating triangle records\n");
+			return error;
+		}
+	}
+
+	clSetKernelArg(triangles->pack, 0, sizeof(cl_mem), &verts);
+	clSetKernelArg(triangles->pack, 1, sizeof(cl_mem), &faces);
+	clSetKernelArg(triangles->pack, 2, sizeof(cl_int), &count);
+	clSetKernelArg(triangles->pack, 3, sizeof(cl_mem), &triangles->records);
+	error = Enqueue1D(queue, triangles->pack, count);
+
+	if (error != CL_SUCCESS){
+		printf("OpenCL: Error enqueuing triangle packing\n");
+	}
+	return error;
+}
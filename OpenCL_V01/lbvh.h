@@ -0,0 +1,113 @@
+#ifndef LBVH_H
+#define LBVH_H
+
+#include <vector>
+
+#ifdef __APPLE__
+#include "OpenCL/opencl.h"
+#else
+#include "CL/cl.h"
+#endif
+
+#define RADIX_BITS 4
+#define RADIX_BLOCK 64 // keys per work-item, matches kernels/image.cl
+#define RADIX_SCAN_GROUP 256
+
+// Deepest leaf of any LBVH. Each level lengthens the common prefix of the
+// 30-bit Morton codes with index tie-breaks (lbvhDelta), which is 2 bits at
+// the root and at most 63 at the deepest inner node.
+#define LBVH_MAX_DEPTH 62
+
+// count work-items of a 1D kernel with the driver's local size, nothing when count is 0
+cl_int Enqueue1D(cl_command_queue queue, cl_kernel kernel, size_t count);
+
+// Device LSD radix sort of uint keys with int values (kernels/image.cl)
+struct RadixSorter
+{
+	cl_kernel histogram;
+	cl_kernel scan;
+	cl_kernel scatter;
+
+	cl_mem hist;
+
+	int capacity;
+	size_t scanGroupSize;
+};
+
+cl_int CreateRadixSorter(RadixSorter *sorter, cl_context context, cl_program program, cl_device_id device, int capacity);
+void ReleaseRadixSorter(RadixSorter *sorter);
+
+// Sort the first count keys[0] with their values[0], up to the capacity.
+// keys[1] and values[1] are scratch, the result ends in keys[0]/values[0].
+cl_int RadixSort(RadixSorter *sorter, cl_command_queue queue, cl_mem keys[2], cl_mem values[2], int count);
+
+// Device side LBVH build (kernels/image.cl), keeps geometry on the device
+// so a changing scene can be rebuilt every frame.
+struct LBVHBuilder
+{
+	RadixSorter sorter;
+
+	cl_kernel centroidBounds;
+	cl_kernel mortonCodes;
+	cl_kernel buildTree;
+	cl_kernel buildBounds;
+	cl_kernel reorderFaces;
+	cl_kernel parentLinks;
+
+	cl_mem bounds;
+	cl_mem codes[2];
+	cl_mem ids[2];
+	cl_mem parents;
+	cl_mem leafSlots;
+	cl_mem internalSlots;
+	cl_mem flags;
+
+	int faceCount;
+	std::vector<int> zeros;
+};
+
+cl_int CreateLBVHBuilder(LBVHBuilder *builder, cl_context context, cl_program program, cl_device_id device, int faceCount);
+void ReleaseLBVHBuilder(LBVHBuilder *builder);
+
+// Rebuild nodes ((2 * faceCount - 1) BVHNodes) from verts and srcFaces,
+// writing faces and faceMats in leaf order for the Filter kernel.
+// parentLinks (one int per node) is only filled when not NULL.
+cl_int BuildLBVH(LBVHBuilder *builder, cl_command_queue queue, cl_mem verts, cl_mem srcFaces, cl_mem srcFaceMats,
+	cl_mem faces, cl_mem faceMats, cl_mem nodes, cl_mem parentLinks);
+
+// Device refit of a binary BVH after the vertices moved, keeps the
+// topology and works on both host built and LBVH trees
+struct BVHRefitter
+{
+	cl_kernel refit;
+	cl_mem flags;
+	int nodeCount;
+	std::vector<int> zeros;
+};
+
+cl_int CreateBVHRefitter(BVHRefitter *refitter, cl_context context, cl_program program, int nodeCount);
+void ReleaseBVHRefitter(BVHRefitter *refitter);
+
+// faces are in leaf order, parentLinks holds the parent of every node
+cl_int RefitDeviceBVH(BVHRefitter *refitter, cl_command_queue queue, cl_mem verts, cl_mem faces, cl_mem nodes, cl_mem parentLinks);
+
+#define TRIANGLE_RECORD_SIZE (3 * 4 * sizeof(cl_float))
+
+// Triangles packed for the Filter kernel, one record per face entry in
+// leaf order: v0, v2 - v0 and v1 - v0 as float4, so a candidate is three
+// aligned loads instead of nine gathered through the face indices
+struct TriangleRecords
+{
+	cl_kernel pack;
+	cl_mem records;
+	int count;
+};
+
+cl_int CreateTriangleRecords(TriangleRecords *triangles, cl_program program);
+void ReleaseTriangleRecords(TriangleRecords *triangles);
+
+// Repack after the vertices or the face order changed, records is
+// reallocated when the number of face entries did
+cl_int PackTriangles(TriangleRecords *triangles, cl_context context, cl_command_queue queue, cl_mem verts, cl_mem faces, int count);
+
+#endif
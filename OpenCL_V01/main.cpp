@@ -4,8 +4,21 @@
 #include <fstream>
 #include <sstream>
 #include <stdio.h>
+#include <chrono>
 #include "objLoader.h"
 #include "obj_parser.h"
+#include "bvh.h"
+#include "task_pool.h"
+#include "lbvh.h"
+#include "scene.h"
+#include "bvh_cache.h"
+#include "accelerator.h"
+#include "wavefront.h"
+#include "tiles.h"
+#include "autotune.h"
+#include "variants.h"
+#include "render_loop.h"
+#include "multi_device.h"
 #include "GL/freeglut.h"
 
 #ifdef __APPLE__
@@ -21,6 +34,105 @@ int height = 512;
 int spp = 0;
 float* pixels = NULL;
 
+// Traverse the BVH in the kernel, false falls back to testing every face
+bool useBVH = true;
+
+// Cast a shadow ray toward the light for every lit point, through the
+// any-hit traversal which stops at the first blocker
+bool useShadows = true;
+
+// Render with the generate/extend/shade/connect stages instead of the
+// Filter megakernel. Each frame prints its time in both modes, so the two
+// can be compared per scene.
+bool useWavefront = false;
+
+// Launch the tracing kernels (Filter, or the wavefront extend and connect
+// stages) just wide enough to fill the device, their work-items fetch
+// rays from an atomic counter until none are left. With useWavefront the
+// speedup on shadow rays is reported at load time.
+bool usePersistentThreads = false;
+
+// Sort shadow rays by origin cell and direction octant on the device
+// before the wavefront pipeline traces them. Rays/s with and without the
+// sort are reported at load time.
+bool sortRays = false;
+
+// Dispatch megakernel frames as tileSize tiles in tileOrder instead of one
+// NDRange, so no launch runs long enough to trip a display watchdog and
+// the first tiles (the center with TILE_ORDER_CENTER_OUT) finish early
+bool useTiles = false;
+int tileSize = TILE_SIZE;
+TileOrder tileOrder = TILE_ORDER_HILBERT;
+
+// Time Filter with every work-group shape the device allows (and tile
+// sizes when useTiles is set) at load time and keep the fastest in
+// TUNE_FILE. Without it, a shape saved for this device and kernel is used.
+bool tuneWorkGroups = false;
+
+// Render loopFrames megakernel frames into two output images, reading each
+// back on a second queue while the next renders. The same frames are then
+// rendered waiting for each readback, and the device utilization of both
+// is printed.
+bool asyncLoop = false;
+int loopFrames = 16;
+
+// Render megakernel frames on every device of every platform, not only the
+// first. Tiles (tileSize, tileOrder) are handed out from one shared
+// counter, so faster devices take more of them, and are merged into one
+// frame. Each device keeps its own copy of the scene, sent again before
+// the next frame after MoveObject or UpdateVertices.
+bool multiDevice = false;
+
+// Structure built when useBVH is set. The multi-level grid tends to win on
+// dense scanned meshes, the BVH on sparse scenes with uneven detail. The
+// options below that mention the BVH only apply to ACCELERATOR_BVH.
+AcceleratorType acceleratorType = ACCELERATOR_BVH;
+
+// Binned SAH on every core, false uses the single threaded sweep builder
+bool parallelBuild = true;
+
+// Build the BVH on the device from Morton codes instead of on the host
+bool deviceBuild = false;
+
+// Collapse the host BVH into BVH_WIDTH wide nodes with quantized boxes
+bool useWideBVH = true;
+
+// Walk the binary BVH with parent/sibling links instead of a private stack
+bool useStackless = false;
+
+// One BLAS per OBJ object/group under a TLAS, so objects can be moved
+bool useTLAS = false;
+
+// SBVH build, straddling triangles may be split into up to splitBudget
+// extra references (a fraction of the face count)
+bool spatialSplits = false;
+float splitBudget = 0.3f;
+
+// Restructure treelets after the host build, slower to build but cheaper
+// to trace, meant for final renders
+bool optimizeTreelets = false;
+
+// Keep the host BVH in <sceneFile>.bvh, keyed by the OBJ/MTL contents and
+// the build options, so a warm start skips parsing and building
+bool useBVHCache = true;
+const char *sceneFile = "test.obj";
+
+// Keep compiled kernel binaries next to the source (PROGRAM_CACHE_PREFIX),
+// keyed by device, driver, build options and source, so a warm start
+// skips clBuildProgram from source
+bool useProgramCache = true;
+
+// Refit binary nodes on the device after vertex updates, wide nodes are
+// always refit on the host and collapsed again
+bool deviceRefit = true;
+
+// Rebuild once refits have grown the SAH cost past this factor of the build
+float refitRebuildRatio = 1.5f;
+
+// Where the BVH report printed at load time is also written as JSON,
+// NULL to only print it
+const char *statsFile = NULL;
+
 // OpenCL stuff
 cl_command_queue queue = NULL;
 cl_int error = 0;
@@ -35,6 +147,52 @@ static cl_mem mem_rand_states = NULL; //random number states
 static unsigned int* rand_states = NULL; //local
 static cl_mem mem_image = NULL;
 
+// Device BVH build, source faces stay in file order
+static LBVHBuilder lbvhBuilder;
+static cl_mem mem_verts = NULL;
+static cl_mem mem_src_faces = NULL;
+static cl_mem mem_src_face_mats = NULL;
+static cl_mem mem_faces = NULL;
+static cl_mem mem_face_mats = NULL;
+static cl_mem mem_bvh = NULL;
+static cl_mem mem_bvh_parents = NULL;
+static cl_mem mem_face_count = NULL;
+static cl_mem mem_materials = NULL;
+static cl_mem mem_accum = NULL;
+static cl_mem mem_sample_counts = NULL;
+
+// Two-level scene, only the TLAS is rebuilt when an object moves
+static Scene scene;
+static cl_mem mem_tlas = NULL;
+static cl_mem mem_instances = NULL;
+
+// Host copy of the flat BVH for refits and rebuilds. Source faces stay in
+// file order, hostFaces has one entry per leaf reference.
+static TaskPool *buildPool = NULL;
+static Accelerator *accelerator = NULL;
+static BVH hostBVH;
+static std::vector<int> hostSrcFaces;
+static std::vector<int> hostSrcFaceMats;
+static std::vector<int> hostFaces;
+static std::vector<int> hostFaceMats;
+static float builtSAHCost = 0;
+static int refitsSinceCheck = 0;
+static int traversalStackSize = 0; // BVH_STACK_SIZE of the program, 0 when it has no stack
+static BVHRefitter refitter;
+static bool refitterCreated = false;
+static TriangleRecords triangleRecords;
+static WavefrontPipeline wavefront;
+static cl_kernel persistentKernel = NULL;
+static cl_mem mem_pixel_counter = NULL;
+static size_t persistentGlobal = 0;
+static size_t persistentLocal = 0;
+static std::vector<Tile> frameTiles;
+static LaunchShape launchShape = { { 0, 0 }, 0 };
+static ProgramVariants programVariants;
+static RenderLoop renderLoop;
+static MultiDevice multi;
+static bool multiSceneChanged = false; // the other devices get the scene before the next frame
+
 struct vector3d
 {
 	float X, Y, Z;
@@ -188,17 +346,19 @@ float *VertsToFloat3(obj_vector** verts, int vertCount){
 	return output;
 }
 
+// One float4 per material, so the kernel reads it with a single load
 float *GetObjectMaterials(objLoader* object, int faceCount){
-	int arraySize = object->materialCount * 3;
+	int arraySize = object->materialCount * MATERIAL_FLOATS;
 	float *materials = (float*)malloc(arraySize * sizeof(float));
 
 
 	// Each face
 	for (int i = 0; i < object->materialCount; i++){
 		for (int k = 0; k < 3; k++){
-			materials[i * 3 + k] = object->materialList[i]->diff[k];
+			materials[i * MATERIAL_FLOATS + k] = object->materialList[i]->diff[k];
 			//materials[i * 3 + k] = object->materialList[object->faceList[i]->material_index]->diff[k];
 		}
+		materials[i * MATERIAL_FLOATS + 3] = 0.0f;
 	}
 
 	return materials;
@@ -221,12 +381,23 @@ int *FacesToMats(objLoader* object, int faceCount){
 
 	// Each face
 	for (int i = 0; i < faceCount; i++){
-		faceMats[i] = object->faceList[i]->material_index*3;
+		faceMats[i] = object->faceList[i]->material_index;
 	}
 
 	return faceMats;
 }
 
+int *FacesToObjects(objLoader* object, int faceCount){
+	int *faceObjects = (int*)malloc(faceCount * sizeof(int));
+
+	// Each face
+	for (int i = 0; i < faceCount; i++){
+		faceObjects[i] = object->faceList[i]->object_index;
+	}
+
+	return faceObjects;
+}
+
 int *FacesToVerts(obj_face** faces, int faceCount){
 	int arraySize = faceCount * 3;
 	int *output = (int*)malloc(arraySize * sizeof(int));
@@ -245,7 +416,7 @@ int *FacesToVerts(obj_face** faces, int faceCount){
 
 objLoader * parseObj(){
 	objLoader *objData = new objLoader();
-	objData->load("test.obj");
+	objData->load((char*)sceneFile);
 
 	// 
 	const int faceAmount = objData->faceCount;
@@ -288,6 +459,35 @@ std::string GetDeviceName(cl_device_id id)
 	return result;
 }
 
+// Memory limits the scene buffers are checked against before creation
+struct DeviceLimits
+{
+	cl_ulong maxAlloc; // one buffer
+	cl_ulong globalMem; // all buffers together
+	cl_ulong maxConstant; // one __constant argument
+};
+
+static DeviceLimits deviceLimits;
+
+DeviceLimits GetDeviceLimits(cl_device_id id)
+{
+	DeviceLimits limits;
+	clGetDeviceInfo(id, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &limits.maxAlloc, nullptr);
+	clGetDeviceInfo(id, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(cl_ulong), &limits.globalMem, nullptr);
+	clGetDeviceInfo(id, CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE, sizeof(cl_ulong), &limits.maxConstant, nullptr);
+	return limits;
+}
+
+// False, with a message, when a buffer this large can not be allocated
+static bool FitsDevice(const char *name, size_t size)
+{
+	if (size <= deviceLimits.maxAlloc) return true;
+
+	fprintf(stderr, "%s needs %.1f MB, the device allocates at most %.1f MB per buffer\n", name,
+		size / (1024.0 * 1024.0), deviceLimits.maxAlloc / (1024.0 * 1024.0));
+	return false;
+}
+
 void CheckError(cl_int error)
 {
 	if (error != CL_SUCCESS) {
@@ -404,32 +604,46 @@ static void Display_cb(void) {
 }
 
 
-//TODO figure out more efficient way of averaging samples
+// Start averaging again, after the view or the scene changed
+static void ResetAccumulation(void) {
+	const cl_float4 zeroColor = { { 0.0f, 0.0f, 0.0f, 0.0f } };
+	const cl_int zeroCount = 0;
+	CheckError(clEnqueueFillBuffer(queue, mem_accum, &zeroColor, sizeof(zeroColor), 0, sizeof(cl_float4)*width*height, 0, NULL, NULL));
+	CheckError(clEnqueueFillBuffer(queue, mem_sample_counts, &zeroCount, sizeof(zeroCount), 0, sizeof(cl_int)*width*height, 0, NULL, NULL));
+	ResetMultiDevice(&multi);
+	spp = 0;
+}
+
+// Running sum and sample count of every pixel, Filter arguments 9 and 10.
+// The kernels add each pass to them and write the mean to the output
+// image, so a pass needs no host work.
+static void AllocateAccumulation(void) {
+	cl_int error = CL_SUCCESS;
+	if (mem_accum != NULL) clReleaseMemObject(mem_accum);
+	if (mem_sample_counts != NULL) clReleaseMemObject(mem_sample_counts);
+
+	mem_accum = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_float4)*width*height, NULL, &error);
+	mem_sample_counts = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int)*width*height, NULL, &error);
+	CheckError(error);
+
+	clSetKernelArg(kernel, 9, sizeof (cl_mem), &mem_accum);
+	clSetKernelArg(kernel, 10, sizeof (cl_mem), &mem_sample_counts);
+	ResetAccumulation();
+}
+
+// Copy the averaged frame into pixels, only when it is shown or saved
 void UpdateLocalPixels(void) {
 	cl_int error = 0;
 	const size_t origin[3] = { 0, 0, 0 };
 	const size_t region[3] = { width, height, 1 };
-	float* old_pixels = (float*)malloc(width * height * 4 * sizeof(float));
-	memcpy(old_pixels, pixels, width * height * 4 * sizeof(float));
 
 	//local pixel array should already be allocated
-	error = clEnqueueReadImage(queue, outputImage2, CL_TRUE, origin, region, 0, 0, pixels, 0, NULL, NULL);
+	error = clEnqueueReadImage(queue, outputImage, CL_TRUE, origin, region, 0, 0, pixels, 0, NULL, NULL);
 
 	if (error != CL_SUCCESS) {
 		printf("OpenCL: Error reading output from outputImage into local variable\n");
 		exit(error);
 	}
-	if (spp > 0) {
-		int i, j;
-		for (i = 0; i < width*height; i++) {
-			for (j = 0; j < 4; j++) {
-				pixels[i * 4 + j] = (old_pixels[i * 4 + j] * (spp - 1) + pixels[i * 4 + j]) / (float)spp;
-			}
-		}
-	}
-	free(old_pixels);
-	old_pixels = NULL;
-	spp++;
 }
 
 
@@ -475,26 +689,185 @@ int runKernelOriginal(){
 	return 0;
 }
 
+// Buffers behind Filter arguments 1-8, which the wavefront stages share
+static SceneBuffers CurrentScene(void) {
+	SceneBuffers buffers;
+	buffers.triangles = triangleRecords.records;
+	buffers.faceCount = mem_face_count;
+	buffers.faceMats = mem_face_mats;
+	buffers.materials = mem_materials;
+	buffers.nodes = mem_bvh;
+	buffers.links = mem_bvh_parents;
+	buffers.tlasNodes = mem_tlas;
+	buffers.instances = mem_instances;
+	return buffers;
+}
+
+// Image the kernels write and the running sum behind it
+static FrameBuffers CurrentFrame(void) {
+	FrameBuffers frame;
+	frame.image = outputImage;
+	frame.accum = mem_accum;
+	frame.sampleCounts = mem_sample_counts;
+	return frame;
+}
+
+// Enqueue Filter over a frame with the given work-group shape, tiled
+// frames are waited for
+static cl_int EnqueueFilter(const size_t *size, const LaunchShape &shape, TileStats *stats) {
+	const size_t *local = shape.local[0] != 0 ? shape.local : NULL;
+
+	if (useTiles){
+		int edge = shape.tileSize > 0 ? shape.tileSize : tileSize;
+		if (local != NULL && (edge % local[0] != 0 || edge % local[1] != 0)) local = NULL;
+
+		BuildTiles(&frameTiles, (int)size[0], (int)size[1], edge, tileOrder);
+		return RenderTiles(queue, kernel, frameTiles, local, TILES_IN_FLIGHT, stats);
+	}
+
+	size_t global[2] = { size[0], size[1] };
+	if (local != NULL){
+		global[0] = RoundUp((int)local[0], (int)size[0]);
+		global[1] = RoundUp((int)local[1], (int)size[1]);
+	}
+	return clEnqueueNDRangeKernel(queue, kernel, 2, NULL, global, local, 0, nullptr, nullptr);
+}
+
+// Add one sample per pixel with the megakernel or the wavefront stages,
+// waits for it and prints the time so the two can be compared
+static cl_int RenderFrame(const size_t *size) {
+	auto frameStart = std::chrono::high_resolution_clock::now();
+
+	cl_int error;
+	TileStats tileStats;
+	if (useWavefront){
+		error = RenderWavefront(&wavefront, queue, CurrentScene(), CurrentFrame(), usePersistentThreads, sortRays);
+	}
+	else if (usePersistentThreads){
+		SceneBuffers scene = CurrentScene();
+		cl_int frameWidth = (cl_int)size[0];
+		cl_int frameHeight = (cl_int)size[1];
+		const cl_int zero = 0;
+
+		clSetKernelArg(persistentKernel, 0, sizeof (cl_mem), &outputImage);
+		clSetKernelArg(persistentKernel, 1, sizeof (cl_mem), &scene.triangles);
+		clSetKernelArg(persistentKernel, 2, sizeof (cl_mem), &scene.faceCount);
+		clSetKernelArg(persistentKernel, 3, sizeof (cl_mem), &scene.faceMats);
+		clSetKernelArg(persistentKernel, 4, sizeof (cl_mem), &scene.materials);
+		clSetKernelArg(persistentKernel, 5, sizeof (cl_mem), &scene.nodes);
+		clSetKernelArg(persistentKernel, 6, sizeof (cl_mem), &scene.links);
+		clSetKernelArg(persistentKernel, 7, sizeof (cl_mem), &scene.tlasNodes);
+		clSetKernelArg(persistentKernel, 8, sizeof (cl_mem), &scene.instances);
+		clSetKernelArg(persistentKernel, 9, sizeof (cl_mem), &mem_pixel_counter);
+		clSetKernelArg(persistentKernel, 10, sizeof (cl_int), &frameWidth);
+		clSetKernelArg(persistentKernel, 11, sizeof (cl_int), &frameHeight);
+		clSetKernelArg(persistentKernel, 12, sizeof (cl_mem), &mem_accum);
+		clSetKernelArg(persistentKernel, 13, sizeof (cl_mem), &mem_sample_counts);
+
+		error = clEnqueueWriteBuffer(queue, mem_pixel_counter, CL_TRUE, 0, sizeof(cl_int), &zero, 0, NULL, NULL);
+		if (error == CL_SUCCESS) error = clEnqueueNDRangeKernel(queue, persistentKernel, 1, NULL, &persistentGlobal, &persistentLocal, 0, nullptr, nullptr);
+	}
+	else {
+		error = EnqueueFilter(size, launchShape, &tileStats);
+	}
+	clFinish(queue);
+	spp++;
+
+	auto frameEnd = std::chrono::high_resolution_clock::now();
+	double frameMs = std::chrono::duration<double, std::milli>(frameEnd - frameStart).count();
+	double pixelCount = (double)size[0] * size[1];
+
+	if (useWavefront){
+		int rays = 0, shadowRays = 0;
+		WavefrontRayCounts(&wavefront, queue, &rays, &shadowRays);
+		printf("Frame (wavefront): %.2f ms, %.2f Mpixels/s, %d rays, %d shadow rays\n", frameMs,
+			frameMs > 0 ? pixelCount / (frameMs * 1e3) : 0.0, rays, shadowRays);
+	}
+	else {
+		printf("Frame (megakernel): %.2f ms, %.2f Mpixels/s\n", frameMs, frameMs > 0 ? pixelCount / (frameMs * 1e3) : 0.0);
+		if (useTiles && !usePersistentThreads){
+			const char *orderNames[3] = { "scanline", "hilbert", "center-out" };
+			PrintTileStats(orderNames[tileOrder], tileStats);
+		}
+	}
+	return error;
+}
+
+// loopFrames frames waited for one by one, then as many through the
+// double-buffered loop. pixels holds the last frame afterwards.
+static cl_int RunFrameLoop(const size_t *size) {
+	const size_t *local = launchShape.local[0] != 0 ? launchShape.local : NULL;
+	size_t global[2] = { size[0], size[1] };
+	if (local != NULL){
+		global[0] = RoundUp((int)local[0], (int)size[0]);
+		global[1] = RoundUp((int)local[1], (int)size[1]);
+	}
+
+	// What the display would upload, pixels is what it draws from
+	auto present = [](const unsigned char *frame, int){ memcpy(pixels, frame, (size_t)width * height * 4); };
+
+	LoopStats serial, pipelined;
+	cl_int error = RunRenderLoop(&renderLoop, queue, kernel, global, local, loopFrames, false, present, &serial);
+	if (error == CL_SUCCESS){
+		error = RunRenderLoop(&renderLoop, queue, kernel, global, local, loopFrames, true, present, &pipelined);
+	}
+	clSetKernelArg(kernel, 0, sizeof (cl_mem), &outputImage);
+	if (error != CL_SUCCESS) return error;
+
+	spp += 2 * loopFrames;
+	PrintLoopStats("wait per frame", serial);
+	PrintLoopStats("double-buffered", pipelined);
+	return CL_SUCCESS;
+}
+
+// One frame from every device, merged into pixels
+static cl_int RenderFrameMultiDevice(const size_t *size) {
+	auto frameStart = std::chrono::high_resolution_clock::now();
+
+	// Scene updates since the last frame went to the primary only, the
+	// rest render the same scene once they have them
+	if (multiSceneChanged){
+		cl_int error = SyncMultiDeviceScene(&multi, CurrentScene());
+		if (error != CL_SUCCESS) return error;
+		multiSceneChanged = false;
+	}
+
+	// The primary renders into whatever outputImage is now
+	multi.workers[0].image = outputImage;
+	BuildTiles(&frameTiles, (int)size[0], (int)size[1], tileSize, tileOrder);
+	cl_int error = RenderMultiDevice(&multi, frameTiles, (unsigned char*)pixels);
+	if (error != CL_SUCCESS) return error;
+	spp++;
+
+	auto frameEnd = std::chrono::high_resolution_clock::now();
+	double frameMs = std::chrono::duration<double, std::milli>(frameEnd - frameStart).count();
+	printf("Frame (%d devices): %.2f ms, %.2f Mpixels/s\n", (int)multi.workers.size(), frameMs,
+		frameMs > 0 ? (double)size[0] * size[1] / (frameMs * 1e3) : 0.0);
+	PrintMultiDeviceStats(multi, (int)frameTiles.size());
+	return CL_SUCCESS;
+}
+
 int runKernel(){
 	Image result = RGBtoRGBA(LoadImage("test.ppm"));
 
 	// Run the processing
-	std::size_t offset[3] = { 0 };
 	std::size_t size[3] = { result.width, result.height, 1 };
 
 	std::cout << "About to do stuff with Queque /n" << std::endl;
-	error = clEnqueueNDRangeKernel(queue, kernel, 2, offset, size, nullptr, 0, nullptr, nullptr);
-	CheckError(error);
-
-	// Prepare the result image, set to black
-	std::fill(result.pixel.begin(), result.pixel.end(), 0);
-
-	// Get the result back to the host
-	std::size_t origin[3] = { 0 };
-	std::size_t region[3] = { result.width, result.height, 1 };
+	if (multiDevice && !useWavefront && !usePersistentThreads){
+		CheckError(RenderFrameMultiDevice(size));
+	}
+	else if (asyncLoop && !useWavefront && !usePersistentThreads && !useTiles){
+		CheckError(RunFrameLoop(size));
+	}
+	else {
+		error = RenderFrame(size);
+		CheckError(error);
 
-	// Get the result back to the host
-	error = clEnqueueReadImage(queue, outputImage, CL_TRUE, origin, region, 0, 0, result.pixel.data(), 0, nullptr, nullptr);
+		// Get the averaged frame back to the host once, for the display and the file
+		UpdateLocalPixels();
+	}
+	memcpy(result.pixel.data(), pixels, result.pixel.size());
 
 	// Save and finish up
 	SaveImage(RGBAtoRGB(result), "output.ppm");
@@ -502,18 +875,6 @@ int runKernel(){
 	std::cout << "Finished.  Press any key to continue" << std::endl;
 	std::getchar();
 
-	std::cout << "About to do stuff with Queue again /n" << std::endl;
-
-	// Save image into pixels
-	error = clEnqueueReadImage(queue, outputImage, CL_TRUE, origin, region, 0, 0, pixels, 0, nullptr, nullptr);
-	CheckError(error);
-	std::cout << "Finished reading image" << std::endl;
-
-	clFlush(queue); //issue all queued opencl commands to device
-	clFinish(queue); //wait till processing is done
-
-	UpdateLocalPixels();
-
 	//std::cout << "About to update local pixel array" << std::endl;
 
 	/*clEnqueueReadImage(queue, outputImage2, CL_TRUE, origin, region, 0, 0, pixels, 0, nullptr, nullptr);
@@ -532,9 +893,13 @@ static void ExecuteKernel(void) {
 	printf("OpenCL: Executing kernel\n");
 	cl_int error = 0;
 
-	size_t num_local_work_items[2] = { 16, 16 };
-	size_t num_global_work_items[2] = { RoundUp(num_local_work_items[0], width),
-		RoundUp(num_local_work_items[1], height) };
+	// Tuned shape when there is one, the driver's choice otherwise
+	size_t *num_local_work_items = launchShape.local[0] != 0 ? launchShape.local : NULL;
+	size_t num_global_work_items[2] = { (size_t)width, (size_t)height };
+	if (num_local_work_items != NULL){
+		num_global_work_items[0] = RoundUp(num_local_work_items[0], width);
+		num_global_work_items[1] = RoundUp(num_local_work_items[1], height);
+	}
 
 	error = clEnqueueNDRangeKernel(command_queue, kernel, 2, NULL,
 		num_global_work_items, num_local_work_items, 0, NULL, NULL);
@@ -549,9 +914,10 @@ void OpenCLRender(void) {
 	ExecuteKernel(); //execute kernel to command queue
 	clFlush(queue); //issue all queued opencl commands to device
 	clFinish(queue); //wait till processing is done
-	//cout<<"About to update local pixel array"<<endl;
+	spp++;
 
-	UpdateLocalPixels(); //update local image
+	// The kernel keeps the average on the device, pixels are read back
+	// with UpdateLocalPixels when a frame is shown
 }
 
 void OpenCLResetRender(void) {
@@ -562,6 +928,9 @@ void OpenCLResetRender(void) {
 	//--------------------------------------Image
 	clReleaseMemObject(outputImage);
 	outputImage = clCreateImage2D(context, CL_MEM_WRITE_ONLY, &format, width, height, 0, NULL, &error);
+	clSetKernelArg(kernel, 0, sizeof (cl_mem), &outputImage);
+
+	AllocateAccumulation();
 }
 
 
@@ -616,6 +985,357 @@ void SetupGLUT(int argc, char** argv) {
 }
 
 
+static bool UseGrid(void) {
+	return useBVH && acceleratorType == ACCELERATOR_GRID;
+}
+
+static bool UseDeviceBuild(void) {
+	return deviceBuild && !UseGrid();
+}
+
+// Instances are built on the host and walked with the binary stack
+static bool UseTLAS(void) {
+	return useBVH && useTLAS && !UseDeviceBuild() && !UseGrid();
+}
+
+// Wide nodes come from the host collapse and have no stackless walk
+static bool UseWideNodes(void) {
+	return useBVH && useWideBVH && !useStackless && !UseDeviceBuild() && !UseTLAS() && !UseGrid();
+}
+
+static Accelerator *CreateAccelerator(void) {
+	if (UseGrid()) return new GridAccelerator();
+
+	BVHSettings settings;
+	settings.parallel = parallelBuild;
+	settings.spatialSplits = spatialSplits;
+	settings.splitBudget = splitBudget;
+	settings.optimizeTreelets = optimizeTreelets;
+	settings.wide = UseWideNodes();
+	settings.stackless = useStackless && !UseTLAS();
+	return new BVHAccelerator(&hostBVH, settings);
+}
+
+// Traversal stack entries (BVH_STACK_SIZE) the trees of this scene need.
+// A TLAS over n instances never needs more than n and an LBVH no more than
+// LBVH_MAX_DEPTH + 1, so moves and device rebuilds stay within it.
+static int TraversalStackSize(int faceCount) {
+	if (!useBVH || UseGrid()) return 0;
+
+	if (UseDeviceBuild()){
+		int bound = faceCount > 0 ? faceCount : 1;
+		return bound < LBVH_MAX_DEPTH + 1 ? bound : LBVH_MAX_DEPTH + 1;
+	}
+	if (UseTLAS()){
+		int size = scene.instances.size() > 0 ? (int)scene.instances.size() : 1;
+		for (size_t i = 0; i < scene.blas.size(); i++){
+			int blasSize = BVHStackDepth(scene.blasNodes, scene.blas[i].nodeOffset);
+			if (blasSize > size) size = blasSize;
+		}
+		return size;
+	}
+	return accelerator->StackDepth();
+}
+
+// TLAS nodes the device buffer holds. A rebuild can split differently
+// after a move, a binary tree over n instances never needs more than 2n - 1.
+static size_t TLASNodeCapacity(void) {
+	return scene.instances.size() > 0 ? 2 * scene.instances.size() - 1 : 1;
+}
+
+// Place an object and refit the scene by rebuilding the TLAS alone
+void MoveObject(int instance, const float *objectToWorld) {
+	auto buildStart = std::chrono::high_resolution_clock::now();
+
+	SetInstanceTransform(&scene, instance, objectToWorld);
+	BuildTLAS(&scene);
+
+	CheckError(clEnqueueWriteBuffer(queue, mem_tlas, CL_TRUE, 0, sizeof(BVHNode)*scene.tlas.nodes.size(), scene.tlas.nodes.data(), 0, NULL, NULL));
+	CheckError(clEnqueueWriteBuffer(queue, mem_instances, CL_TRUE, 0, sizeof(BVHInstance)*scene.tlasInstances.size(), scene.tlasInstances.data(), 0, NULL, NULL));
+	ResetAccumulation();
+	multiSceneChanged = true;
+
+	auto buildEnd = std::chrono::high_resolution_clock::now();
+	printf("TLAS: %d instances, rebuilt in %.3f ms\n", (int)scene.instances.size(),
+		std::chrono::duration<double, std::milli>(buildEnd - buildStart).count());
+}
+
+// Rebuild the BVH from the vertex buffer without leaving the device
+void RebuildDeviceBVH(void) {
+	auto buildStart = std::chrono::high_resolution_clock::now();
+
+	CheckError(BuildLBVH(&lbvhBuilder, queue, mem_verts, mem_src_faces, mem_src_face_mats, mem_faces, mem_face_mats, mem_bvh, mem_bvh_parents));
+	clFinish(queue);
+
+	auto buildEnd = std::chrono::high_resolution_clock::now();
+
+	// Baseline for the refit quality check
+	hostBVH.nodes.resize(lbvhBuilder.faceCount > 0 ? 2 * lbvhBuilder.faceCount - 1 : 0);
+	CheckError(clEnqueueReadBuffer(queue, mem_bvh, CL_TRUE, 0, sizeof(BVHNode)*hostBVH.nodes.size(), hostBVH.nodes.data(), 0, NULL, NULL));
+	builtSAHCost = BVHSAHCost(&hostBVH);
+	refitsSinceCheck = 0;
+
+	printf("LBVH: %d faces, SAH cost %.2f, built on device in %.2f ms\n", lbvhBuilder.faceCount, builtSAHCost,
+		std::chrono::duration<double, std::milli>(buildEnd - buildStart).count());
+}
+
+// Full host build from the source faces, hostFaces and hostFaceMats are
+// then filled in the order the structure indexes them
+static void BuildHostAccelerator(const float *verts) {
+	accelerator->Build(verts, hostSrcFaces.data(), (int)hostSrcFaceMats.size(), buildPool);
+	GatherFaces(accelerator->FaceOrder(), hostSrcFaces.data(), hostSrcFaceMats.data(), &hostFaces, &hostFaceMats);
+
+	if (!UseGrid()){
+		builtSAHCost = BVHSAHCost(&hostBVH);
+		refitsSinceCheck = 0;
+	}
+}
+
+static size_t BufferSize(cl_mem buffer) {
+	size_t size = 0;
+	if (buffer != NULL) clGetMemObjectInfo(buffer, CL_MEM_SIZE, sizeof(size_t), &size, NULL);
+	return size;
+}
+
+// Pack the triangle records from mem_verts and mem_faces (leaf order)
+static void UpdateTriangles(void) {
+	int count = (int)(BufferSize(mem_faces) / (3 * sizeof(int)));
+	CheckError(PackTriangles(&triangleRecords, context, queue, mem_verts, mem_faces, count));
+	clSetKernelArg(kernel, 1, sizeof (cl_mem), &triangleRecords.records);
+}
+
+// Print an entry of the load time report, file may be NULL
+static bool ReportBVHStats(FILE *file, const char *name, const BVHStats &stats) {
+	PrintBVHStats(name, stats);
+	return file == NULL || WriteBVHStatsJSON(file, name, stats);
+}
+
+// Stats of the structure the kernel traverses, also written to statsFile
+// as a JSON array. Sizes of the BVHs built outside the accelerator are
+// taken from their device buffers.
+static void ReportAccelerator(int faceCount) {
+	if (!useBVH) return;
+
+	FILE *file = NULL;
+	if (statsFile != NULL){
+		file = fopen(statsFile, "w");
+		if (file == NULL) printf("Stats: could not write %s\n", statsFile);
+	}
+	if (file != NULL) fprintf(file, "[\n");
+
+	bool written = true;
+	if (UseTLAS()){
+		BVHStats blas, tlas;
+		std::vector<int> roots;
+		for (size_t i = 0; i < scene.blas.size(); i++){
+			roots.push_back(scene.blas[i].nodeOffset);
+		}
+		ComputeBVHStats(&blas, scene.blasNodes, roots, faceCount, BufferSize(mem_bvh));
+		written = ReportBVHStats(file, "BLAS", blas) && written;
+		if (file != NULL) fprintf(file, ",\n");
+
+		// Leaves index instances rather than faces
+		int instanceCount = (int)scene.instances.size();
+		ComputeBVHStats(&tlas, scene.tlas.nodes, std::vector<int>(1, 0), instanceCount, BufferSize(mem_tlas));
+		tlas.faceBytes = BufferSize(mem_instances);
+		tlas.bytesPerFace = instanceCount > 0 ? (float)(tlas.nodeBytes + tlas.faceBytes) / instanceCount : 0.0f;
+		written = ReportBVHStats(file, "TLAS", tlas) && written;
+	}
+	else if (UseDeviceBuild()){
+		BVHStats stats;
+		ComputeBVHStats(&stats, hostBVH.nodes, std::vector<int>(1, 0), faceCount, BufferSize(mem_bvh));
+		written = ReportBVHStats(file, "LBVH", stats);
+	}
+	else {
+		written = accelerator->Report(faceCount, file);
+	}
+
+	if (file == NULL) return;
+
+	fprintf(file, "\n]\n");
+	written = fclose(file) == 0 && written;
+	printf("Stats: %s %s\n", written ? "written to" : "could not be written to", statsFile);
+}
+
+// Everything that changes the host build, part of the cache key
+static std::string BuildParams(void) {
+	char params[256];
+	snprintf(params, sizeof(params), "parallel=%d sbvh=%d budget=%g treelets=%d leaf=%d bins=%d sbvhBins=%d treeletLeaves=%d rounds=%d",
+		parallelBuild, spatialSplits, splitBudget, optimizeTreelets, BVH_MAX_LEAF_SIZE, BVH_BIN_COUNT, SBVH_BIN_COUNT,
+		BVH_TREELET_LEAVES, BVH_TREELET_ROUNDS);
+	return params;
+}
+
+// Faces may change count with a new SBVH, the buffers follow
+static void UploadHostFaces(void) {
+	cl_int error = CL_SUCCESS;
+	size_t faceBytes = sizeof(int)*hostFaces.size();
+	size_t bufferBytes = 0;
+	clGetMemObjectInfo(mem_faces, CL_MEM_SIZE, sizeof(size_t), &bufferBytes, NULL);
+
+	if (bufferBytes == faceBytes){
+		CheckError(clEnqueueWriteBuffer(queue, mem_faces, CL_TRUE, 0, faceBytes, hostFaces.data(), 0, NULL, NULL));
+		CheckError(clEnqueueWriteBuffer(queue, mem_face_mats, CL_TRUE, 0, sizeof(int)*hostFaceMats.size(), hostFaceMats.data(), 0, NULL, NULL));
+		return;
+	}
+
+	clReleaseMemObject(mem_faces);
+	clReleaseMemObject(mem_face_mats);
+	mem_faces = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, faceBytes, hostFaces.data(), &error);
+	mem_face_mats = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(int)*hostFaceMats.size(), hostFaceMats.data(), &error);
+	CheckError(error);
+
+	clSetKernelArg(kernel, 3, sizeof (cl_mem), &mem_face_mats);
+}
+
+// Send the host structure to the device, a new topology also gets new
+// buffers and the faces in their new order. mem_bvh and mem_bvh_parents
+// hold kernel arguments 5 and 6, grid levels and cells when the grid is used.
+// False, with nothing sent, when the new buffers do not fit the device.
+static bool UploadHostAccelerator(bool topologyChanged) {
+	cl_int error = CL_SUCCESS;
+	DeviceArray nodes = accelerator->Nodes();
+
+	if (!topologyChanged){
+		CheckError(clEnqueueWriteBuffer(queue, mem_bvh, CL_TRUE, 0, nodes.size, nodes.data, 0, NULL, NULL));
+		return true;
+	}
+
+	if (UseWideNodes()){
+		printf("BVH%d: %d nodes, %.1f KB (binary %.1f KB)\n", BVH_WIDTH, (int)(nodes.size / sizeof(WideBVHNode)),
+			nodes.size / 1024.0, hostBVH.nodes.size() * sizeof(BVHNode) / 1024.0);
+	}
+
+	DeviceArray links = accelerator->Links();
+
+	// The previous faces and buffers stay in place when the new ones can not
+	// be made, checked before anything is sent so both still match
+	bool fits = FitsDevice(accelerator->Name(), nodes.size);
+	fits = FitsDevice("Links", links.size) && fits;
+	fits = FitsDevice("Faces", sizeof(int)*hostFaces.size()) && fits;
+	if (!fits) return false;
+
+	// At setup the caller makes the face buffers from the same faces
+	if (mem_faces != NULL) UploadHostFaces();
+
+	if (mem_bvh != NULL) clReleaseMemObject(mem_bvh);
+	if (mem_bvh_parents != NULL) clReleaseMemObject(mem_bvh_parents);
+	mem_bvh = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, nodes.size, (void*)nodes.data, &error);
+	mem_bvh_parents = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, links.size, (void*)links.data, &error);
+	CheckError(error);
+
+	clSetKernelArg(kernel, 5, sizeof (cl_mem), &mem_bvh);
+	clSetKernelArg(kernel, 6, sizeof (cl_mem), &mem_bvh_parents);
+
+	if (deviceRefit && !UseWideNodes() && !UseGrid()){
+		if (refitterCreated) ReleaseBVHRefitter(&refitter);
+		CheckError(CreateBVHRefitter(&refitter, context, program, (int)hostBVH.nodes.size()));
+		refitterCreated = true;
+	}
+	return true;
+}
+
+// Rebuild after the vertices moved. A rebuild the device can not take,
+// deeper than the traversal stack the program was built with or too large
+// to allocate, is dropped for the structure the device already holds.
+static bool RebuildHostAccelerator(const float *verts) {
+	// Collapsed nodes keep the layout the device holds, so the accelerator goes back too
+	Accelerator *previous = accelerator->Clone();
+	BVH previousBVH = hostBVH;
+	std::vector<int> previousFaces = hostFaces;
+	std::vector<int> previousFaceMats = hostFaceMats;
+	BuildHostAccelerator(verts);
+
+	bool kept = true;
+	int stackSize = TraversalStackSize((int)hostSrcFaceMats.size());
+	if (stackSize > traversalStackSize){
+		printf("%s: rebuild needs a %d entry traversal stack, the kernel has %d\n", accelerator->Name(),
+			stackSize, traversalStackSize);
+		kept = false;
+	}
+	kept = kept && UploadHostAccelerator(true);
+	if (kept){
+		delete previous;
+		return true;
+	}
+
+	printf("%s: rebuild dropped, keeping the one on the device\n", accelerator->Name());
+	delete accelerator;
+	accelerator = previous;
+	hostBVH = previousBVH;
+	hostFaces.swap(previousFaces);
+	hostFaceMats.swap(previousFaceMats);
+	if (!UseGrid()) builtSAHCost = BVHSAHCost(&hostBVH);
+	return false;
+}
+
+// New positions for every vertex. The BVH is refit and rebuilt once the
+// refits have grown its SAH cost past refitRebuildRatio, a grid is rebuilt.
+void UpdateVertices(const float *verts, int vertexCount) {
+	if (UseTLAS()){
+		printf("UpdateVertices: shared BLAS can not be refit, place objects with MoveObject\n");
+		return;
+	}
+
+	CheckError(clEnqueueWriteBuffer(queue, mem_verts, CL_TRUE, 0, sizeof(float)*vertexCount * 3, verts, 0, NULL, NULL));
+	ResetAccumulation();
+	multiSceneChanged = true;
+
+	if (UseGrid()){
+		RebuildHostAccelerator(verts);
+		UpdateTriangles();
+		return;
+	}
+
+	// Refits keep the face order, rebuilds below pack again
+	UpdateTriangles();
+	if (!useBVH) return;
+
+	auto refitStart = std::chrono::high_resolution_clock::now();
+	bool checkCost = true;
+
+	if (UseDeviceBuild() || (deviceRefit && !UseWideNodes())){
+		CheckError(RefitDeviceBVH(&refitter, queue, mem_verts, mem_faces, mem_bvh, mem_bvh_parents));
+
+		// The cost check reads the nodes back, so only every few refits
+		checkCost = ++refitsSinceCheck >= BVH_REFIT_CHECK_INTERVAL;
+		if (checkCost){
+			refitsSinceCheck = 0;
+			CheckError(clEnqueueReadBuffer(queue, mem_bvh, CL_TRUE, 0, sizeof(BVHNode)*hostBVH.nodes.size(), hostBVH.nodes.data(), 0, NULL, NULL));
+		}
+		else {
+			clFinish(queue);
+		}
+	}
+	else {
+		RefitBVH(&hostBVH, verts, hostFaces.data(), buildPool);
+		UploadHostAccelerator(false);
+	}
+
+	auto refitEnd = std::chrono::high_resolution_clock::now();
+	double refitMs = std::chrono::duration<double, std::milli>(refitEnd - refitStart).count();
+
+	if (!checkCost){
+		printf("BVH: refit in %.2f ms\n", refitMs);
+		return;
+	}
+
+	float cost = BVHSAHCost(&hostBVH);
+	float growth = builtSAHCost > 0 ? cost / builtSAHCost : 1.0f;
+	printf("BVH: refit in %.2f ms, SAH cost %.2f (%.2fx the build)\n", refitMs, cost, growth);
+
+	if (growth > refitRebuildRatio){
+		printf("BVH: SAH cost grew past %.2fx, rebuilding\n", refitRebuildRatio);
+		if (UseDeviceBuild()){
+			RebuildDeviceBVH();
+		}
+		else if (!RebuildHostAccelerator(verts)){
+			return;
+		}
+		UpdateTriangles();
+	}
+}
+
 int setupOpenCL(){
 
 	/* Initalize Platform IDs */
@@ -658,6 +1378,10 @@ int setupOpenCL(){
 		std::cout << "\t (" << (i + 1) << ") : " << GetDeviceName(deviceIds[i]) << std::endl;
 	}
 
+	deviceLimits = GetDeviceLimits(deviceIds[0]);
+	printf("Device memory: %.0f MB global, %.0f MB per buffer, %.0f KB constant\n", deviceLimits.globalMem / (1024.0 * 1024.0),
+		deviceLimits.maxAlloc / (1024.0 * 1024.0), deviceLimits.maxConstant / 1024.0);
+
 	// http://www.khronos.org/registry/cl/sdk/1.1/docs/man/xhtml/clCreateContext.html
 	const cl_context_properties contextProperties[] =
 	{
@@ -672,26 +1396,8 @@ int setupOpenCL(){
 
 	std::cout << "Context created" << std::endl;
 
-	// Create a program from source
-	program = CreateProgram(LoadKernel("kernels/image.cl"), context);
-
-	CheckError(clBuildProgram(program, deviceIdCount, deviceIds.data(),
-		"-D FILTER_SIZE=1", nullptr, nullptr));
-
-	std::cout << "Program created" << std::endl;
-
-	/* Send log to CMD window */
-	size_t log_size;
-	clGetProgramBuildInfo(program, deviceIds[0], CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
-	char *log = (char *)malloc(log_size);
-
-	clGetProgramBuildInfo(program, deviceIds[0], CL_PROGRAM_BUILD_LOG, log_size, log, NULL);
-	printf("%s\n", log);
-
-	/* Create the Kernel */
-	kernel = clCreateKernel(program, "Filter", &error);
-	CheckError(error);
-	std::cout << "Kernel Created" << std::endl;
+	// The accelerator picks the traversal the kernel is built with
+	accelerator = CreateAccelerator();
 
 	// Image info
 	std::cout << "Loading Image" << std::endl;
@@ -704,48 +1410,365 @@ int setupOpenCL(){
 	outputImage = clCreateImage2D(context, CL_MEM_WRITE_ONLY, &format, width, height, 0, pixels, &error);
 	CheckError(error);
 
-	/* PARSING OBJECTS BITCHES */
-	objLoader* loadedObject = parseObj();
+	// A warm start maps the cached arrays and skips parsing and building
+	auto loadStart = std::chrono::high_resolution_clock::now();
+	std::string cachePath = std::string(sceneFile) + ".bvh";
+	uint64_t cacheKey = 0;
+	BVHCache cache;
+	bool cached = false;
+	if (useBVHCache && useBVH && !UseTLAS() && !UseDeviceBuild() && !UseGrid()){
+		cacheKey = SceneCacheKey(sceneFile, BuildParams());
+		cached = OpenBVHCache(&cache, cachePath.c_str(), cacheKey);
+	}
+
+	objLoader* loadedObject = NULL;
+	int vertexCount, faceTotal, materialCount;
+	float* vertArray;
+	int* faceArray;
+	float* materials;
+	int* faceMats;
+
+	if (cached){
+		const SceneArrays &arrays = cache.arrays;
+		vertexCount = arrays.vertexCount;
+		faceTotal = arrays.faceCount;
+		materialCount = arrays.materialCount;
+		vertArray = (float*)arrays.verts;
+		faceArray = (int*)arrays.srcFaces;
+		materials = (float*)arrays.materials;
+		faceMats = (int*)arrays.srcFaceMats;
+
+		hostSrcFaces.assign(arrays.srcFaces, arrays.srcFaces + arrays.faceCount * 3);
+		hostSrcFaceMats.assign(arrays.srcFaceMats, arrays.srcFaceMats + arrays.faceCount);
+		hostBVH.nodes.assign(arrays.nodes, arrays.nodes + arrays.nodeCount);
+		hostBVH.triIndices.assign(arrays.triIndices, arrays.triIndices + arrays.refCount);
+		hostFaces.assign(arrays.faces, arrays.faces + arrays.refCount * 3);
+		hostFaceMats.assign(arrays.faceMats, arrays.faceMats + arrays.refCount);
+		builtSAHCost = BVHSAHCost(&hostBVH);
+	}
+	else {
+		/* PARSING OBJECTS BITCHES */
+		loadedObject = parseObj();
+		vertexCount = loadedObject->vertexCount;
+		faceTotal = loadedObject->faceCount;
+		materialCount = loadedObject->materialCount;
+
+		// export verts
+		vertArray = VertsToFloat3(loadedObject->vertexList, loadedObject->vertexCount);
+
+		// export faces
+		faceArray = FacesToVerts(loadedObject->faceList, loadedObject->faceCount);
+		materials = GetObjectMaterials(loadedObject, loadedObject->faceCount);
+		faceMats = FacesToMats(loadedObject, loadedObject->faceCount);
+	}
+
+	// Faces the kernel sees, repeated objects only appear once with a TLAS
+	int* leafFaces = faceArray;
+	int* leafMats = faceMats;
+	int leafFaceCount = faceTotal;
+
+	// Build the BVH and put faces in leaf order
+	buildPool = new TaskPool();
+	if (cached){
+		leafFaces = hostFaces.data();
+		leafMats = hostFaceMats.data();
+		leafFaceCount = (int)hostFaceMats.size();
+	}
+	else if (UseTLAS()){
+		int* faceObjects = FacesToObjects(loadedObject, faceTotal);
+
+		auto buildStart = std::chrono::high_resolution_clock::now();
+		BuildScene(&scene, vertArray, faceArray, faceMats, faceObjects, faceTotal, buildPool);
+		auto buildEnd = std::chrono::high_resolution_clock::now();
+
+		printf("TLAS: %d instances, %d faces stored (%d in file), built in %.2f ms\n", (int)scene.instances.size(),
+			(int)scene.faceMats.size(), faceTotal, std::chrono::duration<double, std::milli>(buildEnd - buildStart).count());
+
+		leafFaces = scene.faces.data();
+		leafMats = scene.faceMats.data();
+		leafFaceCount = (int)scene.faceMats.size();
+		free(faceObjects);
+	}
+	else if (!UseDeviceBuild()){
+		hostSrcFaces.assign(faceArray, faceArray + faceTotal * 3);
+		hostSrcFaceMats.assign(faceMats, faceMats + faceTotal);
+		BuildHostAccelerator(vertArray);
+
+		leafFaces = hostFaces.data();
+		leafMats = hostFaceMats.data();
+		leafFaceCount = (int)hostFaceMats.size();
+
+		if (useBVHCache && useBVH && !UseGrid()){
+			SceneArrays arrays;
+			arrays.verts = vertArray;
+			arrays.vertexCount = vertexCount;
+			arrays.srcFaces = hostSrcFaces.data();
+			arrays.srcFaceMats = hostSrcFaceMats.data();
+			arrays.faceCount = faceTotal;
+			arrays.materials = materials;
+			arrays.materialCount = materialCount;
+			arrays.nodes = hostBVH.nodes.data();
+			arrays.nodeCount = (int)hostBVH.nodes.size();
+			arrays.triIndices = hostBVH.triIndices.data();
+			arrays.faces = hostFaces.data();
+			arrays.faceMats = hostFaceMats.data();
+			arrays.refCount = (int)hostFaceMats.size();
+			WriteBVHCache(cachePath.c_str(), cacheKey, arrays);
+		}
+	}
+
+	auto loadEnd = std::chrono::high_resolution_clock::now();
+	printf("Scene: %s start, loaded in %.2f ms\n", cached ? "warm (BVH cache)" : "cold",
+		std::chrono::duration<double, std::milli>(loadEnd - loadStart).count());
+
+	// Build the kernel variant this scene needs, or reuse it if an earlier
+	// scene needed the same one
+	SceneFeatures features;
+	ComputeSceneFeatures(&features, leafMats, leafFaceCount, materials, materialCount);
+
+	std::string buildOptions = "-D FILTER_SIZE=1";
+	if (useBVH) buildOptions += accelerator->Defines();
+	if (UseTLAS()) buildOptions += " -D USE_TLAS";
+	if (useShadows) buildOptions += " -D USE_SHADOWS";
+	buildOptions += SceneDefines(features);
+
+	// Stacks hold the deepest walk of these trees, no entry is ever dropped
+	traversalStackSize = TraversalStackSize(faceTotal);
+	if (traversalStackSize > 0) buildOptions += " -D BVH_STACK_SIZE=" + std::to_string(traversalStackSize);
+
+	std::string kernelSource = LoadKernel("kernels/image.cl");
+	if (programVariants.context != context || programVariants.source != kernelSource){
+		ReleaseProgramVariants(&programVariants);
+		programVariants.context = context;
+		programVariants.source = kernelSource;
+	}
+	programVariants.useBinaries = useProgramCache;
+
+	auto compileStart = std::chrono::high_resolution_clock::now();
+	ProgramOrigin origin = PROGRAM_FROM_SOURCE;
+	CheckError(GetProgramVariant(&programVariants, deviceIdCount, deviceIds.data(), buildOptions, &program, &origin));
+	auto compileEnd = std::chrono::high_resolution_clock::now();
 
-	// export verts
-	float* vertArray = VertsToFloat3(loadedObject->vertexList, loadedObject->vertexCount);
+	const char *originNames[3] = { "reused", "warm (binary cache)", "cold (source build)" };
+	printf("Kernel variant: %s, %d in memory\n", buildOptions.c_str(), (int)programVariants.programs.size());
+	printf("Program: %s start, built in %.2f ms\n", originNames[origin],
+		std::chrono::duration<double, std::milli>(compileEnd - compileStart).count());
 
-	// export faces
-	int* faceArray = FacesToVerts(loadedObject->faceList, loadedObject->faceCount);
-	float* materials = GetObjectMaterials(loadedObject, loadedObject->faceCount);
-	int* faceMats = FacesToMats(loadedObject, loadedObject->faceCount);
+	std::cout << "Program created" << std::endl;
+
+	/* Send log to CMD window */
+	if (origin == PROGRAM_FROM_SOURCE){
+		size_t log_size;
+		clGetProgramBuildInfo(program, deviceIds[0], CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
+		char *log = (char *)malloc(log_size);
+
+		clGetProgramBuildInfo(program, deviceIds[0], CL_PROGRAM_BUILD_LOG, log_size, log, NULL);
+		printf("%s\n", log);
+		free(log);
+	}
+
+	/* Create the Kernel */
+	kernel = clCreateKernel(program, "Filter", &error);
+	CheckError(error);
+
+	// Traversal stack spills show up here
+	cl_ulong privateMem = 0;
+	clGetKernelWorkGroupInfo(kernel, deviceIds[0], CL_KERNEL_PRIVATE_MEM_SIZE, sizeof(cl_ulong), &privateMem, nullptr);
+	printf("Filter: %llu bytes private memory per work-item (%s traversal)\n", (unsigned long long)privateMem,
+		!useBVH ? "brute force" : (UseGrid() ? "grid" : (UseTLAS() ? "two-level stack" : (useStackless ? "stackless" : "stack"))));
+	std::cout << "Kernel Created" << std::endl;
 
 	//double* normals = getFaceNormals(vertArray, faceArray, loadedObject->faceCount, loadedObject->vertexCount);
 
+	// Geometry lives in __global memory, only the face count is __constant.
+	// Check it against the device before allocating anything.
+	int deviceFaceCount = UseDeviceBuild() ? faceTotal : leafFaceCount;
+	size_t vertBytes = sizeof(float)*vertexCount * 3;
+	size_t faceBytes = sizeof(int)*deviceFaceCount * 3;
+	size_t faceMatBytes = sizeof(int)*deviceFaceCount;
+	size_t materialBytes = sizeof(float)*materialCount * MATERIAL_FLOATS;
+	size_t triangleBytes = TRIANGLE_RECORD_SIZE*deviceFaceCount;
+	// Empty scenes still get one slot, like BuildBVHFromBoxes
+	int deviceFaceSlots = faceTotal > 0 ? faceTotal : 1;
+	int deviceNodeCount = faceTotal > 0 ? 2 * faceTotal - 1 : 1;
+	size_t nodeBytes = 0;
+	if (UseDeviceBuild()){
+		nodeBytes = (sizeof(BVHNode) + sizeof(int))*deviceNodeCount;
+	}
+	else if (UseTLAS()){
+		nodeBytes = sizeof(BVHNode)*(scene.blasNodes.size() + TLASNodeCapacity()) + sizeof(BVHInstance)*scene.tlasInstances.size();
+	}
+
+	bool fits = FitsDevice("Vertices", vertBytes);
+	fits = FitsDevice("Faces", faceBytes) && fits;
+	fits = FitsDevice("Face materials", faceMatBytes) && fits;
+	fits = FitsDevice("Materials", materialBytes) && fits;
+	fits = FitsDevice("Triangle records", triangleBytes) && fits;
+	if (UseDeviceBuild()) fits = FitsDevice("BVH nodes", sizeof(BVHNode)*deviceNodeCount) && fits;
+	if (UseTLAS()) fits = FitsDevice("BLAS nodes", sizeof(BVHNode)*scene.blasNodes.size()) && fits;
+
+	// Source faces are kept next to the leaf order ones for device builds
+	size_t sceneBytes = vertBytes + faceBytes + faceMatBytes + materialBytes + triangleBytes + nodeBytes;
+	if (UseDeviceBuild()) sceneBytes += faceBytes + faceMatBytes;
+	if (sceneBytes > deviceLimits.globalMem){
+		fprintf(stderr, "Scene needs %.1f MB, the device has %.1f MB\n", sceneBytes / (1024.0 * 1024.0), deviceLimits.globalMem / (1024.0 * 1024.0));
+		fits = false;
+	}
+	if (!fits) return 1;
+
 	// create buffers
-	cl_mem faceData = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(int)*loadedObject->faceCount * 3, faceArray, &error);
-	cl_mem vertData = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(float)*loadedObject->vertexCount * 3, vertArray, &error);
-	cl_mem faceCount = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(int), &loadedObject->faceCount, &error);
+	cl_mem vertData = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(float)*vertexCount * 3, vertArray, &error);
+	cl_mem faceCount = mem_face_count = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(int), &faceTotal, &error);
+	cl_mem materialData = mem_materials = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(float)*materialCount * MATERIAL_FLOATS, materials, &error);
+
+	cl_mem faceData, faceMatData, bvhData, bvhParentData;
+	if (UseDeviceBuild()){
+		// Filled in leaf order by the LBVH kernels
+		cl_mem_flags srcFlags = faceTotal > 0 ? CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR : CL_MEM_READ_ONLY;
+		mem_src_faces = clCreateBuffer(context, srcFlags, sizeof(int)*deviceFaceSlots * 3, faceTotal > 0 ? faceArray : NULL, &error);
+		mem_src_face_mats = clCreateBuffer(context, srcFlags, sizeof(int)*deviceFaceSlots, faceTotal > 0 ? faceMats : NULL, &error);
+		faceData = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(int)*deviceFaceSlots * 3, NULL, &error);
+		faceMatData = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(int)*deviceFaceSlots, NULL, &error);
+		bvhData = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(BVHNode)*deviceNodeCount, NULL, &error);
+		bvhParentData = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(int)*deviceNodeCount, NULL, &error);
+	}
+	else {
+		faceData = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(int)*leafFaceCount * 3, leafFaces, &error);
+		faceMatData = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(int)*leafFaceCount, leafMats, &error);
+		if (UseTLAS()){
+			// TLAS nodes and instances are rewritten in place by MoveObject,
+			// the node buffer has room for any TLAS over the same instances
+			std::vector<BVHNode> tlasNodes(scene.tlas.nodes);
+			tlasNodes.resize(TLASNodeCapacity());
+			bvhData = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(BVHNode)*scene.blasNodes.size(), scene.blasNodes.data(), &error);
+			mem_tlas = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(BVHNode)*tlasNodes.size(), tlasNodes.data(), &error);
+			mem_instances = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(BVHInstance)*scene.tlasInstances.size(), scene.tlasInstances.data(), &error);
+			bvhParentData = NULL;
+		}
+		else {
+			if (!UploadHostAccelerator(true)) return 1;
+			bvhData = mem_bvh;
+			bvhParentData = mem_bvh_parents;
+		}
+	}
+	CheckError(error);
 
-	cl_mem materialData = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(float)*loadedObject->materialCount * 3, materials, &error);
-	cl_mem faceMatData = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(int)*loadedObject->faceCount, faceMats, &error);
+	mem_verts = vertData;
+	mem_faces = faceData;
+	mem_face_mats = faceMatData;
+	mem_bvh = bvhData;
+	mem_bvh_parents = bvhParentData;
 
-	// Setup the kernel arguments
+	// Setup the kernel arguments, the triangle records (1) follow once
+	// the queue exists
 	clSetKernelArg(kernel, 0, sizeof (cl_mem), &outputImage);
-	clSetKernelArg(kernel, 1, sizeof (cl_mem), &vertData);
-	clSetKernelArg(kernel, 2, sizeof (cl_mem), &faceData);
-	clSetKernelArg(kernel, 3, sizeof (cl_mem), &faceCount);
+	clSetKernelArg(kernel, 2, sizeof (cl_mem), &faceCount);
 
-	clSetKernelArg(kernel, 4, sizeof (cl_mem), &faceMatData);
-	clSetKernelArg(kernel, 5, sizeof (cl_mem), &materialData);
+	clSetKernelArg(kernel, 3, sizeof (cl_mem), &faceMatData);
+	clSetKernelArg(kernel, 4, sizeof (cl_mem), &materialData);
+	clSetKernelArg(kernel, 5, sizeof (cl_mem), &bvhData);
+	clSetKernelArg(kernel, 6, sizeof (cl_mem), &bvhParentData);
+	clSetKernelArg(kernel, 7, sizeof (cl_mem), &mem_tlas);
+	clSetKernelArg(kernel, 8, sizeof (cl_mem), &mem_instances);
 
 	//DrawImage();
 
-	// Free MALLOC when finished
-	free(vertArray);
-	free(faceArray);
+	// Free MALLOC when finished, cached arrays live in the mapping
+	if (cached){
+		CloseBVHCache(&cache);
+	}
+	else {
+		free(vertArray);
+		free(faceArray);
+	}
 
 	std::cout << "Arguments Passed to Kernel" << std::endl;
 
 	// Start the Queue
-	queue = clCreateCommandQueue(context, deviceIds[0], 0, &error);
+	// Tiles and the render loop are timed with event profiling
+	queue = clCreateCommandQueue(context, deviceIds[0], (useTiles || asyncLoop) ? CL_QUEUE_PROFILING_ENABLE : 0, &error);
 	CheckError(error);
 
+	if (UseDeviceBuild()){
+		CheckError(CreateLBVHBuilder(&lbvhBuilder, context, program, deviceIds[0], faceTotal));
+		RebuildDeviceBVH();
+
+		CheckError(CreateBVHRefitter(&refitter, context, program, faceTotal > 0 ? 2 * faceTotal - 1 : 0));
+		refitterCreated = true;
+	}
+
+	CheckError(CreateTriangleRecords(&triangleRecords, program));
+	UpdateTriangles();
+	AllocateAccumulation();
+	if (asyncLoop) CheckError(CreateRenderLoop(&renderLoop, context, deviceIds[0], width, height));
+	if (multiDevice){
+		CheckError(CreateMultiDevice(&multi, deviceIds[0], context, queue, kernel, CurrentScene(), CurrentFrame(), kernelSource,
+			buildOptions, width, height));
+	}
+
+	// Filter's launch shape, tuned now or saved by an earlier run on this device
+	std::string deviceName = GetDeviceName(deviceIds[0]).c_str();
+	uint64_t filterKey = KernelKey(kernelSource, buildOptions, "Filter");
+	if (tuneWorkGroups){
+		std::vector<LaunchShape> candidates;
+		CandidateLocalSizes(kernel, deviceIds[0], &candidates);
+
+		// The configured tile size first, it is timed with every local size
+		std::vector<int> tileSizes;
+		if (useTiles){
+			const int edges[4] = { 32, 64, 128, 256 };
+			tileSizes.push_back(tileSize);
+			for (int i = 0; i < 4; i++){
+				if (edges[i] != tileSize) tileSizes.push_back(edges[i]);
+			}
+		}
+
+		const size_t frameSize[2] = { (size_t)width, (size_t)height };
+		double bestMs = 0;
+		CheckError(TuneLaunchShape(queue, candidates, tileSizes,
+			[&frameSize](const LaunchShape &shape){ return EnqueueFilter(frameSize, shape, NULL); }, &launchShape, &bestMs));
+		printf("Autotune: best local %dx%d (0 = driver), tile %d, %.3f ms per frame\n", (int)launchShape.local[0],
+			(int)launchShape.local[1], launchShape.tileSize, bestMs);
+
+		SaveLaunchShape(TUNE_FILE, deviceName, filterKey, launchShape, bestMs);
+		ResetAccumulation();
+	}
+	else if (LoadLaunchShape(TUNE_FILE, deviceName, filterKey, &launchShape)){
+		printf("Autotune: local %dx%d (0 = driver), tile %d from %s\n", (int)launchShape.local[0], (int)launchShape.local[1],
+			launchShape.tileSize, TUNE_FILE);
+	}
+
+	if (usePersistentThreads){
+		persistentKernel = clCreateKernel(program, "FilterPersistent", &error);
+		CheckError(error);
+		mem_pixel_counter = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int), NULL, &error);
+		CheckError(error);
+		PersistentLaunchSize(persistentKernel, deviceIds[0], &persistentGlobal, &persistentLocal);
+	}
+
+	if (useWavefront){
+		CheckError(CreateWavefrontPipeline(&wavefront, context, program, deviceIds[0], width, height));
+
+		if (usePersistentThreads){
+			double regularMs = 0, persistentMs = 0;
+			CheckError(TimeShadowRays(&wavefront, queue, CurrentScene(), CurrentFrame(), 8, &regularMs, &persistentMs));
+			printf("Persistent threads: shadow rays %.3f ms -> %.3f ms (%.2fx), %d work-items\n", regularMs, persistentMs,
+				persistentMs > 0 ? regularMs / persistentMs : 0.0, (int)wavefront.persistentGlobal);
+		}
+
+		if (sortRays){
+			double unsortedRate = 0, sortedRate = 0;
+			CheckError(TimeRaySorting(&wavefront, queue, CurrentScene(), CurrentFrame(), 8, &unsortedRate, &sortedRate));
+			printf("Ray sorting: shadow rays %.2f Mrays/s unsorted, %.2f Mrays/s sorted (sort included)\n",
+				unsortedRate * 1e-6, sortedRate * 1e-6);
+		}
+
+		// The timings above rendered extra samples
+		if (usePersistentThreads || sortRays) ResetAccumulation();
+	}
+
+	ReportAccelerator(faceTotal);
+
 	return 0;
 }
 
@@ -755,7 +1778,7 @@ int main ()
 	std::cout << "Starting OpenCL" << std::endl;
 	
 	// INIT Opencl
-	setupOpenCL();
+	if (setupOpenCL() != 0) return 1;
 	AllocateLocalImageMem(); //allocate pixel array
 
 	// Windowing system
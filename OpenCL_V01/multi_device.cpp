@@ -0,0 +1,379 @@
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <thread>
+#include "multi_device.h"
+
+// Filter arguments 1-8 in order
+static void SceneArray(const SceneBuffers &scene, cl_mem *buffers){
+	buffers[0] = scene.triangles;
+	buffers[1] = scene.faceCount;
+	buffers[2] = scene.faceMats;
+	buffers[3] = scene.materials;
+	buffers[4] = scene.nodes;
+	buffers[5] = scene.links;
+	buffers[6] = scene.tlasNodes;
+	buffers[7] = scene.instances;
+}
+
+static std::string DeviceName(cl_device_id device){
+	size_t size = 0;
+	clGetDeviceInfo(device, CL_DEVICE_NAME, 0, NULL, &size);
+	std::vector<char> name(size + 1, 0);
+	clGetDeviceInfo(device, CL_DEVICE_NAME, size, name.data(), NULL);
+	return std::string(name.data());
+}
+
+static void ReleaseWorker(DeviceWorker *worker){
+	if (!worker->owned) return;
+
+	for (int i = 0; i < SCENE_BUFFER_COUNT; i++){
+		if (worker->scene[i] != NULL) clReleaseMemObject(worker->scene[i]);
+	}
+	if (worker->image != NULL) clReleaseMemObject(worker->image);
+	if (worker->accum != NULL) clReleaseMemObject(worker->accum);
+	if (worker->sampleCounts != NULL) clReleaseMemObject(worker->sampleCounts);
+	if (worker->kernel != NULL) clReleaseKernel(worker->kernel);
+	if (worker->program != NULL) clReleaseProgram(worker->program);
+	if (worker->queue != NULL) clReleaseCommandQueue(worker->queue);
+	if (worker->context != NULL) clReleaseContext(worker->context);
+}
+
+static cl_int ClearAccumulation(DeviceWorker *worker, int pixelCount){
+	const cl_float4 zeroColor = { { 0.0f, 0.0f, 0.0f, 0.0f } };
+	const cl_int zeroCount = 0;
+	cl_int error = clEnqueueFillBuffer(worker->queue, worker->accum, &zeroColor, sizeof(zeroColor), 0, sizeof(cl_float4) * pixelCount, 0, NULL, NULL);
+	if (error == CL_SUCCESS) error = clEnqueueFillBuffer(worker->queue, worker->sampleCounts, &zeroCount, sizeof(zeroCount), 0, sizeof(cl_int) * pixelCount, 0, NULL, NULL);
+	return error;
+}
+
+// Host copy of the primary's scene, what every other device is sent
+static cl_int ReadScene(const DeviceWorker &primary, std::vector<std::vector<char> > *copies){
+	cl_int error = CL_SUCCESS;
+	copies->assign(SCENE_BUFFER_COUNT, std::vector<char>());
+	for (int i = 0; i < SCENE_BUFFER_COUNT && error == CL_SUCCESS; i++){
+		if (primary.scene[i] == NULL) continue;
+
+		size_t size = 0;
+		clGetMemObjectInfo(primary.scene[i], CL_MEM_SIZE, sizeof(size_t), &size, NULL);
+		(*copies)[i].resize(size);
+		error = clEnqueueReadBuffer(primary.queue, primary.scene[i], CL_TRUE, 0, size, (*copies)[i].data(), 0, NULL, NULL);
+	}
+	return error;
+}
+
+// Scene buffers of worker from copies, written in place while the size
+// holds and made again when it changed, then set as arguments 1-8
+static cl_int UploadScene(DeviceWorker *worker, const std::vector<std::vector<char> > &copies){
+	cl_int error = CL_SUCCESS;
+	for (int i = 0; i < SCENE_BUFFER_COUNT && error == CL_SUCCESS; i++){
+		size_t size = 0;
+		if (worker->scene[i] != NULL) clGetMemObjectInfo(worker->scene[i], CL_MEM_SIZE, sizeof(size_t), &size, NULL);
+
+		if (worker->scene[i] != NULL && size == copies[i].size()){
+			error = clEnqueueWriteBuffer(worker->queue, worker->scene[i], CL_TRUE, 0, size, copies[i].data(), 0, NULL, NULL);
+			continue;
+		}
+
+		// Unused arguments (links, TLAS) stay NULL as on the primary
+		if (worker->scene[i] != NULL) clReleaseMemObject(worker->scene[i]);
+		worker->scene[i] = NULL;
+		if (copies[i].empty()) continue;
+		worker->scene[i] = clCreateBuffer(worker->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, copies[i].size(), (void*)copies[i].data(), &error);
+	}
+	if (error != CL_SUCCESS) return error;
+
+	for (int i = 0; i < SCENE_BUFFER_COUNT; i++){
+		clSetKernelArg(worker->kernel, 1 + i, sizeof(cl_mem), &worker->scene[i]);
+	}
+	return CL_SUCCESS;
+}
+
+// Context, program and scene copy of a device other than the primary
+static cl_int CreateWorker(DeviceWorker *worker, cl_platform_id platform, cl_device_id device, const std::vector<std::vector<char> > &scene,
+	const std::string &source, const std::string &options, int width, int height){
+	cl_int error = CL_SUCCESS;
+	size_t pixelCount = (size_t)width * height;
+
+	worker->device = device;
+	worker->name = DeviceName(device);
+	worker->owned = true;
+
+	// Images hold the frame, the scene and the frame buffers have to fit
+	cl_bool images = CL_FALSE;
+	cl_ulong globalMem = 0, maxAlloc = 0;
+	clGetDeviceInfo(device, CL_DEVICE_IMAGE_SUPPORT, sizeof(cl_bool), &images, NULL);
+	clGetDeviceInfo(device, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(cl_ulong), &globalMem, NULL);
+	clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &maxAlloc, NULL);
+	if (!images){
+		printf("Multi-device: %s has no image support\n", worker->name.c_str());
+		return CL_INVALID_DEVICE;
+	}
+
+	size_t totalBytes = (sizeof(cl_float4) + sizeof(cl_int) + 4) * pixelCount;
+	for (int i = 0; i < SCENE_BUFFER_COUNT; i++){
+		if (scene[i].size() > maxAlloc){
+			printf("Multi-device: %s can not hold a %.1f MB scene buffer\n", worker->name.c_str(), scene[i].size() / (1024.0 * 1024.0));
+			return CL_MEM_OBJECT_ALLOCATION_FAILURE;
+		}
+		totalBytes += scene[i].size();
+	}
+	if (totalBytes > globalMem || sizeof(cl_float4) * pixelCount > maxAlloc){
+		printf("Multi-device: %s can not hold the %.1f MB scene and frame\n", worker->name.c_str(), totalBytes / (1024.0 * 1024.0));
+		return CL_MEM_OBJECT_ALLOCATION_FAILURE;
+	}
+
+	const cl_context_properties properties[] = { CL_CONTEXT_PLATFORM, reinterpret_cast<cl_context_properties>(platform), 0, 0 };
+	worker->context = clCreateContext(properties, 1, &device, NULL, NULL, &error);
+	if (error != CL_SUCCESS) return error;
+	worker->queue = clCreateCommandQueue(worker->context, device, 0, &error);
+	if (error != CL_SUCCESS) return error;
+
+	size_t length = source.size();
+	const char *text = source.data();
+	worker->program = clCreateProgramWithSource(worker->context, 1, &text, &length, &error);
+	if (error != CL_SUCCESS) return error;
+	error = clBuildProgram(worker->program, 1, &device, options.c_str(), NULL, NULL);
+	if (error != CL_SUCCESS){
+		printf("Multi-device: %s failed to build the kernel\n", worker->name.c_str());
+		return error;
+	}
+	worker->kernel = clCreateKernel(worker->program, "Filter", &error);
+	if (error != CL_SUCCESS) return error;
+
+	error = UploadScene(worker, scene);
+	if (error != CL_SUCCESS) return error;
+
+	const cl_image_format format = { CL_RGBA, CL_UNORM_INT8 };
+	worker->image = clCreateImage2D(worker->context, CL_MEM_WRITE_ONLY, &format, width, height, 0, NULL, &error);
+	if (error != CL_SUCCESS) return error;
+	worker->accum = clCreateBuffer(worker->context, CL_MEM_READ_WRITE, sizeof(cl_float4) * pixelCount, NULL, &error);
+	if (error != CL_SUCCESS) return error;
+	worker->sampleCounts = clCreateBuffer(worker->context, CL_MEM_READ_WRITE, sizeof(cl_int) * pixelCount, NULL, &error);
+	if (error != CL_SUCCESS) return error;
+
+	clSetKernelArg(worker->kernel, 0, sizeof(cl_mem), &worker->image);
+	clSetKernelArg(worker->kernel, 9, sizeof(cl_mem), &worker->accum);
+	clSetKernelArg(worker->kernel, 10, sizeof(cl_mem), &worker->sampleCounts);
+
+	return ClearAccumulation(worker, (int)pixelCount);
+}
+
+cl_int CreateMultiDevice(MultiDevice *multi, cl_device_id primary, cl_context context, cl_command_queue queue, cl_kernel kernel,
+	const SceneBuffers &scene, const FrameBuffers &frame, const std::string &source, const std::string &options, int width, int height){
+	cl_int error = CL_SUCCESS;
+	multi->width = width;
+	multi->height = height;
+	multi->workers.clear();
+	multi->split.clear();
+
+	DeviceWorker first;
+	first.device = primary;
+	first.name = DeviceName(primary);
+	first.context = context;
+	first.queue = queue;
+	first.program = NULL;
+	first.kernel = kernel;
+	first.owned = false;
+	SceneArray(scene, first.scene);
+	first.image = frame.image;
+	first.accum = frame.accum;
+	first.sampleCounts = frame.sampleCounts;
+	first.busyMs = 0;
+	multi->workers.push_back(first);
+
+	std::vector<std::vector<char> > copies;
+	error = ReadScene(first, &copies);
+	if (error != CL_SUCCESS) return error;
+
+	cl_uint platformCount = 0;
+	clGetPlatformIDs(0, NULL, &platformCount);
+	std::vector<cl_platform_id> platforms(platformCount);
+	clGetPlatformIDs(platformCount, platforms.data(), NULL);
+
+	for (cl_uint p = 0; p < platformCount; p++){
+		cl_uint deviceCount = 0;
+		if (clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, 0, NULL, &deviceCount) != CL_SUCCESS) continue;
+		std::vector<cl_device_id> devices(deviceCount);
+		clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, deviceCount, devices.data(), NULL);
+
+		for (cl_uint d = 0; d < deviceCount; d++){
+			if (devices[d] == primary) continue;
+
+			DeviceWorker worker;
+			worker.context = NULL;
+			worker.queue = NULL;
+			worker.program = NULL;
+			worker.kernel = NULL;
+			for (int i = 0; i < SCENE_BUFFER_COUNT; i++) worker.scene[i] = NULL;
+			worker.image = worker.accum = worker.sampleCounts = NULL;
+			worker.busyMs = 0;
+
+			if (CreateWorker(&worker, platforms[p], devices[d], copies, source, options, width, height) == CL_SUCCESS){
+				multi->workers.push_back(worker);
+			}
+			else {
+				printf("Multi-device: skipping %s\n", worker.name.c_str());
+				ReleaseWorker(&worker);
+			}
+		}
+	}
+
+	printf("Multi-device: %d device(s)\n", (int)multi->workers.size());
+	for (size_t i = 0; i < multi->workers.size(); i++){
+		printf("\t (%d) : %s\n", (int)i + 1, multi->workers[i].name.c_str());
+	}
+	return CL_SUCCESS;
+}
+
+void ReleaseMultiDevice(MultiDevice *multi){
+	for (size_t i = 0; i < multi->workers.size(); i++){
+		ReleaseWorker(&multi->workers[i]);
+	}
+	multi->workers.clear();
+}
+
+cl_int SyncMultiDeviceScene(MultiDevice *multi, const SceneBuffers &scene){
+	if (multi->workers.empty()) return CL_SUCCESS;
+
+	// The primary's buffers may have been made again, e.g. after a rebuild
+	DeviceWorker &primary = multi->workers[0];
+	SceneArray(scene, primary.scene);
+
+	std::vector<std::vector<char> > copies;
+	cl_int error = ReadScene(primary, &copies);
+	if (error != CL_SUCCESS) return error;
+
+	// A device that can not take the new scene stops rendering, it would tear the frame
+	for (size_t i = 1; i < multi->workers.size();){
+		DeviceWorker &worker = multi->workers[i];
+		error = UploadScene(&worker, copies);
+		if (error == CL_SUCCESS) error = ClearAccumulation(&worker, multi->width * multi->height);
+		if (error == CL_SUCCESS){
+			i++;
+			continue;
+		}
+
+		printf("Multi-device: %s could not take the new scene, dropping it\n", worker.name.c_str());
+		ReleaseWorker(&worker);
+		multi->workers.erase(multi->workers.begin() + i);
+		multi->split.clear();
+	}
+	return CL_SUCCESS;
+}
+
+void ResetMultiDevice(MultiDevice *multi){
+	for (size_t i = 0; i < multi->workers.size(); i++){
+		if (multi->workers[i].owned) ClearAccumulation(&multi->workers[i], multi->width * multi->height);
+	}
+}
+
+// Take tiles from next until none are left, or render the worker's own
+// tiles when fixed, keeping MULTI_DEVICE_IN_FLIGHT queued so the rest stay
+// free for the other devices
+static void RunWorker(DeviceWorker *worker, const std::vector<Tile> *tiles, std::atomic<int> *next, bool fixed, int *error){
+	std::deque<cl_event> inFlight;
+	int count = fixed ? (int)worker->tiles.size() : (int)tiles->size();
+	if (!fixed) worker->tiles.clear();
+
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int taken = 0; *error == CL_SUCCESS; taken++){
+		if (inFlight.size() >= MULTI_DEVICE_IN_FLIGHT){
+			clWaitForEvents(1, &inFlight.front());
+			clReleaseEvent(inFlight.front());
+			inFlight.pop_front();
+		}
+
+		if (fixed && taken >= count) break;
+		int index = fixed ? worker->tiles[taken] : next->fetch_add(1);
+		if (index >= (int)tiles->size()) break;
+
+		const Tile &tile = (*tiles)[index];
+		size_t offset[2] = { (size_t)tile.x, (size_t)tile.y };
+		size_t global[2] = { (size_t)tile.width, (size_t)tile.height };
+		cl_event event = NULL;
+		cl_int result = clEnqueueNDRangeKernel(worker->queue, worker->kernel, 2, offset, global, NULL, 0, NULL, &event);
+		if (result != CL_SUCCESS){
+			*error = result;
+			break;
+		}
+		clFlush(worker->queue);
+
+		inFlight.push_back(event);
+		if (!fixed) worker->tiles.push_back(index);
+	}
+
+	clFinish(worker->queue);
+	for (size_t i = 0; i < inFlight.size(); i++){
+		clReleaseEvent(inFlight[i]);
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+	worker->busyMs = std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+static bool SameTiles(const std::vector<Tile> &a, const std::vector<Tile> &b){
+	if (a.size() != b.size()) return false;
+	for (size_t i = 0; i < a.size(); i++){
+		if (a[i].x != b[i].x || a[i].y != b[i].y || a[i].width != b[i].width || a[i].height != b[i].height) return false;
+	}
+	return true;
+}
+
+cl_int RenderMultiDevice(MultiDevice *multi, const std::vector<Tile> &tiles, unsigned char *frame){
+	// A pixel moving to another device would average a different set of
+	// samples, so tiles only move together with a cleared sum
+	bool fixed = !multi->split.empty() && SameTiles(multi->split, tiles);
+	if (!fixed){
+		for (size_t i = 0; i < multi->workers.size(); i++){
+			cl_int error = ClearAccumulation(&multi->workers[i], multi->width * multi->height);
+			if (error != CL_SUCCESS) return error;
+		}
+	}
+
+	std::atomic<int> next(0);
+	std::vector<int> errors(multi->workers.size(), CL_SUCCESS);
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < multi->workers.size(); i++){
+		threads.push_back(std::thread(RunWorker, &multi->workers[i], &tiles, &next, fixed, &errors[i]));
+	}
+	for (size_t i = 0; i < threads.size(); i++){
+		threads[i].join();
+	}
+
+	for (size_t i = 0; i < errors.size(); i++){
+		if (errors[i] != CL_SUCCESS){
+			printf("Multi-device: %s failed to render\n", multi->workers[i].name.c_str());
+			multi->split.clear();
+			return errors[i];
+		}
+	}
+	multi->split = tiles;
+
+	// Every device's tiles land in place, the row pitch spans the whole frame
+	cl_int error = CL_SUCCESS;
+	size_t rowPitch = (size_t)multi->width * 4;
+	for (size_t i = 0; i < multi->workers.size(); i++){
+		DeviceWorker &worker = multi->workers[i];
+		for (size_t t = 0; t < worker.tiles.size(); t++){
+			const Tile &tile = tiles[worker.tiles[t]];
+			size_t origin[3] = { (size_t)tile.x, (size_t)tile.y, 0 };
+			size_t region[3] = { (size_t)tile.width, (size_t)tile.height, 1 };
+			if (error == CL_SUCCESS) error = clEnqueueReadImage(worker.queue, worker.image, CL_FALSE, origin, region, rowPitch, 0,
+				frame + (size_t)tile.y * rowPitch + (size_t)tile.x * 4, 0, NULL, NULL);
+		}
+	}
+	for (size_t i = 0; i < multi->workers.size(); i++){
+		clFinish(multi->workers[i].queue);
+	}
+	return error;
+}
+
+void PrintMultiDeviceStats(const MultiDevice &multi, int tileCount){
+	for (size_t i = 0; i < multi.workers.size(); i++){
+		const DeviceWorker &worker = multi.workers[i];
+		int taken = (int)worker.tiles.size();
+		printf("Multi-device: %s took %d of %d tiles (%.0f%%) in %.2f ms\n", worker.name.c_str(), taken, tileCount,
+			tileCount > 0 ? 100.0 * taken / tileCount : 0.0, worker.busyMs);
+	}
+}
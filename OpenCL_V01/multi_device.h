@@ -0,0 +1,71 @@
+#ifndef MULTI_DEVICE_H
+#define MULTI_DEVICE_H
+
+#ifdef __APPLE__
+#include "OpenCL/opencl.h"
+#else
+#include "CL/cl.h"
+#endif
+#include <string>
+#include <vector>
+#include "tiles.h"
+#include "wavefront.h"
+
+#define MULTI_DEVICE_IN_FLIGHT 2 // tiles a device holds, one runs while the next is queued
+#define SCENE_BUFFER_COUNT 8 // Filter arguments 1-8
+
+// One device rendering Filter tiles. The first worker is the device the
+// rest of the renderer uses; every other device gets its own context
+// (contexts can not span platforms), program, queue and copy of the scene.
+struct DeviceWorker
+{
+	cl_device_id device;
+	std::string name;
+	cl_context context;
+	cl_command_queue queue;
+	cl_program program;
+	cl_kernel kernel;
+	bool owned; // false for the primary, whose objects belong to the renderer
+
+	cl_mem scene[SCENE_BUFFER_COUNT];
+	cl_mem image;
+	cl_mem accum;
+	cl_mem sampleCounts;
+
+	std::vector<int> tiles; // indices of the tiles it renders, the same every frame once split
+	double busyMs; // host time from its first tile to its last, last frame
+};
+
+struct MultiDevice
+{
+	std::vector<DeviceWorker> workers;
+	int width;
+	int height;
+	std::vector<Tile> split; // tiles the workers' sets index, empty until the first frame
+};
+
+// Every device on every platform next to primary, whose frame buffers and
+// scene are copied to the others. Devices that can not build the program
+// or hold the scene are skipped.
+cl_int CreateMultiDevice(MultiDevice *multi, cl_device_id primary, cl_context context, cl_command_queue queue, cl_kernel kernel,
+	const SceneBuffers &scene, const FrameBuffers &frame, const std::string &source, const std::string &options, int width, int height);
+void ReleaseMultiDevice(MultiDevice *multi);
+
+// Send the primary's scene (Filter arguments 1-8, as now bound there) to
+// every other device and clear their sums, after any scene update.
+// Devices that can no longer hold it are dropped.
+cl_int SyncMultiDeviceScene(MultiDevice *multi, const SceneBuffers &scene);
+
+// Clear the running sums of the devices other than the primary
+void ResetMultiDevice(MultiDevice *multi);
+
+// Render tiles with every device and merge them into frame (RGBA8,
+// width * height). On the first frame, or when tiles or the devices
+// change, each device takes the next tile from a shared counter once it
+// is done with its last, and every sum is cleared. Later frames give each
+// device the same tiles again, so a pixel's samples all add up on one device.
+cl_int RenderMultiDevice(MultiDevice *multi, const std::vector<Tile> &tiles, unsigned char *frame);
+
+void PrintMultiDeviceStats(const MultiDevice &multi, int tileCount);
+
+#endif
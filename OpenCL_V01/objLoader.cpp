@@ -21,6 +21,7 @@ int objLoader::load(char *filename)
 		this->lightQuadCount = data.light_quad_count;
 
 		this->materialCount = data.material_count;
+		this->objectCount = data.object_count;
 
 		this->vertexList = data.vertex_list;
 		this->normalList = data.vertex_normal_list;
@@ -35,6 +36,7 @@ int objLoader::load(char *filename)
 		this->lightQuadList = data.light_quad_list;
 
 		this->materialList = data.material_list;
+		this->objectList = data.object_list;
 
 		this->camera = data.camera;
 	}
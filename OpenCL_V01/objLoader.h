@@ -27,6 +27,7 @@ public:
 	obj_light_disc **lightDiscList;
 	
 	obj_material **materialList;
+	obj_object **objectList;
 	
 	int vertexCount;
 	int normalCount;
@@ -41,6 +42,7 @@ public:
 	int lightDiscCount;
 
 	int materialCount;
+	int objectCount;
 
 	obj_camera *camera;
 private:
@@ -289,10 +289,33 @@ int obj_parse_mtl_file(char *filename, list *material_list)
 
 }
 
+// Faces after an 'o' or 'g' statement belong to that object, repeated names reuse it
+int obj_parse_object(obj_growable_scene_data *scene)
+{
+	char *name = strtok(NULL, WHITESPACE);
+	if(name == NULL)
+		name = (char*)"default";
+
+	// list_find only compares prefixes, object names must match exactly
+	for(int i=0; i<scene->object_list.item_count; i++)
+	{
+		if(strequal(scene->object_list.names[i], name))
+			return i;
+	}
+
+	obj_object *obj = (obj_object*)malloc(sizeof(obj_object));
+	strncpy(obj->name, name, OBJECT_NAME_SIZE);
+	obj->name[OBJECT_NAME_SIZE - 1] = '\0';
+	list_add_item(&scene->object_list, obj, obj->name);
+
+	return scene->object_list.item_count - 1;
+}
+
 int obj_parse_obj_file(obj_growable_scene_data *growable_data, char *filename)
 {
 	FILE* obj_file_stream;
 	int current_material = -1; 
+	int current_object = -1;
 	char *current_token = NULL;
 	char current_line[OBJ_LINE_SIZE];
 	int line_number = 0;
@@ -346,6 +369,7 @@ int obj_parse_obj_file(obj_growable_scene_data *growable_data, char *filename)
 		{
 			obj_face *face = obj_parse_face(growable_data);
 			face->material_index = current_material;
+			face->object_index = current_object;
 			list_add_item(&growable_data->face_list, face, NULL);
 		}
 		
@@ -408,11 +432,15 @@ int obj_parse_obj_file(obj_growable_scene_data *growable_data, char *filename)
 		}
 		
 		else if( strequal(current_token, "o") ) //object name
-		{ }
+		{
+			current_object = obj_parse_object(growable_data);
+		}
 		else if( strequal(current_token, "s") ) //smoothing
 		{ }
 		else if( strequal(current_token, "g") ) // group
-		{ }		
+		{
+			current_object = obj_parse_object(growable_data);
+		}
 
 		else
 		{
@@ -442,6 +470,7 @@ void obj_init_temp_storage(obj_growable_scene_data *growable_data)
 	list_make(&growable_data->light_disc_list, 10, 1);
 	
 	list_make(&growable_data->material_list, 10, 1);	
+	list_make(&growable_data->object_list, 10, 1);
 	
 	growable_data->camera = NULL;
 }
@@ -461,6 +490,7 @@ void obj_free_temp_storage(obj_growable_scene_data *growable_data)
 	obj_free_half_list(&growable_data->light_disc_list);
 	
 	obj_free_half_list(&growable_data->material_list);
+	obj_free_half_list(&growable_data->object_list);
 }
 
 void delete_obj_data(obj_scene_data *data_out)
@@ -501,6 +531,10 @@ void delete_obj_data(obj_scene_data *data_out)
 		free(data_out->material_list[i]);
 	free(data_out->material_list);
 
+	for(i=0; i<data_out->object_count; i++)
+		free(data_out->object_list[i]);
+	free(data_out->object_list);
+
 	free(data_out->camera);
 }
 
@@ -519,6 +553,7 @@ void obj_copy_to_out_storage(obj_scene_data *data_out, obj_growable_scene_data *
 	data_out->light_quad_count = growable_data->light_quad_list.item_count;
 
 	data_out->material_count = growable_data->material_list.item_count;
+	data_out->object_count = growable_data->object_list.item_count;
 	
 	data_out->vertex_list = (obj_vector**)growable_data->vertex_list.items;
 	data_out->vertex_normal_list = (obj_vector**)growable_data->vertex_normal_list.items;
@@ -533,6 +568,7 @@ void obj_copy_to_out_storage(obj_scene_data *data_out, obj_growable_scene_data *
 	data_out->light_quad_list = (obj_light_quad**)growable_data->light_quad_list.items;
 	
 	data_out->material_list = (obj_material**)growable_data->material_list.items;
+	data_out->object_list = (obj_object**)growable_data->object_list.items;
 	
 	data_out->camera = growable_data->camera;
 }
@@ -5,6 +5,7 @@
 
 #define OBJ_FILENAME_LENGTH 500
 #define MATERIAL_NAME_SIZE 255
+#define OBJECT_NAME_SIZE 255
 #define OBJ_LINE_SIZE 500
 #define MAX_VERTEX_COUNT 4 //can only handle quads or triangles
 
@@ -15,6 +16,7 @@ typedef struct obj_face
 	int texture_index[MAX_VERTEX_COUNT];
 	int vertex_count;
 	int material_index;
+	int object_index;
 };
 
 typedef struct obj_sphere
@@ -55,6 +57,11 @@ typedef struct obj_material
 	double refract_index;
 };
 
+typedef struct obj_object
+{
+	char name[OBJECT_NAME_SIZE];
+};
+
 typedef struct obj_camera
 {
 	int camera_pos_index;
@@ -100,6 +107,7 @@ typedef struct obj_growable_scene_data
 	list light_disc_list;
 	
 	list material_list;
+	list object_list;
 	
 	obj_camera *camera;
 };
@@ -119,6 +127,7 @@ typedef struct obj_scene_data
 	obj_light_disc **light_disc_list;
 	
 	obj_material **material_list;
+	obj_object **object_list;
 	
 	int vertex_count;
 	int vertex_normal_count;
@@ -133,6 +142,7 @@ typedef struct obj_scene_data
 	int light_disc_count;
 
 	int material_count;
+	int object_count;
 
 	obj_camera *camera;
 };
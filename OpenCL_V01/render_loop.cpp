@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <chrono>
+#include "render_loop.h"
+
+cl_int CreateRenderLoop(RenderLoop *loop, cl_context context, cl_device_id device, int width, int height){
+	cl_int error = CL_SUCCESS;
+	loop->width = width;
+	loop->height = height;
+
+	loop->readQueue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &error);
+	if (error != CL_SUCCESS) return error;
+
+	const cl_image_format format = { CL_RGBA, CL_UNORM_INT8 };
+	for (int i = 0; i < LOOP_BUFFERS; i++){
+		loop->images[i] = clCreateImage2D(context, CL_MEM_WRITE_ONLY, &format, width, height, 0, NULL, &error);
+		if (error != CL_SUCCESS) return error;
+		loop->pixels[i].resize((size_t)width * height * 4);
+	}
+	return CL_SUCCESS;
+}
+
+void ReleaseRenderLoop(RenderLoop *loop){
+	for (int i = 0; i < LOOP_BUFFERS; i++){
+		clReleaseMemObject(loop->images[i]);
+		loop->pixels[i].clear();
+	}
+	clReleaseCommandQueue(loop->readQueue);
+}
+
+static bool EventTimes(cl_event event, cl_ulong *start, cl_ulong *end){
+	return clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), start, NULL) == CL_SUCCESS &&
+		clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), end, NULL) == CL_SUCCESS;
+}
+
+cl_int RunRenderLoop(RenderLoop *loop, cl_command_queue queue, cl_kernel kernel, const size_t *global, const size_t *local,
+	int frames, bool overlap, const std::function<void(const unsigned char *, int)> &present, LoopStats *stats){
+	cl_int error = CL_SUCCESS;
+	const size_t origin[3] = { 0, 0, 0 };
+	const size_t region[3] = { (size_t)loop->width, (size_t)loop->height, 1 };
+	std::vector<cl_event> rendered(frames, NULL);
+	std::vector<cl_event> read(frames, NULL);
+	int shownCount = 0;
+
+	auto loopStart = std::chrono::high_resolution_clock::now();
+	for (int n = 0; n < frames; n++){
+		int slot = n % LOOP_BUFFERS;
+
+		// The image is free again once the last frame rendered into it was read
+		cl_uint waitCount = n >= LOOP_BUFFERS ? 1 : 0;
+		const cl_event *waitList = waitCount > 0 ? &read[n - LOOP_BUFFERS] : NULL;
+		clSetKernelArg(kernel, 0, sizeof(cl_mem), &loop->images[slot]);
+		error = clEnqueueNDRangeKernel(queue, kernel, 2, NULL, global, local, waitCount, waitList, &rendered[n]);
+		if (error != CL_SUCCESS) break;
+		clFlush(queue);
+
+		error = clEnqueueReadImage(loop->readQueue, loop->images[slot], CL_FALSE, origin, region, 0, 0, loop->pixels[slot].data(),
+			1, &rendered[n], &read[n]);
+		if (error != CL_SUCCESS) break;
+		clFlush(loop->readQueue);
+
+		// Show the previous frame while this one renders, or this one as the baseline
+		int shown = overlap ? n - 1 : n;
+		if (shown < 0) continue;
+
+		error = clWaitForEvents(1, &read[shown]);
+		if (error != CL_SUCCESS) break;
+		present(loop->pixels[shown % LOOP_BUFFERS].data(), shown);
+		shownCount = shown + 1;
+	}
+
+	if (error == CL_SUCCESS && shownCount < frames){
+		error = clWaitForEvents(1, &read[frames - 1]);
+		if (error == CL_SUCCESS) present(loop->pixels[(frames - 1) % LOOP_BUFFERS].data(), frames - 1);
+	}
+	clFinish(queue);
+	clFinish(loop->readQueue);
+	auto loopEnd = std::chrono::high_resolution_clock::now();
+
+	if (stats != NULL){
+		stats->frames = frames;
+		stats->wallMs = std::chrono::duration<double, std::milli>(loopEnd - loopStart).count();
+		stats->kernelMs = stats->readMs = stats->utilization = 0;
+
+		cl_ulong firstStart = 0, lastEnd = 0;
+		bool profiled = error == CL_SUCCESS;
+		for (int n = 0; n < frames && profiled; n++){
+			cl_ulong start, end, readStart, readEnd;
+			profiled = EventTimes(rendered[n], &start, &end) && EventTimes(read[n], &readStart, &readEnd);
+			if (!profiled) break;
+
+			if (n == 0 || start < firstStart) firstStart = start;
+			if (end > lastEnd) lastEnd = end;
+			stats->kernelMs += (end - start) * 1e-6;
+			stats->readMs += (readEnd - readStart) * 1e-6;
+		}
+		if (profiled && lastEnd > firstStart){
+			stats->utilization = stats->kernelMs / ((lastEnd - firstStart) * 1e-6);
+		}
+	}
+
+	for (int n = 0; n < frames; n++){
+		if (rendered[n] != NULL) clReleaseEvent(rendered[n]);
+		if (read[n] != NULL) clReleaseEvent(read[n]);
+	}
+	return error;
+}
+
+void PrintLoopStats(const char *name, const LoopStats &stats){
+	int frames = stats.frames > 0 ? stats.frames : 1;
+	printf("Render loop (%s): %d frames, %.2f ms/frame, kernel %.2f ms, readback %.2f ms per frame, device busy %.0f%%\n",
+		name, stats.frames, stats.wallMs / frames, stats.kernelMs / frames, stats.readMs / frames, stats.utilization * 100.0);
+}
@@ -0,0 +1,48 @@
+#ifndef RENDER_LOOP_H
+#define RENDER_LOOP_H
+
+#ifdef __APPLE__
+#include "OpenCL/opencl.h"
+#else
+#include "CL/cl.h"
+#endif
+#include <functional>
+#include <vector>
+
+#define LOOP_BUFFERS 2 // output images, one renders while the other is read back
+
+// Frames rendered into alternating images. Reads run on their own queue,
+// chained to the kernels by events, so the device renders frame N+1
+// while frame N is read back and shown.
+struct RenderLoop
+{
+	cl_command_queue readQueue;
+	cl_mem images[LOOP_BUFFERS];
+	std::vector<unsigned char> pixels[LOOP_BUFFERS]; // RGBA8, what the reads land in
+	int width;
+	int height;
+};
+
+struct LoopStats
+{
+	int frames;
+	double wallMs; // host time for every frame, until the last one was shown
+	double kernelMs; // device time in the kernel, summed
+	double readMs; // device time in readbacks, summed
+	double utilization; // kernelMs over the device time from first kernel start to last kernel end
+};
+
+// Both queues need CL_QUEUE_PROFILING_ENABLE for the stats, the read queue is made with it
+cl_int CreateRenderLoop(RenderLoop *loop, cl_context context, cl_device_id device, int width, int height);
+void ReleaseRenderLoop(RenderLoop *loop);
+
+// Render frames with kernel, whose argument 0 is the output image. Each
+// frame is read back without blocking and handed to present (RGBA8, in
+// frame order) once the read ended. With overlap false every frame is
+// waited for before the next starts, as a baseline.
+cl_int RunRenderLoop(RenderLoop *loop, cl_command_queue queue, cl_kernel kernel, const size_t *global, const size_t *local,
+	int frames, bool overlap, const std::function<void(const unsigned char *, int)> &present, LoopStats *stats);
+
+void PrintLoopStats(const char *name, const LoopStats &stats);
+
+#endif
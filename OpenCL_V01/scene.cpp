@@ -0,0 +1,224 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <unordered_map>
+#include "scene.h"
+#include "task_pool.h"
+
+// Faces of one object with vertices renumbered in order of first use,
+// positions relative to the first vertex so translated copies match
+struct ObjectGeometry
+{
+	std::vector<int> faces; // global faces
+	std::vector<int> localFaces;
+	std::vector<int> mats;
+	std::vector<float> relative;
+	float anchor[3];
+	size_t hash;
+};
+
+static void MakeGeometry(ObjectGeometry *geo, const float *verts, const int *faces, const int *faceMats, const std::vector<int> &faceIds){
+	std::unordered_map<int, int> local;
+	std::vector<int> order;
+
+	for (size_t f = 0; f < faceIds.size(); f++){
+		int face = faceIds[f];
+		for (int v = 0; v < 3; v++){
+			int index = faces[3 * face + v];
+			std::unordered_map<int, int>::iterator it = local.find(index);
+			if (it == local.end()){
+				it = local.insert(std::make_pair(index, (int)order.size())).first;
+				order.push_back(index);
+			}
+			geo->faces.push_back(index);
+			geo->localFaces.push_back(it->second);
+		}
+		geo->mats.push_back(faceMats[face]);
+	}
+
+	for (int k = 0; k < 3; k++){
+		geo->anchor[k] = verts[3 * order[0] + k];
+	}
+	for (size_t i = 0; i < order.size(); i++){
+		for (int k = 0; k < 3; k++){
+			geo->relative.push_back(verts[3 * order[i] + k] - geo->anchor[k]);
+		}
+	}
+
+	// Topology and materials only, positions are compared with a tolerance
+	size_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < geo->localFaces.size(); i++){
+		hash = (hash ^ (size_t)geo->localFaces[i]) * 1099511628211ULL;
+	}
+	for (size_t i = 0; i < geo->mats.size(); i++){
+		hash = (hash ^ (size_t)geo->mats[i]) * 1099511628211ULL;
+	}
+	geo->hash = hash;
+}
+
+static bool SameGeometry(const ObjectGeometry &a, const ObjectGeometry &b){
+	if (a.localFaces != b.localFaces || a.mats != b.mats || a.relative.size() != b.relative.size()){
+		return false;
+	}
+	for (size_t i = 0; i < a.relative.size(); i++){
+		float scale = fabsf(a.relative[i]) > 1.0f ? fabsf(a.relative[i]) : 1.0f;
+		if (fabsf(a.relative[i] - b.relative[i]) > 1e-5f * scale) return false;
+	}
+	return true;
+}
+
+static void Translation(float *m, const float *t){
+	memset(m, 0, 12 * sizeof(float));
+	m[0] = m[5] = m[10] = 1.0f;
+	m[3] = t[0];
+	m[7] = t[1];
+	m[11] = t[2];
+}
+
+static void TransformPoint(const float *m, const float *p, float *out){
+	for (int r = 0; r < 3; r++){
+		out[r] = m[4 * r] * p[0] + m[4 * r + 1] * p[1] + m[4 * r + 2] * p[2] + m[4 * r + 3];
+	}
+}
+
+static void InvertAffine(const float *m, float *inv){
+	float det = m[0] * (m[5] * m[10] - m[6] * m[9])
+		- m[1] * (m[4] * m[10] - m[6] * m[8])
+		+ m[2] * (m[4] * m[9] - m[5] * m[8]);
+	float invDet = det != 0 ? 1.0f / det : 0.0f;
+
+	inv[0] = (m[5] * m[10] - m[6] * m[9]) * invDet;
+	inv[1] = (m[2] * m[9] - m[1] * m[10]) * invDet;
+	inv[2] = (m[1] * m[6] - m[2] * m[5]) * invDet;
+	inv[4] = (m[6] * m[8] - m[4] * m[10]) * invDet;
+	inv[5] = (m[0] * m[10] - m[2] * m[8]) * invDet;
+	inv[6] = (m[2] * m[4] - m[0] * m[6]) * invDet;
+	inv[8] = (m[4] * m[9] - m[5] * m[8]) * invDet;
+	inv[9] = (m[1] * m[8] - m[0] * m[9]) * invDet;
+	inv[10] = (m[0] * m[5] - m[1] * m[4]) * invDet;
+
+	for (int r = 0; r < 3; r++){
+		inv[4 * r + 3] = -(inv[4 * r] * m[3] + inv[4 * r + 1] * m[7] + inv[4 * r + 2] * m[11]);
+	}
+}
+
+void BuildScene(Scene *scene, const float *verts, const int *faces, const int *faceMats, const int *faceObjects,
+	int faceCount, TaskPool *pool){
+	scene->blas.clear();
+	scene->instances.clear();
+	scene->blasNodes.clear();
+	scene->faces.clear();
+	scene->faceMats.clear();
+
+	// Faces grouped by object, faces before the first 'o'/'g' form their own
+	std::map<int, std::vector<int> > objects;
+	for (int i = 0; i < faceCount; i++){
+		objects[faceObjects[i]].push_back(i);
+	}
+
+	std::vector<ObjectGeometry> prototypes;
+	std::unordered_multimap<size_t, int> byHash;
+
+	for (std::map<int, std::vector<int> >::iterator it = objects.begin(); it != objects.end(); ++it){
+		ObjectGeometry geo;
+		MakeGeometry(&geo, verts, faces, faceMats, it->second);
+
+		int blasIndex = -1;
+		std::pair<std::unordered_multimap<size_t, int>::iterator, std::unordered_multimap<size_t, int>::iterator> range = byHash.equal_range(geo.hash);
+		for (std::unordered_multimap<size_t, int>::iterator m = range.first; m != range.second; ++m){
+			if (SameGeometry(prototypes[m->second], geo)){
+				blasIndex = m->second;
+				break;
+			}
+		}
+
+		if (blasIndex < 0){
+			blasIndex = (int)scene->blas.size();
+			int count = (int)it->second.size();
+
+			BVH bvh;
+			BuildBVHBinned(&bvh, verts, geo.faces.data(), count, pool);
+
+			std::vector<int> blasFaces = geo.faces;
+			std::vector<int> blasMats = geo.mats;
+			ReorderFaces(&bvh, blasFaces.data(), blasMats.data(), count);
+
+			BLAS blas;
+			blas.nodeOffset = (int)scene->blasNodes.size();
+			blas.nodeCount = (int)bvh.nodes.size();
+			blas.faceOffset = (int)scene->faceMats.size();
+			blas.faceCount = count;
+			for (int k = 0; k < 3; k++){
+				blas.bounds.bmin[k] = bvh.nodes[0].bmin[k];
+				blas.bounds.bmax[k] = bvh.nodes[0].bmax[k];
+			}
+
+			// Children and triangles index the shared arrays
+			for (size_t n = 0; n < bvh.nodes.size(); n++){
+				BVHNode node = bvh.nodes[n];
+				node.leftFirst += node.count > 0 ? blas.faceOffset : blas.nodeOffset;
+				scene->blasNodes.push_back(node);
+			}
+			scene->faces.insert(scene->faces.end(), blasFaces.begin(), blasFaces.end());
+			scene->faceMats.insert(scene->faceMats.end(), blasMats.begin(), blasMats.end());
+
+			scene->blas.push_back(blas);
+			byHash.insert(std::make_pair(geo.hash, blasIndex));
+			prototypes.push_back(geo);
+		}
+
+		// Shared geometry is placed by the offset between the anchors
+		float offset[3];
+		for (int k = 0; k < 3; k++){
+			offset[k] = geo.anchor[k] - prototypes[blasIndex].anchor[k];
+		}
+
+		BVHInstance instance;
+		memset(&instance, 0, sizeof(instance));
+		instance.blasRoot = scene->blas[blasIndex].nodeOffset;
+		instance.blasIndex = blasIndex;
+		instance.objectIndex = it->first;
+		Translation(instance.objectToWorld, offset);
+		InvertAffine(instance.objectToWorld, instance.worldToObject);
+		scene->instances.push_back(instance);
+	}
+
+	printf("Scene: %d objects, %d unique BLAS, %d BLAS nodes\n",
+		(int)scene->instances.size(), (int)scene->blas.size(), (int)scene->blasNodes.size());
+
+	BuildTLAS(scene);
+}
+
+void SetInstanceTransform(Scene *scene, int instance, const float *objectToWorld){
+	BVHInstance &target = scene->instances[instance];
+	memcpy(target.objectToWorld, objectToWorld, 12 * sizeof(float));
+	InvertAffine(target.objectToWorld, target.worldToObject);
+}
+
+void BuildTLAS(Scene *scene){
+	int count = (int)scene->instances.size();
+	std::vector<AABB> boxes(count);
+
+	// World box of every instance from the corners of its BLAS box
+	for (int i = 0; i < count; i++){
+		const BVHInstance &instance = scene->instances[i];
+		const AABB *bounds = &scene->blas[instance.blasIndex].bounds;
+
+		for (int c = 0; c < 8; c++){
+			float corner[3], world[3];
+			for (int k = 0; k < 3; k++){
+				corner[k] = ((c >> k) & 1) ? bounds->bmax[k] : bounds->bmin[k];
+			}
+			TransformPoint(instance.objectToWorld, corner, world);
+			boxes[i].Grow(world);
+		}
+	}
+
+	BuildBVHFromBoxes(&scene->tlas, boxes.data(), count);
+
+	scene->tlasInstances.resize(count);
+	for (int i = 0; i < count; i++){
+		scene->tlasInstances[i] = scene->instances[scene->tlas.triIndices[i]];
+	}
+}
@@ -0,0 +1,54 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <vector>
+#include "bvh.h"
+
+// Placement of one OBJ object, mirrored by BVHInstance in kernels/image.cl.
+// Matrices are row major 3x4 affine transforms.
+struct BVHInstance
+{
+	float worldToObject[12];
+	float objectToWorld[12];
+	int blasRoot; // root of the shared BLAS in Scene::blasNodes
+	int blasIndex;
+	int objectIndex;
+	int pad;
+};
+
+// Bottom level BVH of one unique object, faces stored from faceOffset on
+struct BLAS
+{
+	int nodeOffset;
+	int nodeCount;
+	int faceOffset;
+	int faceCount;
+	AABB bounds; // object space
+};
+
+// Two-level scene: one BLAS per unique OBJ object/group and a TLAS over
+// the instances. Moving an object only needs BuildTLAS().
+struct Scene
+{
+	std::vector<BLAS> blas;
+	std::vector<BVHInstance> instances; // one per object, in object order
+
+	std::vector<BVHNode> blasNodes; // every BLAS, offsets already applied
+	std::vector<int> faces; // every BLAS in leaf order
+	std::vector<int> faceMats;
+
+	BVH tlas;
+	std::vector<BVHInstance> tlasInstances; // instances in TLAS leaf order
+};
+
+// faceObjects holds the object of every face (-1 before any 'o'/'g').
+// Objects with the same faces and materials up to a translation share one BLAS.
+void BuildScene(Scene *scene, const float *verts, const int *faces, const int *faceMats, const int *faceObjects,
+	int faceCount, TaskPool *pool);
+
+void SetInstanceTransform(Scene *scene, int instance, const float *objectToWorld);
+
+// Rebuild the top level from the current instance transforms
+void BuildTLAS(Scene *scene);
+
+#endif
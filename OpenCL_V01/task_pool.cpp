@@ -0,0 +1,138 @@
+#include "task_pool.h"
+
+// Index of the worker owning the current thread, -1 for outside threads
+static thread_local int currentWorker = -1;
+static thread_local TaskPool *currentPool = NULL;
+
+TaskPool::TaskPool(int threadCount) : queued(0), nextWorker(0), stopping(false){
+	if (threadCount <= 0){
+		threadCount = (int)std::thread::hardware_concurrency();
+	}
+	if (threadCount <= 0){
+		threadCount = 1;
+	}
+
+	for (int i = 0; i < threadCount; i++){
+		workers.push_back(new Worker());
+	}
+	for (int i = 0; i < threadCount; i++){
+		threads.push_back(std::thread(&TaskPool::WorkerLoop, this, i));
+	}
+}
+
+TaskPool::~TaskPool(){
+	{
+		std::lock_guard<std::mutex> guard(sleepLock);
+		stopping = true;
+	}
+	wake.notify_all();
+
+	for (size_t i = 0; i < threads.size(); i++){
+		threads[i].join();
+	}
+	for (size_t i = 0; i < workers.size(); i++){
+		delete workers[i];
+	}
+}
+
+void TaskPool::Submit(std::function<void()> task, std::atomic<int> *counter){
+	Task t = { task, counter };
+
+	// Workers keep their own tasks local, outside threads spread them out
+	int target = (currentPool == this) ? currentWorker : nextWorker++ % (int)workers.size();
+
+	// Count first so queued never drops below the number of tasks held
+	{
+		std::lock_guard<std::mutex> guard(sleepLock);
+		queued++;
+	}
+	{
+		std::lock_guard<std::mutex> guard(workers[target]->lock);
+		workers[target]->tasks.push_back(t);
+	}
+	wake.notify_one();
+}
+
+bool TaskPool::PopTask(int self, Task *task){
+	int count = (int)workers.size();
+
+	// Newest task from our own deque first
+	if (self >= 0){
+		Worker *w = workers[self];
+		std::lock_guard<std::mutex> guard(w->lock);
+		if (!w->tasks.empty()){
+			*task = w->tasks.back();
+			w->tasks.pop_back();
+			queued--;
+			return true;
+		}
+	}
+
+	// Steal the oldest task from someone else
+	int start = (self >= 0) ? self + 1 : 0;
+	for (int i = 0; i < count; i++){
+		Worker *w = workers[(start + i) % count];
+		std::lock_guard<std::mutex> guard(w->lock);
+		if (!w->tasks.empty()){
+			*task = w->tasks.front();
+			w->tasks.pop_front();
+			queued--;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void TaskPool::RunTask(Task &task){
+	task.run();
+	if (task.counter != NULL){
+		(*task.counter)--;
+	}
+}
+
+void TaskPool::WorkerLoop(int self){
+	currentWorker = self;
+	currentPool = this;
+
+	for (;;){
+		Task task;
+		if (PopTask(self, &task)){
+			RunTask(task);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> guard(sleepLock);
+		wake.wait(guard, [this] { return stopping || queued > 0; });
+		if (stopping && queued == 0){
+			return;
+		}
+	}
+}
+
+void TaskPool::WaitFor(std::atomic<int> *counter){
+	int self = (currentPool == this) ? currentWorker : -1;
+
+	while (*counter > 0){
+		Task task;
+		if (PopTask(self, &task)){
+			RunTask(task);
+		}
+		else {
+			std::this_thread::yield();
+		}
+	}
+}
+
+void TaskPool::ParallelFor(int begin, int end, int grain, std::function<void(int, int)> body){
+	if (grain < 1) grain = 1;
+
+	std::atomic<int> pending(0);
+	for (int first = begin; first < end; first += grain){
+		int last = (first + grain < end) ? first + grain : end;
+		pending++;
+		Submit([=] { body(first, last); }, &pending);
+	}
+
+	WaitFor(&pending);
+}
@@ -0,0 +1,59 @@
+#ifndef TASK_POOL_H
+#define TASK_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing pool, one deque per worker. Workers pop their own newest
+// task and steal the oldest task of another worker when they run dry.
+class TaskPool
+{
+public:
+	// threadCount 0 sizes the pool to the machine's cores
+	TaskPool(int threadCount = 0);
+	~TaskPool();
+
+	// Queue a task, counter (if any) is decremented once it has run
+	void Submit(std::function<void()> task, std::atomic<int> *counter = NULL);
+
+	// Run queued tasks on the calling thread until counter reaches zero
+	void WaitFor(std::atomic<int> *counter);
+
+	// Split [begin, end) into chunks of at least grain and wait for them
+	void ParallelFor(int begin, int end, int grain, std::function<void(int, int)> body);
+
+	int ThreadCount() const { return (int)threads.size(); }
+
+private:
+	struct Task
+	{
+		std::function<void()> run;
+		std::atomic<int> *counter;
+	};
+
+	struct Worker
+	{
+		std::deque<Task> tasks;
+		std::mutex lock;
+	};
+
+	bool PopTask(int self, Task *task);
+	void RunTask(Task &task);
+	void WorkerLoop(int self);
+
+	std::vector<std::thread> threads;
+	std::vector<Worker*> workers;
+
+	std::mutex sleepLock;
+	std::condition_variable wake;
+	std::atomic<int> queued;
+	std::atomic<int> nextWorker;
+	bool stopping;
+};
+
+#endif
@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <algorithm>
+#include "tiles.h"
+
+// Cell of the d-th step along a Hilbert curve over an n x n grid, n a power of two
+static void HilbertCell(int n, int d, int *x, int *y){
+	int cx = 0, cy = 0;
+	for (int s = 1; s < n; s *= 2){
+		int rx = 1 & (d / 2);
+		int ry = 1 & (d ^ rx);
+		if (ry == 0){
+			if (rx == 1){
+				cx = s - 1 - cx;
+				cy = s - 1 - cy;
+			}
+			std::swap(cx, cy);
+		}
+		cx += s * rx;
+		cy += s * ry;
+		d /= 4;
+	}
+	*x = cx;
+	*y = cy;
+}
+
+void BuildTiles(std::vector<Tile> *tiles, int width, int height, int tileSize, TileOrder order){
+	int size = tileSize > 0 ? tileSize : TILE_SIZE;
+	int columns = (width + size - 1) / size;
+	int rows = (height + size - 1) / size;
+
+	// Tile grid cells in the chosen order
+	std::vector<int> cells;
+	cells.reserve(columns * rows);
+	if (order == TILE_ORDER_HILBERT){
+		int n = 1;
+		while (n < columns || n < rows) n *= 2;
+
+		// The curve covers the enclosing power of two, cells outside are skipped
+		for (int d = 0; d < n * n; d++){
+			int x, y;
+			HilbertCell(n, d, &x, &y);
+			if (x < columns && y < rows) cells.push_back(y * columns + x);
+		}
+	}
+	else {
+		for (int c = 0; c < columns * rows; c++) cells.push_back(c);
+
+		if (order == TILE_ORDER_CENTER_OUT){
+			// Squared distance of tile centers from the image center, in half tiles
+			auto distance = [columns, rows](int c){
+				int dx = 2 * (c % columns) + 1 - columns;
+				int dy = 2 * (c / columns) + 1 - rows;
+				return dx * dx + dy * dy;
+			};
+			std::stable_sort(cells.begin(), cells.end(), [&distance](int a, int b){ return distance(a) < distance(b); });
+		}
+	}
+
+	tiles->clear();
+	tiles->reserve(cells.size());
+	for (int c : cells){
+		Tile tile;
+		tile.x = (c % columns) * size;
+		tile.y = (c / columns) * size;
+		tile.width = std::min(size, width - tile.x);
+		tile.height = std::min(size, height - tile.y);
+		tiles->push_back(tile);
+	}
+}
+
+static double EventMs(cl_ulong from, cl_ulong to){
+	return to > from ? (to - from) * 1e-6 : 0.0;
+}
+
+cl_int RenderTiles(cl_command_queue queue, cl_kernel kernel, const std::vector<Tile> &tiles, const size_t *local, int inFlight,
+	TileStats *stats){
+	cl_int error = CL_SUCCESS;
+	size_t count = tiles.size();
+	size_t window = inFlight > 0 ? (size_t)inFlight : 1;
+	std::vector<cl_event> events(count, NULL);
+
+	for (size_t i = 0; i < count && error == CL_SUCCESS; i++){
+		// Wait for the oldest dispatch before queueing past the window
+		if (i >= window){
+			error = clWaitForEvents(1, &events[i - window]);
+			if (error != CL_SUCCESS) break;
+		}
+
+		const Tile &tile = tiles[i];
+		size_t offset[2] = { (size_t)tile.x, (size_t)tile.y };
+		size_t global[2] = { (size_t)tile.width, (size_t)tile.height };
+		if (local != NULL){
+			global[0] = (global[0] + local[0] - 1) / local[0] * local[0];
+			global[1] = (global[1] + local[1] - 1) / local[1] * local[1];
+		}
+		error = clEnqueueNDRangeKernel(queue, kernel, 2, offset, global, local, 0, NULL, &events[i]);
+
+		// Start it now rather than when the window fills up
+		clFlush(queue);
+	}
+	clFinish(queue);
+
+	if (stats != NULL){
+		stats->tileCount = (int)count;
+		stats->frameMs = stats->previewMs = stats->maxTileMs = stats->meanTileMs = 0;
+
+		size_t previewCount = (size_t)(count * TILE_PREVIEW_FRACTION);
+		if (previewCount < 1) previewCount = 1;
+
+		cl_ulong firstStart = 0, lastEnd = 0, previewEnd = 0;
+		double totalMs = 0;
+		bool profiled = true;
+		for (size_t i = 0; i < count && profiled; i++){
+			cl_ulong start = 0, end = 0;
+			if (events[i] == NULL ||
+				clGetEventProfilingInfo(events[i], CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL) != CL_SUCCESS ||
+				clGetEventProfilingInfo(events[i], CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL) != CL_SUCCESS){
+				profiled = false;
+				break;
+			}
+			if (i == 0 || start < firstStart) firstStart = start;
+			if (end > lastEnd) lastEnd = end;
+			if (i < previewCount && end > previewEnd) previewEnd = end;
+
+			double tileMs = EventMs(start, end);
+			totalMs += tileMs;
+			if (tileMs > stats->maxTileMs) stats->maxTileMs = tileMs;
+		}
+
+		if (profiled && count > 0){
+			stats->frameMs = EventMs(firstStart, lastEnd);
+			stats->previewMs = EventMs(firstStart, previewEnd);
+			stats->meanTileMs = totalMs / count;
+		}
+	}
+
+	for (size_t i = 0; i < count; i++){
+		if (events[i] != NULL) clReleaseEvent(events[i]);
+	}
+	return error;
+}
+
+void PrintTileStats(const char *name, const TileStats &stats){
+	printf("Tiles (%s): %d tiles, frame %.2f ms, preview %.2f ms (first %.0f%%), tile %.3f ms mean / %.3f ms max\n",
+		name, stats.tileCount, stats.frameMs, stats.previewMs, TILE_PREVIEW_FRACTION * 100.0f, stats.meanTileMs, stats.maxTileMs);
+}
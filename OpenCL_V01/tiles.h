@@ -0,0 +1,55 @@
+#ifndef TILES_H
+#define TILES_H
+
+#ifdef __APPLE__
+#include "OpenCL/opencl.h"
+#else
+#include "CL/cl.h"
+#endif
+#include <vector>
+
+#define TILE_SIZE 64 // default tile edge in pixels
+#define TILES_IN_FLIGHT 8 // dispatched tiles the host lets run ahead of it
+#define TILE_PREVIEW_FRACTION 0.25f // share of tiles counted as the preview
+
+enum TileOrder
+{
+	TILE_ORDER_SCANLINE,
+	TILE_ORDER_HILBERT, // neighbouring tiles follow each other, coherent caches
+	TILE_ORDER_CENTER_OUT // nearest the image center first, for an early preview
+};
+
+// Rectangle of pixels dispatched as its own NDRange, edge tiles are clipped
+struct Tile
+{
+	int x;
+	int y;
+	int width;
+	int height;
+};
+
+// Cover a width x height image with tileSize tiles in the given order
+void BuildTiles(std::vector<Tile> *tiles, int width, int height, int tileSize, TileOrder order);
+
+struct TileStats
+{
+	int tileCount;
+	double frameMs; // first tile start to last tile end on the device
+	double previewMs; // until the first TILE_PREVIEW_FRACTION of the tiles ended
+	double maxTileMs; // longest single dispatch, what a watchdog sees
+	double meanTileMs;
+};
+
+// Dispatch a 2D kernel once per tile through the global work offset, the
+// kernel indexes pixels with get_global_id as for a whole frame. local may
+// be NULL, otherwise it must divide the tile size and edge tiles are
+// padded to whole work-groups, which the kernel skips. At most
+// inFlight tiles are queued ahead of the host, earlier ones finish while
+// later ones wait. Returns once every tile ended. queue must have
+// CL_QUEUE_PROFILING_ENABLE for stats, which may be NULL.
+cl_int RenderTiles(cl_command_queue queue, cl_kernel kernel, const std::vector<Tile> &tiles, const size_t *local, int inFlight,
+	TileStats *stats);
+
+void PrintTileStats(const char *name, const TileStats &stats);
+
+#endif
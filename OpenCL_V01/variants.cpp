@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <inttypes.h>
+#include <vector>
+#include "variants.h"
+#include "bvh_cache.h"
+
+void ComputeSceneFeatures(SceneFeatures *features, const int *faceMats, int faceCount, const float *materials, int materialCount){
+	features->faceCount = faceCount;
+	features->usedMaterials = 0;
+	features->singleColor[0] = features->singleColor[1] = features->singleColor[2] = 0.0f;
+
+	std::vector<bool> used(materialCount > 0 ? materialCount : 0, false);
+	int lastUsed = -1;
+	for (int i = 0; i < faceCount; i++){
+		int material = faceMats[i];
+		if (material < 0 || material >= materialCount){
+			features->usedMaterials = -1;
+			return;
+		}
+		if (!used[material]){
+			used[material] = true;
+			lastUsed = material;
+			features->usedMaterials++;
+		}
+	}
+
+	if (features->usedMaterials == 1){
+		for (int k = 0; k < 3; k++){
+			features->singleColor[k] = materials[lastUsed * MATERIAL_FLOATS + k];
+		}
+	}
+}
+
+std::string SceneDefines(const SceneFeatures &features){
+	std::string defines;
+
+	// One material: the color is a literal instead of two dependent loads per hit
+	if (features.usedMaterials == 1){
+		char color[128];
+		snprintf(color, sizeof(color), " -D SINGLE_MATERIAL -D SCENE_COLOR=(float3)(%.9ef,%.9ef,%.9ef)",
+			features.singleColor[0], features.singleColor[1], features.singleColor[2]);
+		defines += color;
+	}
+	return defines;
+}
+
+static std::string DeviceString(cl_device_id device, cl_device_info info){
+	size_t size = 0;
+	clGetDeviceInfo(device, info, 0, NULL, &size);
+	std::vector<char> text(size + 1, 0);
+	clGetDeviceInfo(device, info, size, text.data(), NULL);
+	return std::string(text.data());
+}
+
+uint64_t ProgramBinaryKey(cl_device_id device, const std::string &options, const std::string &source){
+	const cl_device_info infos[3] = { CL_DEVICE_NAME, CL_DRIVER_VERSION, CL_DEVICE_VERSION };
+	uint64_t hash = FNV_OFFSET;
+	for (int i = 0; i < 3; i++){
+		std::string text = DeviceString(device, infos[i]);
+		hash = HashBytes(hash, text.data(), text.size() + 1);
+	}
+	hash = HashBytes(hash, options.data(), options.size() + 1);
+	return HashBytes(hash, source.data(), source.size());
+}
+
+static std::string BinaryPath(uint64_t key){
+	char name[32];
+	snprintf(name, sizeof(name), ".%016" PRIx64 ".bin", key);
+	return std::string(PROGRAM_CACHE_PREFIX) + name;
+}
+
+static bool ReadBinary(const std::string &path, std::vector<unsigned char> *binary){
+	FILE *file = fopen(path.c_str(), "rb");
+	if (file == NULL) return false;
+
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	bool ok = size > 0;
+	if (ok){
+		binary->resize(size);
+		ok = fread(binary->data(), 1, size, file) == (size_t)size;
+	}
+	fclose(file);
+	return ok;
+}
+
+// Written to a temporary file first, like the BVH cache
+static bool WriteBinary(const std::string &path, const unsigned char *binary, size_t size){
+	std::string tempPath = path + ".tmp";
+	FILE *file = fopen(tempPath.c_str(), "wb");
+	if (file == NULL){
+		printf("Program cache: can not write %s\n", tempPath.c_str());
+		return false;
+	}
+
+	bool ok = fwrite(binary, 1, size, file) == size;
+	ok = fclose(file) == 0 && ok;
+
+	if (ok){
+		remove(path.c_str());
+		ok = rename(tempPath.c_str(), path.c_str()) == 0;
+	}
+	if (!ok){
+		printf("Program cache: failed to write %s\n", path.c_str());
+		remove(tempPath.c_str());
+	}
+	return ok;
+}
+
+static void PrintBuildLog(cl_program program, cl_device_id device, const std::string &options){
+	size_t logSize = 0;
+	clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &logSize);
+	std::vector<char> log(logSize + 1, 0);
+	clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, logSize, log.data(), NULL);
+	printf("OpenCL: Error building variant %s\n%s\n", options.c_str(), log.data());
+}
+
+// Program from the saved binary of every device, NULL when one is missing or rejected
+static cl_program LoadBinaries(ProgramVariants *variants, cl_uint deviceCount, const cl_device_id *devices, const std::string &options){
+	std::vector<std::vector<unsigned char> > binaries(deviceCount);
+	std::vector<const unsigned char*> pointers(deviceCount);
+	std::vector<size_t> sizes(deviceCount);
+	for (cl_uint i = 0; i < deviceCount; i++){
+		if (!ReadBinary(BinaryPath(ProgramBinaryKey(devices[i], options, variants->source)), &binaries[i])) return NULL;
+		pointers[i] = binaries[i].data();
+		sizes[i] = binaries[i].size();
+	}
+
+	cl_int error = CL_SUCCESS;
+	std::vector<int> status(deviceCount, CL_SUCCESS);
+	cl_program program = clCreateProgramWithBinary(variants->context, deviceCount, devices, sizes.data(), pointers.data(),
+		(cl_int*)status.data(), &error);
+	if (error != CL_SUCCESS) return NULL;
+
+	// Binaries still need a build, which links them for the device
+	if (clBuildProgram(program, deviceCount, devices, options.c_str(), NULL, NULL) != CL_SUCCESS){
+		printf("Program cache: saved binaries rejected, building from source\n");
+		clReleaseProgram(program);
+		return NULL;
+	}
+	return program;
+}
+
+// Save the binary the source build made for each of devices
+static void SaveBinaries(ProgramVariants *variants, cl_program program, cl_uint deviceCount, const cl_device_id *devices,
+	const std::string &options){
+	// Binaries come in the order of CL_PROGRAM_DEVICES, which holds every device of the context
+	cl_uint programDeviceCount = 0;
+	clGetProgramInfo(program, CL_PROGRAM_NUM_DEVICES, sizeof(cl_uint), &programDeviceCount, NULL);
+	std::vector<cl_device_id> programDevices(programDeviceCount);
+	std::vector<size_t> sizes(programDeviceCount, 0);
+	clGetProgramInfo(program, CL_PROGRAM_DEVICES, sizeof(cl_device_id) * programDeviceCount, programDevices.data(), NULL);
+	clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t) * programDeviceCount, sizes.data(), NULL);
+
+	std::vector<std::vector<unsigned char> > binaries(programDeviceCount);
+	std::vector<unsigned char*> pointers(programDeviceCount);
+	for (cl_uint i = 0; i < programDeviceCount; i++){
+		binaries[i].resize(sizes[i]);
+		pointers[i] = sizes[i] > 0 ? binaries[i].data() : NULL;
+	}
+	if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char*) * programDeviceCount, pointers.data(), NULL) != CL_SUCCESS) return;
+
+	for (cl_uint i = 0; i < programDeviceCount; i++){
+		bool built = false;
+		for (cl_uint d = 0; d < deviceCount; d++){
+			if (devices[d] == programDevices[i]) built = true;
+		}
+		if (!built || sizes[i] == 0) continue;
+
+		WriteBinary(BinaryPath(ProgramBinaryKey(programDevices[i], options, variants->source)), binaries[i].data(), sizes[i]);
+	}
+}
+
+cl_int GetProgramVariant(ProgramVariants *variants, cl_uint deviceCount, const cl_device_id *devices, const std::string &options,
+	cl_program *program, ProgramOrigin *origin){
+	std::map<std::string, cl_program>::iterator found = variants->programs.find(options);
+	if (found != variants->programs.end()){
+		*program = found->second;
+		*origin = PROGRAM_REUSED;
+		return CL_SUCCESS;
+	}
+
+	cl_program created = variants->useBinaries ? LoadBinaries(variants, deviceCount, devices, options) : NULL;
+	if (created != NULL){
+		variants->programs[options] = created;
+		*program = created;
+		*origin = PROGRAM_FROM_BINARY;
+		return CL_SUCCESS;
+	}
+
+	cl_int error = CL_SUCCESS;
+	size_t lengths[1] = { variants->source.size() };
+	const char *sources[1] = { variants->source.data() };
+	created = clCreateProgramWithSource(variants->context, 1, sources, lengths, &error);
+	if (error != CL_SUCCESS) return error;
+
+	error = clBuildProgram(created, deviceCount, devices, options.c_str(), NULL, NULL);
+	if (error != CL_SUCCESS){
+		// The log is what tells a broken variant apart
+		PrintBuildLog(created, devices[0], options);
+		clReleaseProgram(created);
+		return error;
+	}
+
+	if (variants->useBinaries) SaveBinaries(variants, created, deviceCount, devices, options);
+
+	variants->programs[options] = created;
+	*program = created;
+	*origin = PROGRAM_FROM_SOURCE;
+	return CL_SUCCESS;
+}
+
+void ReleaseProgramVariants(ProgramVariants *variants){
+	for (std::map<std::string, cl_program>::iterator it = variants->programs.begin(); it != variants->programs.end(); ++it){
+		clReleaseProgram(it->second);
+	}
+	variants->programs.clear();
+}
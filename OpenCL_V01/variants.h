@@ -0,0 +1,59 @@
+#ifndef VARIANTS_H
+#define VARIANTS_H
+
+#ifdef __APPLE__
+#include "OpenCL/opencl.h"
+#else
+#include "CL/cl.h"
+#endif
+#include <stdint.h>
+#include <map>
+#include <string>
+
+#define PROGRAM_CACHE_PREFIX "kernels/image" // binaries go to <prefix>.<key>.bin
+
+// What the loaded scene uses that the kernel can be specialized on
+struct SceneFeatures
+{
+	int faceCount;
+	int usedMaterials; // distinct materials faces name, -1 when one is out of range
+	float singleColor[3]; // diffuse color of the only material when usedMaterials == 1
+};
+
+// faceMats index materials, MATERIAL_FLOATS floats per material
+void ComputeSceneFeatures(SceneFeatures *features, const int *faceMats, int faceCount, const float *materials, int materialCount);
+
+// -D options that compile out what the scene does not use
+std::string SceneDefines(const SceneFeatures &features);
+
+// Programs built from one source, by build options, so a scene that
+// needs the same variant as an earlier one does not compile again. With
+// useBinaries, compiled binaries are also kept on disk per device.
+struct ProgramVariants
+{
+	cl_context context;
+	std::string source;
+	std::map<std::string, cl_program> programs;
+	bool useBinaries;
+};
+
+enum ProgramOrigin
+{
+	PROGRAM_REUSED, // built earlier in this run
+	PROGRAM_FROM_BINARY, // warm start, clCreateProgramWithBinary
+	PROGRAM_FROM_SOURCE // cold start, binaries are saved afterwards
+};
+
+// Key of the binary for device: its name, driver and OpenCL version, the
+// build options and the source
+uint64_t ProgramBinaryKey(cl_device_id device, const std::string &options, const std::string &source);
+
+// The program built with options for devices, on first use from the
+// saved binaries when every device has one and from source otherwise
+// (also when the binaries are rejected, e.g. after a driver update).
+cl_int GetProgramVariant(ProgramVariants *variants, cl_uint deviceCount, const cl_device_id *devices, const std::string &options,
+	cl_program *program, ProgramOrigin *origin);
+
+void ReleaseProgramVariants(ProgramVariants *variants);
+
+#endif
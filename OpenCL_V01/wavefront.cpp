@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <limits.h>
+#include <chrono>
+#include <utility>
+#include "wavefront.h"
+
+// Filter arguments 1-8 in the order the stage kernels take them from first
+static void SetSceneArgs(cl_kernel kernel, cl_uint first, const SceneBuffers &scene, bool traversal){
+	if (traversal){
+		clSetKernelArg(kernel, first + 0, sizeof(cl_mem), &scene.triangles);
+		clSetKernelArg(kernel, first + 1, sizeof(cl_mem), &scene.faceCount);
+		clSetKernelArg(kernel, first + 2, sizeof(cl_mem), &scene.nodes);
+		clSetKernelArg(kernel, first + 3, sizeof(cl_mem), &scene.links);
+		clSetKernelArg(kernel, first + 4, sizeof(cl_mem), &scene.tlasNodes);
+		clSetKernelArg(kernel, first + 5, sizeof(cl_mem), &scene.instances);
+	}
+	else {
+		clSetKernelArg(kernel, first + 0, sizeof(cl_mem), &scene.faceMats);
+		clSetKernelArg(kernel, first + 1, sizeof(cl_mem), &scene.materials);
+	}
+}
+
+void PersistentLaunchSize(cl_kernel kernel, cl_device_id device, size_t *global, size_t *local){
+	cl_uint units = 1;
+	size_t maxGroup = PERSISTENT_GROUP_SIZE;
+	clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &units, NULL);
+	clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &maxGroup, NULL);
+
+	*local = maxGroup < PERSISTENT_GROUP_SIZE ? maxGroup : PERSISTENT_GROUP_SIZE;
+	*global = *local * units * PERSISTENT_GROUPS_PER_UNIT;
+}
+
+cl_int CreateWavefrontPipeline(WavefrontPipeline *pipeline, cl_context context, cl_program program, cl_device_id device, int width, int height){
+	cl_int error = CL_SUCCESS;
+	size_t count = (size_t)width * height;
+
+	pipeline->width = width;
+	pipeline->height = height;
+
+	const char *names[10] = { "WavefrontGenerate", "WavefrontExtend", "WavefrontShade", "WavefrontConnect", "WavefrontWrite",
+		"WavefrontExtendPersistent", "WavefrontConnectPersistent", "RayOriginBounds", "RayKeys", "WavefrontGatherShadowRays" };
+	cl_kernel *kernels[10] = { &pipeline->generate, &pipeline->extend, &pipeline->shade, &pipeline->connect, &pipeline->write,
+		&pipeline->extendPersistent, &pipeline->connectPersistent, &pipeline->rayBounds, &pipeline->rayKeys, &pipeline->gatherShadow };
+
+	for (int i = 0; i < 10; i++){
+		*kernels[i] = clCreateKernel(program, names[i], &error);
+		if (error != CL_SUCCESS){
+			printf("OpenCL: Error creating wavefront kernel %s\n", names[i]);
+			return error;
+		}
+	}
+
+	// Every queue holds at most one ray per pixel
+	pipeline->rayOrigins = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_float4) * count, NULL, &error);
+	pipeline->rayDirs = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_float4) * count, NULL, &error);
+	pipeline->rayPixels = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * count, NULL, &error);
+	pipeline->hitFaces = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * count, NULL, &error);
+	pipeline->hitPoints = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_float4) * count, NULL, &error);
+	pipeline->shadowOrigins = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_float4) * count, NULL, &error);
+	pipeline->shadowDirs = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_float4) * count, NULL, &error);
+	pipeline->shadowPixels = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * count, NULL, &error);
+	pipeline->shadowColors = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_float4) * count, NULL, &error);
+	pipeline->colors = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_float4) * count, NULL, &error);
+	pipeline->counters = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * WAVEFRONT_COUNTERS, NULL, &error);
+
+	for (int i = 0; i < 2; i++){
+		pipeline->keys[i] = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint) * count, NULL, &error);
+		pipeline->ids[i] = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * count, NULL, &error);
+	}
+	pipeline->bounds = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * 6, NULL, &error);
+	pipeline->sortedOrigins = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_float4) * count, NULL, &error);
+	pipeline->sortedDirs = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_float4) * count, NULL, &error);
+	pipeline->sortedPixels = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * count, NULL, &error);
+	pipeline->sortedColors = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_float4) * count, NULL, &error);
+
+	// Both persistent stages run with the smaller of their launch sizes
+	size_t extendGlobal, extendLocal;
+	PersistentLaunchSize(pipeline->extendPersistent, device, &extendGlobal, &extendLocal);
+	PersistentLaunchSize(pipeline->connectPersistent, device, &pipeline->persistentGlobal, &pipeline->persistentLocal);
+	if (extendLocal < pipeline->persistentLocal){
+		pipeline->persistentGlobal = extendGlobal;
+		pipeline->persistentLocal = extendLocal;
+	}
+
+	if (error != CL_SUCCESS){
+		printf("OpenCL: Error allocating wavefront queues\n");
+		return error;
+	}
+	return CreateRadixSorter(&pipeline->sorter, context, program, device, (int)count);
+}
+
+void ReleaseWavefrontPipeline(WavefrontPipeline *pipeline){
+	clReleaseKernel(pipeline->generate);
+	clReleaseKernel(pipeline->extend);
+	clReleaseKernel(pipeline->shade);
+	clReleaseKernel(pipeline->connect);
+	clReleaseKernel(pipeline->write);
+	clReleaseKernel(pipeline->extendPersistent);
+	clReleaseKernel(pipeline->connectPersistent);
+	clReleaseKernel(pipeline->rayBounds);
+	clReleaseKernel(pipeline->rayKeys);
+	clReleaseKernel(pipeline->gatherShadow);
+
+	clReleaseMemObject(pipeline->rayOrigins);
+	clReleaseMemObject(pipeline->rayDirs);
+	clReleaseMemObject(pipeline->rayPixels);
+	clReleaseMemObject(pipeline->hitFaces);
+	clReleaseMemObject(pipeline->hitPoints);
+	clReleaseMemObject(pipeline->shadowOrigins);
+	clReleaseMemObject(pipeline->shadowDirs);
+	clReleaseMemObject(pipeline->shadowPixels);
+	clReleaseMemObject(pipeline->shadowColors);
+	clReleaseMemObject(pipeline->colors);
+	clReleaseMemObject(pipeline->counters);
+
+	ReleaseRadixSorter(&pipeline->sorter);
+	for (int i = 0; i < 2; i++){
+		clReleaseMemObject(pipeline->keys[i]);
+		clReleaseMemObject(pipeline->ids[i]);
+	}
+	clReleaseMemObject(pipeline->bounds);
+	clReleaseMemObject(pipeline->sortedOrigins);
+	clReleaseMemObject(pipeline->sortedDirs);
+	clReleaseMemObject(pipeline->sortedPixels);
+	clReleaseMemObject(pipeline->sortedColors);
+}
+
+// Launch a stage over its queue, one work-item per slot or as persistent
+// work-items that fetch slots themselves
+static cl_int EnqueueStage(WavefrontPipeline *pipeline, cl_command_queue queue, cl_kernel kernel, bool persistent){
+	if (persistent){
+		return clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &pipeline->persistentGlobal, &pipeline->persistentLocal, 0, NULL, NULL);
+	}
+	return Enqueue1D(queue, kernel, (size_t)pipeline->width * pipeline->height);
+}
+
+static cl_int EnqueueConnect(WavefrontPipeline *pipeline, cl_command_queue queue, const SceneBuffers &scene, bool persistent){
+	cl_kernel connect = persistent ? pipeline->connectPersistent : pipeline->connect;
+	clSetKernelArg(connect, 0, sizeof(cl_mem), &pipeline->shadowOrigins);
+	clSetKernelArg(connect, 1, sizeof(cl_mem), &pipeline->shadowDirs);
+	clSetKernelArg(connect, 2, sizeof(cl_mem), &pipeline->shadowPixels);
+	clSetKernelArg(connect, 3, sizeof(cl_mem), &pipeline->shadowColors);
+	clSetKernelArg(connect, 4, sizeof(cl_mem), &pipeline->counters);
+	clSetKernelArg(connect, 5, sizeof(cl_mem), &pipeline->colors);
+	SetSceneArgs(connect, 6, scene, true);
+	return EnqueueStage(pipeline, queue, connect, persistent);
+}
+
+// Sort the whole shadow queue capacity, so its length is never read back
+static cl_int EnqueueSortShadowRays(WavefrontPipeline *pipeline, cl_command_queue queue){
+	cl_int error = CL_SUCCESS;
+	int count = pipeline->width * pipeline->height;
+	cl_int queueIndex = WAVEFRONT_QUEUE_SHADOW;
+
+	static const cl_int emptyBounds[6] = { INT_MAX, INT_MAX, INT_MAX, INT_MIN, INT_MIN, INT_MIN };
+	error = clEnqueueWriteBuffer(queue, pipeline->bounds, CL_FALSE, 0, sizeof(emptyBounds), emptyBounds, 0, NULL, NULL);
+
+	clSetKernelArg(pipeline->rayBounds, 0, sizeof(cl_mem), &pipeline->shadowOrigins);
+	clSetKernelArg(pipeline->rayBounds, 1, sizeof(cl_mem), &pipeline->counters);
+	clSetKernelArg(pipeline->rayBounds, 2, sizeof(cl_int), &queueIndex);
+	clSetKernelArg(pipeline->rayBounds, 3, sizeof(cl_mem), &pipeline->bounds);
+	if (error == CL_SUCCESS) error = Enqueue1D(queue, pipeline->rayBounds, count);
+
+	clSetKernelArg(pipeline->rayKeys, 0, sizeof(cl_mem), &pipeline->shadowOrigins);
+	clSetKernelArg(pipeline->rayKeys, 1, sizeof(cl_mem), &pipeline->shadowDirs);
+	clSetKernelArg(pipeline->rayKeys, 2, sizeof(cl_mem), &pipeline->counters);
+	clSetKernelArg(pipeline->rayKeys, 3, sizeof(cl_int), &queueIndex);
+	clSetKernelArg(pipeline->rayKeys, 4, sizeof(cl_mem), &pipeline->bounds);
+	clSetKernelArg(pipeline->rayKeys, 5, sizeof(cl_mem), &pipeline->keys[0]);
+	clSetKernelArg(pipeline->rayKeys, 6, sizeof(cl_mem), &pipeline->ids[0]);
+	if (error == CL_SUCCESS) error = Enqueue1D(queue, pipeline->rayKeys, count);
+
+	if (error == CL_SUCCESS) error = RadixSort(&pipeline->sorter, queue, pipeline->keys, pipeline->ids, count);
+
+	clSetKernelArg(pipeline->gatherShadow, 0, sizeof(cl_mem), &pipeline->ids[0]);
+	clSetKernelArg(pipeline->gatherShadow, 1, sizeof(cl_mem), &pipeline->counters);
+	clSetKernelArg(pipeline->gatherShadow, 2, sizeof(cl_mem), &pipeline->shadowOrigins);
+	clSetKernelArg(pipeline->gatherShadow, 3, sizeof(cl_mem), &pipeline->shadowDirs);
+	clSetKernelArg(pipeline->gatherShadow, 4, sizeof(cl_mem), &pipeline->shadowPixels);
+	clSetKernelArg(pipeline->gatherShadow, 5, sizeof(cl_mem), &pipeline->shadowColors);
+	clSetKernelArg(pipeline->gatherShadow, 6, sizeof(cl_mem), &pipeline->sortedOrigins);
+	clSetKernelArg(pipeline->gatherShadow, 7, sizeof(cl_mem), &pipeline->sortedDirs);
+	clSetKernelArg(pipeline->gatherShadow, 8, sizeof(cl_mem), &pipeline->sortedPixels);
+	clSetKernelArg(pipeline->gatherShadow, 9, sizeof(cl_mem), &pipeline->sortedColors);
+	if (error == CL_SUCCESS) error = Enqueue1D(queue, pipeline->gatherShadow, count);
+
+	// Kernel arguments are set per launch, so swapping is enough
+	std::swap(pipeline->shadowOrigins, pipeline->sortedOrigins);
+	std::swap(pipeline->shadowDirs, pipeline->sortedDirs);
+	std::swap(pipeline->shadowPixels, pipeline->sortedPixels);
+	std::swap(pipeline->shadowColors, pipeline->sortedColors);
+	return error;
+}
+
+cl_int RenderWavefront(WavefrontPipeline *pipeline, cl_command_queue queue, const SceneBuffers &scene, const FrameBuffers &frame,
+	bool persistent, bool sortRays){
+	cl_int error = CL_SUCCESS;
+	size_t pixels[2] = { (size_t)pipeline->width, (size_t)pipeline->height };
+
+	// Empty queues, the stages after Generate run over every slot and
+	// check the counters themselves, so no lengths are read back
+	static const cl_int zeros[WAVEFRONT_COUNTERS] = { 0 };
+	error = clEnqueueWriteBuffer(queue, pipeline->counters, CL_FALSE, 0, sizeof(zeros), zeros, 0, NULL, NULL);
+
+	clSetKernelArg(pipeline->generate, 0, sizeof(cl_mem), &pipeline->rayOrigins);
+	clSetKernelArg(pipeline->generate, 1, sizeof(cl_mem), &pipeline->rayDirs);
+	clSetKernelArg(pipeline->generate, 2, sizeof(cl_mem), &pipeline->rayPixels);
+	clSetKernelArg(pipeline->generate, 3, sizeof(cl_mem), &pipeline->colors);
+	clSetKernelArg(pipeline->generate, 4, sizeof(cl_mem), &pipeline->counters);
+	if (error == CL_SUCCESS) error = clEnqueueNDRangeKernel(queue, pipeline->generate, 2, NULL, pixels, NULL, 0, NULL, NULL);
+
+	cl_kernel extend = persistent ? pipeline->extendPersistent : pipeline->extend;
+	clSetKernelArg(extend, 0, sizeof(cl_mem), &pipeline->rayOrigins);
+	clSetKernelArg(extend, 1, sizeof(cl_mem), &pipeline->rayDirs);
+	clSetKernelArg(extend, 2, sizeof(cl_mem), &pipeline->hitFaces);
+	clSetKernelArg(extend, 3, sizeof(cl_mem), &pipeline->hitPoints);
+	clSetKernelArg(extend, 4, sizeof(cl_mem), &pipeline->counters);
+	SetSceneArgs(extend, 5, scene, true);
+	if (error == CL_SUCCESS) error = EnqueueStage(pipeline, queue, extend, persistent);
+
+	clSetKernelArg(pipeline->shade, 0, sizeof(cl_mem), &pipeline->rayOrigins);
+	clSetKernelArg(pipeline->shade, 1, sizeof(cl_mem), &pipeline->rayDirs);
+	clSetKernelArg(pipeline->shade, 2, sizeof(cl_mem), &pipeline->rayPixels);
+	clSetKernelArg(pipeline->shade, 3, sizeof(cl_mem), &pipeline->hitFaces);
+	clSetKernelArg(pipeline->shade, 4, sizeof(cl_mem), &pipeline->hitPoints);
+	clSetKernelArg(pipeline->shade, 5, sizeof(cl_mem), &pipeline->counters);
+	clSetKernelArg(pipeline->shade, 6, sizeof(cl_mem), &pipeline->shadowOrigins);
+	clSetKernelArg(pipeline->shade, 7, sizeof(cl_mem), &pipeline->shadowDirs);
+	clSetKernelArg(pipeline->shade, 8, sizeof(cl_mem), &pipeline->shadowPixels);
+	clSetKernelArg(pipeline->shade, 9, sizeof(cl_mem), &pipeline->shadowColors);
+	clSetKernelArg(pipeline->shade, 10, sizeof(cl_mem), &pipeline->colors);
+	SetSceneArgs(pipeline->shade, 11, scene, false);
+	if (error == CL_SUCCESS) error = EnqueueStage(pipeline, queue, pipeline->shade, false);
+
+	if (sortRays && error == CL_SUCCESS) error = EnqueueSortShadowRays(pipeline, queue);
+	if (error == CL_SUCCESS) error = EnqueueConnect(pipeline, queue, scene, persistent);
+
+	clSetKernelArg(pipeline->write, 0, sizeof(cl_mem), &frame.image);
+	clSetKernelArg(pipeline->write, 1, sizeof(cl_mem), &pipeline->colors);
+	clSetKernelArg(pipeline->write, 2, sizeof(cl_mem), &frame.accum);
+	clSetKernelArg(pipeline->write, 3, sizeof(cl_mem), &frame.sampleCounts);
+	if (error == CL_SUCCESS) error = clEnqueueNDRangeKernel(queue, pipeline->write, 2, NULL, pixels, NULL, 0, NULL, NULL);
+
+	if (error != CL_SUCCESS){
+		printf("OpenCL: Error enqueuing wavefront frame\n");
+	}
+	return error;
+}
+
+cl_int TimeShadowRays(WavefrontPipeline *pipeline, cl_command_queue queue, const SceneBuffers &scene, const FrameBuffers &frame, int runs,
+	double *regularMs, double *persistentMs){
+	// A frame fills the shadow queue
+	cl_int error = RenderWavefront(pipeline, queue, scene, frame, false, false);
+	clFinish(queue);
+
+	for (int persistent = 0; persistent < 2; persistent++){
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int run = 0; run < runs; run++){
+			if (persistent){
+				static const cl_int zero = 0;
+				if (error == CL_SUCCESS) error = clEnqueueWriteBuffer(queue, pipeline->counters, CL_FALSE, sizeof(cl_int) * WAVEFRONT_FETCH_SHADOW, sizeof(cl_int), &zero, 0, NULL, NULL);
+			}
+			if (error == CL_SUCCESS) error = EnqueueConnect(pipeline, queue, scene, persistent != 0);
+			clFinish(queue);
+		}
+		auto end = std::chrono::high_resolution_clock::now();
+
+		double ms = std::chrono::duration<double, std::milli>(end - start).count() / (runs > 0 ? runs : 1);
+		*(persistent ? persistentMs : regularMs) = ms;
+	}
+
+	// Every run added its light again
+	if (error == CL_SUCCESS) error = RenderWavefront(pipeline, queue, scene, frame, false, false);
+	clFinish(queue);
+	return error;
+}
+
+cl_int TimeRaySorting(WavefrontPipeline *pipeline, cl_command_queue queue, const SceneBuffers &scene, const FrameBuffers &frame, int runs,
+	double *unsortedRate, double *sortedRate){
+	cl_int error = RenderWavefront(pipeline, queue, scene, frame, false, false);
+	int rays = 0, shadowRays = 0;
+	if (error == CL_SUCCESS) error = WavefrontRayCounts(pipeline, queue, &rays, &shadowRays);
+
+	for (int sorted = 0; sorted < 2; sorted++){
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int run = 0; run < runs; run++){
+			if (sorted && error == CL_SUCCESS) error = EnqueueSortShadowRays(pipeline, queue);
+			if (error == CL_SUCCESS) error = EnqueueConnect(pipeline, queue, scene, false);
+			clFinish(queue);
+		}
+		auto end = std::chrono::high_resolution_clock::now();
+
+		double seconds = std::chrono::duration<double>(end - start).count();
+		*(sorted ? sortedRate : unsortedRate) = seconds > 0 ? (double)shadowRays * runs / seconds : 0.0;
+	}
+
+	if (error == CL_SUCCESS) error = RenderWavefront(pipeline, queue, scene, frame, false, false);
+	clFinish(queue);
+	return error;
+}
+
+cl_int WavefrontRayCounts(WavefrontPipeline *pipeline, cl_command_queue queue, int *rays, int *shadowRays){
+	cl_int counts[WAVEFRONT_COUNTERS];
+	cl_int error = clEnqueueReadBuffer(queue, pipeline->counters, CL_TRUE, 0, sizeof(counts), counts, 0, NULL, NULL);
+	*rays = counts[0];
+	*shadowRays = counts[1];
+	return error;
+}
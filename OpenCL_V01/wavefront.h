@@ -0,0 +1,112 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#ifdef __APPLE__
+#include "OpenCL/opencl.h"
+#else
+#include "CL/cl.h"
+#endif
+#include "lbvh.h"
+
+#define WAVEFRONT_COUNTERS 4 // queue lengths and fetch counters, matches kernels/image.cl
+#define WAVEFRONT_QUEUE_SHADOW 1
+#define WAVEFRONT_FETCH_SHADOW 3
+
+#define PERSISTENT_GROUP_SIZE 64
+#define PERSISTENT_GROUPS_PER_UNIT 4 // resident work-groups per compute unit
+
+// Scene buffers as the Filter kernel sees them (arguments 1-8)
+struct SceneBuffers
+{
+	cl_mem triangles;
+	cl_mem faceCount;
+	cl_mem faceMats;
+	cl_mem materials;
+	cl_mem nodes;
+	cl_mem links;
+	cl_mem tlasNodes;
+	cl_mem instances;
+};
+
+// Where a frame goes: the image shown and the per-pixel running sum and
+// sample count it is averaged from (Filter arguments 0, 9 and 10)
+struct FrameBuffers
+{
+	cl_mem image;
+	cl_mem accum;
+	cl_mem sampleCounts;
+};
+
+// Filter split into generate/extend/shade/connect stages (kernels/image.cl)
+// that pass rays through SoA queues in global memory, so each stage keeps
+// only the registers it needs and runs without the others' divergence.
+struct WavefrontPipeline
+{
+	cl_kernel generate;
+	cl_kernel extend;
+	cl_kernel shade;
+	cl_kernel connect;
+	cl_kernel write;
+	cl_kernel extendPersistent;
+	cl_kernel connectPersistent;
+	cl_kernel rayBounds;
+	cl_kernel rayKeys;
+	cl_kernel gatherShadow;
+
+	cl_mem rayOrigins;
+	cl_mem rayDirs;
+	cl_mem rayPixels;
+	cl_mem hitFaces;
+	cl_mem hitPoints;
+	cl_mem shadowOrigins;
+	cl_mem shadowDirs;
+	cl_mem shadowPixels;
+	cl_mem shadowColors;
+	cl_mem colors; // one float4 per pixel
+	cl_mem counters; // queue lengths, then where persistent kernels fetch next
+
+	// Shadow ray sorting, the gather swaps the sorted queue in
+	RadixSorter sorter;
+	cl_mem keys[2];
+	cl_mem ids[2];
+	cl_mem bounds;
+	cl_mem sortedOrigins;
+	cl_mem sortedDirs;
+	cl_mem sortedPixels;
+	cl_mem sortedColors;
+
+	int width;
+	int height;
+	size_t persistentGlobal;
+	size_t persistentLocal;
+};
+
+// Launch size that just fills the device, for kernels that fetch their own work
+void PersistentLaunchSize(cl_kernel kernel, cl_device_id device, size_t *global, size_t *local);
+
+cl_int CreateWavefrontPipeline(WavefrontPipeline *pipeline, cl_context context, cl_program program, cl_device_id device, int width, int height);
+void ReleaseWavefrontPipeline(WavefrontPipeline *pipeline);
+
+// Enqueue every stage of one frame, nothing is waited for. The frame adds
+// one sample to every pixel.
+// persistent runs the tracing stages as persistent kernels, sortRays
+// reorders shadow rays by origin and direction before they are traced.
+cl_int RenderWavefront(WavefrontPipeline *pipeline, cl_command_queue queue, const SceneBuffers &scene, const FrameBuffers &frame,
+	bool persistent, bool sortRays);
+
+// Trace the shadow rays (secondary rays) of a frame runs times with each
+// launch and report the mean ms, the frame is rendered again afterwards,
+// so the accumulated samples should be reset
+cl_int TimeShadowRays(WavefrontPipeline *pipeline, cl_command_queue queue, const SceneBuffers &scene, const FrameBuffers &frame, int runs,
+	double *regularMs, double *persistentMs);
+
+// Shadow rays per second of a frame traced runs times as they come and
+// runs times sorted first, the sort counting toward the time. The frame
+// is rendered again afterwards.
+cl_int TimeRaySorting(WavefrontPipeline *pipeline, cl_command_queue queue, const SceneBuffers &scene, const FrameBuffers &frame, int runs,
+	double *unsortedRate, double *sortedRate);
+
+// Queue lengths of the last frame, waits for it to finish
+cl_int WavefrontRayCounts(WavefrontPipeline *pipeline, cl_command_queue queue, int *rays, int *shadowRays);
+
+#endif